@@ -0,0 +1,58 @@
+import json
+import os
+import random
+
+import pytest
+
+from .generate import generate, load_storm
+
+
+def pytest_addoption(parser):
+	group = parser.getgroup("mpq")
+	group.addoption(
+		"--archives", help="directory written by generate.py, "
+		"instead of small archives generated for the run"
+	)
+	group.addoption("--storm", help="path of the StormLib shared library")
+
+
+class Context(object):
+	"""
+	The archives of a manifest written by generate.py, and samples of their
+	files for the benchmarks
+	"""
+	def __init__(self, directory, seed=0):
+		with open(os.path.join(directory, "manifest.json")) as f:
+			self.manifest = json.load(f)
+		self.base = self.manifest["base"]
+		self.patches = self.manifest["patches"]
+		rng = random.Random(seed)
+		small = self.manifest["small"]
+		self.small = rng.sample(small, min(1000, len(small)))
+		self.missing = [
+			"Data\\Missing\\File%06i.dat" % (i) for i in range(len(self.small))
+		]
+		self.large = self.manifest["large"]
+		self.patched = self.manifest["patched"][:1000]
+		self.seeks = [rng.random() for i in range(1000)]
+
+
+@pytest.fixture(scope="session")
+def ctx(request, tmp_path_factory):
+	directory = request.config.getoption("archives")
+	if directory is None:
+		directory = str(tmp_path_factory.mktemp("mpqbench"))
+		storm = load_storm(request.config.getoption("storm"))
+		generate(
+			directory, files=2000, large=2, large_size=16 << 20, patches=2,
+			storm=storm,
+		)
+	return Context(directory)
+
+
+@pytest.fixture(autouse=True)
+def parameters(request, ctx):
+	# Recorded in the JSON report, to compare runs on the same archives
+	if "benchmark" in request.fixturenames:
+		benchmark = request.getfixturevalue("benchmark")
+		benchmark.extra_info["archives"] = ctx.manifest["parameters"]
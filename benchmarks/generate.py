@@ -0,0 +1,204 @@
+#!/usr/bin/env python
+"""
+Builds synthetic MPQ archives for the benchmarks
+
+Archives are written through StormLib directly, with ctypes:
+
+	python benchmarks/generate.py OUTPUT [--files 5000] [--patches 2]
+
+OUTPUT receives base.MPQ, patch-1.MPQ... and manifest.json, which describes
+the archives and their files for the benchmarks.
+"""
+import argparse
+import ctypes
+import ctypes.util
+import json
+import os
+import random
+import sys
+
+
+COMPRESSIONS = {
+	"none": 0,
+	"huffmann": 0x01,
+	"zlib": 0x02,
+	"pkware": 0x08,
+	"bzip2": 0x10,
+	"lzma": 0x12,
+}
+
+MPQ_CREATE_LISTFILE = 0x00100000
+MPQ_CREATE_ATTRIBUTES = 0x00200000
+MPQ_CREATE_ARCHIVE_V2 = 0x01000000
+MPQ_FILE_COMPRESS = 0x00000200
+MPQ_FILE_REPLACEEXISTING = 0x80000000
+
+
+def load_storm(path=None):
+	"""
+	Loads StormLib from \a path, or from the library search path.
+	"""
+	path = path or ctypes.util.find_library("storm") or "libstorm.so"
+	storm = ctypes.CDLL(path)
+	handle = ctypes.c_void_p
+	storm.SFileCreateArchive.argtypes = [
+		ctypes.c_char_p, ctypes.c_uint32, ctypes.c_uint32, ctypes.POINTER(handle),
+	]
+	storm.SFileCreateArchive.restype = ctypes.c_bool
+	storm.SFileCreateFile.argtypes = [
+		handle, ctypes.c_char_p, ctypes.c_uint64, ctypes.c_uint32, ctypes.c_uint32,
+		ctypes.c_uint32, ctypes.POINTER(handle),
+	]
+	storm.SFileCreateFile.restype = ctypes.c_bool
+	storm.SFileWriteFile.argtypes = [
+		handle, ctypes.c_char_p, ctypes.c_uint32, ctypes.c_uint32,
+	]
+	storm.SFileWriteFile.restype = ctypes.c_bool
+	storm.SFileFinishFile.argtypes = [handle]
+	storm.SFileFinishFile.restype = ctypes.c_bool
+	storm.SFileCloseArchive.argtypes = [handle]
+	storm.SFileCloseArchive.restype = ctypes.c_bool
+	return storm
+
+
+def make_content(rng, size, ratio):
+	"""
+	Returns \a size bytes of which about \a ratio compress away.
+	"""
+	random_size = int(size * (1 - ratio))
+	data = b""
+	if random_size:
+		data = rng.getrandbits(8 * random_size).to_bytes(random_size, "little")
+	text = b"The quick brown fox jumps over the lazy dog. "
+	return (data + text * (size // len(text) + 1))[:size]
+
+
+def write_archive(storm, path, files, compression):
+	"""
+	Writes the archive \a path holding \a files, a dict of names to contents.
+	"""
+	if os.path.exists(path):
+		os.remove(path)
+	mpq = ctypes.c_void_p()
+	flags = MPQ_CREATE_ARCHIVE_V2 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES
+	# Room for the listfile and attributes, and a sparse hash table
+	count = max(len(files) * 2 + 16, 16)
+	created = storm.SFileCreateArchive(
+		os.fsencode(path), flags, count, ctypes.byref(mpq)
+	)
+	if not created:
+		raise OSError("Could not create %s" % (path))
+
+	file_flags = MPQ_FILE_REPLACEEXISTING
+	if compression:
+		file_flags |= MPQ_FILE_COMPRESS
+	for name, data in files.items():
+		file = ctypes.c_void_p()
+		created = storm.SFileCreateFile(
+			mpq, name.encode(), 0, len(data), 0, file_flags, ctypes.byref(file)
+		)
+		if not created:
+			raise OSError("Could not add %s to %s" % (name, path))
+		if not storm.SFileWriteFile(file, data, len(data), compression):
+			raise OSError("Could not write %s to %s" % (name, path))
+		storm.SFileFinishFile(file)
+	storm.SFileCloseArchive(mpq)
+
+
+def generate(
+	output, files=5000, min_size=64, max_size=16384, large=4,
+	large_size=8 << 20, compression="zlib", ratio=0.5, patches=0,
+	patch_fraction=0.05, seed=0, storm=None
+):
+	"""
+	Generates the archives in \a output and returns their manifest.
+	"""
+	storm = storm or load_storm()
+	rng = random.Random(seed)
+	codec = COMPRESSIONS[compression]
+	os.makedirs(output, exist_ok=True)
+
+	small = {}
+	for i in range(files):
+		name = "Data\\Dir%03i\\File%06i.dat" % (i % 100, i)
+		small[name] = make_content(rng, rng.randint(min_size, max_size), ratio)
+	big = {}
+	for i in range(large):
+		name = "Data\\Large\\Large%02i.dat" % (i)
+		big[name] = make_content(rng, large_size, ratio)
+
+	base = os.path.join(output, "base.MPQ")
+	write_archive(storm, base, dict(small, **big), codec)
+
+	patch_paths = []
+	patched = set()
+	for i in range(patches):
+		names = rng.sample(sorted(small), int(len(small) * patch_fraction))
+		patched.update(names)
+		path = os.path.join(output, "patch-%i.MPQ" % (i + 1))
+		contents = {
+			name: make_content(rng, len(small[name]), ratio) for name in names
+		}
+		write_archive(storm, path, contents, codec)
+		patch_paths.append(path)
+
+	manifest = {
+		"parameters": {
+			"files": files,
+			"min_size": min_size,
+			"max_size": max_size,
+			"large": large,
+			"large_size": large_size,
+			"compression": compression,
+			"ratio": ratio,
+			"patches": patches,
+			"patch_fraction": patch_fraction,
+			"seed": seed,
+		},
+		"base": base,
+		"patches": patch_paths,
+		"small": sorted(small),
+		"large": sorted(big),
+		"patched": sorted(patched),
+	}
+	with open(os.path.join(output, "manifest.json"), "w") as f:
+		json.dump(manifest, f, indent="\t")
+	return manifest
+
+
+def main(argv=None):
+	parser = argparse.ArgumentParser(
+		description="Builds synthetic MPQ archives for the benchmarks"
+	)
+	add = parser.add_argument
+	add("output", help="directory receiving the archives")
+	add("--files", type=int, default=5000, help="number of small files")
+	add("--min-size", type=int, default=64, help="smallest small file size")
+	add("--max-size", type=int, default=16384, help="largest small file size")
+	add("--large", type=int, default=4, help="number of large files")
+	add("--large-size", type=int, default=8 << 20, help="size of large files")
+	add("--compression", choices=sorted(COMPRESSIONS), default="zlib")
+	add(
+		"--ratio", type=float, default=0.5,
+		help="compressible fraction of each file",
+	)
+	add("--patches", type=int, default=0, help="length of the patch chain")
+	add(
+		"--patch-fraction", type=float, default=0.05,
+		help="fraction of small files each patch replaces",
+	)
+	add("--seed", type=int, default=0)
+	add("--storm", help="path of the StormLib shared library")
+	args = parser.parse_args(argv)
+
+	manifest = generate(
+		args.output, args.files, args.min_size, args.max_size, args.large,
+		args.large_size, args.compression, args.ratio, args.patches,
+		args.patch_fraction, args.seed, load_storm(args.storm),
+	)
+	json.dump(manifest["parameters"], sys.stdout, indent="\t")
+	print()
+
+
+if __name__ == "__main__":
+	main()
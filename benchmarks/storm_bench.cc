@@ -0,0 +1,260 @@
+/*
+ * Benchmarks of StormLib itself, without the bindings
+ *
+ * Times the calls the pytest-benchmark suite makes through the bindings, on
+ * the archives written by generate.py, so that the difference between the two
+ * is the cost of the bindings. Built by `python setup.py build_bench`:
+ *
+ *	build/storm_bench ARCHIVES [--repeat 5]
+ *
+ * ARCHIVES is the directory holding manifest.json; the base archive and its
+ * patches are read from their conventional names there. Results are printed
+ * as JSON, with the minimum, median and mean of the rounds of each benchmark.
+ */
+#include <StormLib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+	struct Result {
+		std::string name;
+		size_t operations;
+		std::vector<double> seconds;
+	};
+
+	double now() {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	//! Runs \a fn \a repeat times, each making \a operations calls
+	Result measure(char const *name, size_t operations, unsigned int repeat, std::function<void()> const& fn) {
+		Result result = {name, operations, {}};
+		for (unsigned int i = 0; i < repeat; ++i) {
+			double start = now();
+			fn();
+			result.seconds.push_back(now() - start);
+		}
+		return result;
+	}
+
+	bool exists(std::string const& path) {
+		FILE *file = fopen(path.c_str(), "rb");
+		if (file) {
+			fclose(file);
+		}
+		return file != NULL;
+	}
+
+	bool open_archive(std::string const& path, HANDLE *mpq) {
+		if (!SFileOpenArchive(path.c_str(), 0, MPQ_OPEN_READ_ONLY, mpq)) {
+			fprintf(stderr, "storm_bench: could not open %s\n", path.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	struct Listed {
+		std::string name;
+		DWORD size;
+	};
+
+	std::vector<Listed> list_files(HANDLE mpq) {
+		std::vector<Listed> files;
+		SFILE_FIND_DATA data;
+		HANDLE find = SFileFindFirstFile(mpq, "*", &data, NULL);
+		if (!find) {
+			return files;
+		}
+		do {
+			Listed listed = {data.cFileName, data.dwFileSize};
+			files.push_back(listed);
+		} while (SFileFindNextFile(find, &data));
+		SFileFindClose(find);
+		return files;
+	}
+
+	//! Reads the rest of \a file into \a buffer
+	void read_rest(HANDLE file, std::vector<char> *buffer) {
+		DWORD high;
+		DWORD size = SFileGetFileSize(file, &high);
+		if (size == SFILE_INVALID_SIZE) {
+			return;
+		}
+		buffer->resize(std::max<size_t>(size, 1));
+		DWORD bytesRead;
+		SFileReadFile(file, buffer->data(), size, &bytesRead, NULL);
+	}
+
+	void read_files(HANDLE mpq, std::vector<std::string> const& names, DWORD scope) {
+		std::vector<char> buffer;
+		for (std::string const& name : names) {
+			HANDLE file;
+			if (SFileOpenFileEx(mpq, name.c_str(), scope, &file)) {
+				read_rest(file, &buffer);
+				SFileCloseFile(file);
+			}
+		}
+	}
+
+	double median(std::vector<double> values) {
+		std::sort(values.begin(), values.end());
+		size_t middle = values.size() / 2;
+		return values.size() % 2 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+	}
+
+	std::string json_string(std::string const& value) {
+		std::string result = "\"";
+		for (char c : value) {
+			if (c == '"' || c == '\\') {
+				result += '\\';
+			}
+			result += c;
+		}
+		return result + '"';
+	}
+
+	void print_json(std::string const& archives, unsigned int repeat, std::vector<Result> const& results) {
+		printf("{\n\t\"archives\": %s,\n\t\"repeat\": %u,\n\t\"benchmarks\": [", json_string(archives).c_str(), repeat);
+		for (size_t i = 0; i < results.size(); ++i) {
+			Result const& result = results[i];
+			double best = *std::min_element(result.seconds.begin(), result.seconds.end());
+			double total = 0;
+			for (double seconds : result.seconds) {
+				total += seconds;
+			}
+			printf("%s\n\t\t{\"name\": %s, \"operations\": %zu, \"min\": %.9f, \"median\": %.9f, \"mean\": %.9f, \"ops\": %.1f}",
+				i ? "," : "", json_string(result.name).c_str(), result.operations, best, median(result.seconds),
+				total / result.seconds.size(), best > 0 ? result.operations / best : 0.0);
+		}
+		printf("\n\t]\n}\n");
+	}
+}
+
+int main(int argc, char **argv) {
+	std::string archives;
+	unsigned int repeat = 5;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+			repeat = std::max(atoi(argv[++i]), 1);
+		} else if (archives.empty() && argv[i][0] != '-') {
+			archives = argv[i];
+		} else {
+			archives.clear();
+			break;
+		}
+	}
+	if (archives.empty()) {
+		fprintf(stderr, "usage: %s ARCHIVES [--repeat N]\n", argv[0]);
+		return 2;
+	}
+
+	std::string base = archives + "/base.MPQ";
+	std::vector<std::string> patches;
+	for (int i = 1; exists(archives + "/patch-" + std::to_string(i) + ".MPQ"); ++i) {
+		patches.push_back(archives + "/patch-" + std::to_string(i) + ".MPQ");
+	}
+	HANDLE mpq;
+	if (!open_archive(base, &mpq)) {
+		return 1;
+	}
+
+	/* Samples like those of the pytest-benchmark suite, files under 1 MiB being small */
+	std::vector<Listed> listed = list_files(mpq);
+	std::vector<std::string> small, large, missing;
+	for (Listed const& file : listed) {
+		if (file.name[0] == '(') {
+			continue;
+		}
+		(file.size < (1 << 20) ? small : large).push_back(file.name);
+	}
+	std::mt19937 rng(0);
+	std::shuffle(small.begin(), small.end(), rng);
+	small.resize(std::min<size_t>(small.size(), 1000));
+	for (size_t i = 0; i < small.size(); ++i) {
+		char name[64];
+		snprintf(name, sizeof(name), "Data\\Missing\\File%06zu.dat", i);
+		missing.push_back(name);
+	}
+
+	std::vector<Result> results;
+	results.push_back(measure("open_archive", 1, repeat, [&] {
+		HANDLE other;
+		if (open_archive(base, &other)) {
+			SFileCloseArchive(other);
+		}
+	}));
+	results.push_back(measure("has_file", small.size() + missing.size(), repeat, [&] {
+		for (std::string const& name : small) {
+			SFileHasFile(mpq, name.c_str());
+		}
+		for (std::string const& name : missing) {
+			SFileHasFile(mpq, name.c_str());
+		}
+	}));
+	results.push_back(measure("enumerate_files", listed.size(), repeat, [&] { list_files(mpq); }));
+	results.push_back(measure("read_small", small.size(), repeat, [&] { read_files(mpq, small, SFILE_OPEN_FROM_MPQ); }));
+	if (!large.empty()) {
+		results.push_back(measure("read_large", large.size(), repeat, [&] { read_files(mpq, large, SFILE_OPEN_FROM_MPQ); }));
+
+		HANDLE file;
+		if (SFileOpenFileEx(mpq, large[0].c_str(), SFILE_OPEN_FROM_MPQ, &file)) {
+			DWORD size = SFileGetFileSize(file, NULL);
+			std::uniform_real_distribution<double> position;
+			std::vector<LONG> seeks;
+			for (int i = 0; i < 1000; ++i) {
+				seeks.push_back((LONG)(position(rng) * size));
+			}
+			std::vector<char> buffer(4096);
+			results.push_back(measure("seek", seeks.size(), repeat, [&] {
+				for (LONG seek : seeks) {
+					DWORD bytesRead;
+					SFileSetFilePointer(file, seek, NULL, FILE_BEGIN);
+					SFileReadFile(file, buffer.data(), (DWORD)buffer.size(), &bytesRead, NULL);
+				}
+			}));
+			SFileCloseFile(file);
+		}
+	}
+	if (!patches.empty()) {
+		HANDLE patched;
+		if (!open_archive(base, &patched)) {
+			return 1;
+		}
+		/* The files replaced by the patches */
+		std::vector<std::string> names;
+		for (std::string const& patch : patches) {
+			SFileOpenPatchArchive(patched, patch.c_str(), NULL, 0);
+			HANDLE other;
+			if (open_archive(patch, &other)) {
+				for (Listed const& file : list_files(other)) {
+					if (file.name[0] != '(' && names.size() < 1000) {
+						names.push_back(file.name);
+					}
+				}
+				SFileCloseArchive(other);
+			}
+		}
+		results.push_back(measure("read_patched", names.size(), repeat, [&] { read_files(patched, names, SFILE_OPEN_FROM_MPQ); }));
+		SFileCloseArchive(patched);
+	}
+	std::string scratch = archives + "/storm_bench.tmp";
+	results.push_back(measure("extract", small.size(), repeat, [&] {
+		for (std::string const& name : small) {
+			SFileExtractFile(mpq, name.c_str(), scratch.c_str(), SFILE_OPEN_FROM_MPQ);
+		}
+	}));
+	remove(scratch.c_str());
+
+	SFileCloseArchive(mpq);
+	print_json(archives, repeat, results);
+	return 0;
+}
@@ -0,0 +1,250 @@
+"""
+Benchmarks of the storm bindings, run with pytest-benchmark
+
+	python benchmarks/generate.py /tmp/mpqbench --files 5000 --patches 2
+	pytest benchmarks --archives /tmp/mpqbench --benchmark-json results.json
+
+Without --archives, small archives are generated for the run. Each benchmark
+records the number of operations of one round in its extra_info.
+"""
+import os
+import shutil
+import tempfile
+import threading
+
+import pytest
+
+import mpq
+from mpq import storm
+
+
+def operations(benchmark, count):
+	benchmark.extra_info["operations"] = count
+
+
+def test_open_archive(benchmark, ctx):
+	operations(benchmark, 1)
+	benchmark(lambda: storm.Archive(ctx.base).close())
+
+
+def test_has_file(benchmark, ctx):
+	with storm.Archive(ctx.base) as archive:
+		def run():
+			for name in ctx.small:
+				archive.has_file(name)
+			for name in ctx.missing:
+				archive.has_file(name)
+		operations(benchmark, len(ctx.small) + len(ctx.missing))
+		benchmark(run)
+
+
+def test_tell(benchmark, ctx):
+	# Binding overhead: StormLib answers from memory
+	with storm.Archive(ctx.base) as archive:
+		with archive.open_file(ctx.small[0]) as file:
+			operations(benchmark, 1)
+			benchmark(file.tell)
+
+
+def test_contains(benchmark, ctx):
+	with mpq.MPQFile(ctx.base) as f:
+		f._name_index()
+
+		def run():
+			for name in ctx.small:
+				name in f
+			for name in ctx.missing:
+				name in f
+		operations(benchmark, len(ctx.small) + len(ctx.missing))
+		benchmark(run)
+
+
+def test_enumerate_files(benchmark, ctx):
+	with storm.Archive(ctx.base) as archive:
+		operations(benchmark, len(archive.list().name))
+		benchmark(archive.list)
+
+
+def test_listdir(benchmark, ctx):
+	with mpq.MPQFile(ctx.base) as f:
+		f.listdir()  # builds the directory tree
+		directories = sorted({name.rpartition("\\")[0] for name in ctx.small})
+
+		def run():
+			for directory in directories:
+				f.listdir(directory)
+		operations(benchmark, len(directories))
+		benchmark(run)
+
+
+def test_glob(benchmark, ctx):
+	with mpq.MPQFile(ctx.base) as f:
+		f.listdir()
+		patterns = [
+			name.rpartition("\\")[0] + "\\*.dat" for name in ctx.small[:100]
+		]
+
+		def run():
+			for pattern in patterns:
+				f.glob(pattern)
+		operations(benchmark, len(patterns))
+		benchmark(run)
+
+
+def test_match_names(benchmark, ctx):
+	with storm.Archive(ctx.base) as archive:
+		names = ctx.small + ctx.missing
+		candidates = "".join(name + "\n" for name in names).encode() * 100
+		operations(benchmark, len(names) * 100)
+		benchmark(archive.match_names, candidates)
+
+
+def test_read_small(benchmark, ctx):
+	with mpq.MPQFile(ctx.base) as f:
+		f._name_index()
+
+		def run():
+			for name in ctx.small:
+				f.read(name)
+		operations(benchmark, len(ctx.small))
+		benchmark(run)
+
+
+def test_read_many(benchmark, ctx):
+	with mpq.MPQFile(ctx.base) as f:
+		f._name_index()
+		operations(benchmark, len(ctx.small))
+		benchmark(f.read_many, ctx.small)
+
+
+def test_read_many_threads(benchmark, ctx):
+	with mpq.MPQFile(ctx.base) as f:
+		f._name_index()
+		operations(benchmark, len(ctx.small))
+		benchmark(f.read_many, ctx.small, False, os.cpu_count() or 1)
+
+
+@pytest.mark.parametrize("threads", [1, 2, 4])
+def test_read_small_threads(benchmark, ctx, threads):
+	# Threads reading on their own archive, to compare the throughput of runs
+	# with more threads: the GIL is released around StormLib calls
+	archives = [mpq.MPQFile(ctx.base) for i in range(threads)]
+	for f in archives:
+		f._name_index()
+
+	def read(f):
+		for name in ctx.small:
+			f.read(name)
+
+	def run():
+		workers = [
+			threading.Thread(target=read, args=(f, )) for f in archives[1:]
+		]
+		for worker in workers:
+			worker.start()
+		read(archives[0])
+		for worker in workers:
+			worker.join()
+
+	benchmark.extra_info["threads"] = threads
+	operations(benchmark, threads * len(ctx.small))
+	try:
+		benchmark(run)
+	finally:
+		for f in archives:
+			f.close()
+
+
+@pytest.mark.parametrize("parallel", [False, True])
+def test_read_large(benchmark, ctx, parallel):
+	with mpq.MPQFile(ctx.base) as f:
+		f.parallel_read(1 << 20 if parallel else 0)
+
+		def run():
+			for name in ctx.large:
+				f.read(name)
+		operations(benchmark, len(ctx.large))
+		benchmark(run)
+
+
+def test_seek(benchmark, ctx):
+	if not ctx.large:
+		pytest.skip("no large files")
+	with mpq.MPQFile(ctx.base) as f, f.open(ctx.large[0]) as file:
+		size = file.size()
+
+		def run():
+			for position in ctx.seeks:
+				file.seek(int(position * size))
+				file.read(4096)
+		operations(benchmark, len(ctx.seeks))
+		benchmark(run)
+
+
+def patched_file(ctx):
+	if not ctx.patches:
+		pytest.skip("no patches")
+	f = mpq.MPQFile(ctx.base)
+	for patch in ctx.patches:
+		f.patch(patch)
+	f._name_index()
+	return f
+
+
+def test_read_patched(benchmark, ctx):
+	with patched_file(ctx) as f:
+		def run():
+			for name in ctx.patched:
+				with f.open(name, patched=True) as file:
+					file.read()
+		operations(benchmark, len(ctx.patched))
+		benchmark(run)
+
+
+def test_read_materialized(benchmark, ctx):
+	with patched_file(ctx) as f:
+		f.materialize()
+
+		def run():
+			for name in ctx.patched:
+				f.read(name, True)
+		operations(benchmark, len(ctx.patched))
+		benchmark(run)
+
+
+@pytest.fixture
+def directory():
+	path = tempfile.mkdtemp()
+	yield path
+	shutil.rmtree(path)
+
+
+def test_extract(benchmark, ctx, directory):
+	with mpq.MPQFile(ctx.base) as f:
+		f._name_index()
+		operations(benchmark, len(ctx.small))
+		benchmark(f.extract_all, directory, ctx.small)
+
+
+def drop_cache(path):
+	# Evicts the archive from the page cache, for cold-cache runs
+	if hasattr(os, "posix_fadvise"):
+		fd = os.open(path, os.O_RDONLY)
+		try:
+			os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+		finally:
+			os.close(fd)
+
+
+@pytest.mark.parametrize("advised", [False, True])
+@pytest.mark.parametrize("extract", [False, True])
+def test_scan_cold(benchmark, ctx, directory, advised, extract):
+	# Extracts or verifies every file, the archive starting out of the cache
+	if not hasattr(os, "posix_fadvise"):
+		pytest.skip("cannot drop the page cache")
+	with mpq.MPQFile(ctx.base) as f:
+		if advised:
+			f.advise(storm.ADVISE_WILLNEED | storm.ADVISE_DONTNEED)
+		operations(benchmark, len(f.namelist()))
+		run = (lambda: f.extract_all(directory)) if extract else f.testmpq
+		benchmark.pedantic(run, setup=lambda: drop_cache(ctx.base), rounds=3)
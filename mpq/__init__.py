@@ -1,7 +1,12 @@
 """
 Python wrapper around Storm C API bindings
 """
+import asyncio
+import io
 import os
+import posixpath
+from array import array
+from datetime import datetime, timedelta
 
 import pkg_resources
 
@@ -17,93 +22,254 @@ class MPQFile(object):
 	"""
 	ATTRIBUTES = "(attributes)"
 	LISTFILE = "(listfile)"
-
-	def __init__(self, name=None, flags=0):
+	# Bound on the asynchronous requests in flight per event loop
+	MAX_IN_FLIGHT = 64
+	# Scope the files are opened with when patched
+	PATCHED_SCOPE = 1
+	# Files written by StormLib itself, left out of flattened archives
+	SPECIAL_FILES = (ATTRIBUTES, LISTFILE, "(signature)")
+
+	def __init__(
+		self, name=None, flags=storm.MPQ_OPEN_READ_ONLY, mmap=False, cache=None,
+		lazy=False
+	):
 		self.paths = []
+		# storm.Cache shared by reads, if any
+		self.cache = cache
 		self._archives = []
 		self._archive_names = {}
+		self._listfile = None
+		self._index = None
+		self._patch_indexes = {}
+		# Patched files read into memory by materialize(), by normalized name
+		self._patched = {}
+		# Asynchronous request dispatchers, by event loop
+		self._dispatchers = {}
 		if name is not None:
-			self.add_archive(name, flags)
+			self.add_archive(name, flags, mmap, lazy)
 
 	def __contains__(self, name):
-		for mpq in self._archives:
-			if storm.SFileHasFile(mpq, name):
-				return True
-		return False
+		return self._archive_contains(name) is not None
+
+	def __enter__(self):
+		return self
+
+	def __exit__(self, *args):
+		self.close()
 
 	def __repr__(self):
 		return "<%s paths=%r>" % (self.__class__.__name__, self.paths)
 
 	def _archive_contains(self, name):
-		for mpq in self._archives:
-			if storm.SFileHasFile(mpq, name):
-				return mpq
+		# Until something lists the archives, known names are looked up in
+		# each of them: building the index loads and lists every archive
+		if self._index is None:
+			for mpq in self._archives:
+				if mpq.has_file(name):
+					return mpq
+			return None
+		return self._index.get(name)
+
+	def _dispatcher(self):
+		# Each loop gets its own pool, collecting only its own requests.
+		# Those of closed loops are shut down.
+		for loop in list(self._dispatchers):
+			if loop.is_closed():
+				dispatcher = self._dispatchers.pop(loop, None)
+				if dispatcher is not None:
+					dispatcher.close()
+		loop = asyncio.get_event_loop()
+		dispatcher = self._dispatchers.get(loop)
+		if dispatcher is None:
+			limit = self.MAX_IN_FLIGHT
+			try:
+				dispatcher = _AsyncDispatcher(storm.Pool(), loop, limit)
+			except NotImplementedError:
+				# Windows: run blocking calls on the loop's executor
+				dispatcher = _ExecutorDispatcher(_ExecutorPool(), loop, limit)
+			self._dispatchers[loop] = dispatcher
+		return dispatcher
+
+	def _patch_index(self, mpq):
+		index = self._patch_indexes.get(mpq)
+		if index is None:
+			index = self._patch_indexes[mpq] = storm.PatchIndex(mpq, self.PATCHED_SCOPE)
+		return index
+
+	def _patched_scope(self, mpq, name):
+		# Files no patch touches read the same from the base archive alone
+		if self._patch_index(mpq).get(name) == 0:
+			return storm.SFILE_OPEN_BASE_FILE
+		return self.PATCHED_SCOPE
+
+	def _name_index(self):
+		if self._index is None:
+			self._index = storm.NameIndex(self._archives)
+		return self._index
 
 	def _regenerate_listfile(self):
-		self._listfile = []
-		for mpq in self._archives:
-			handle, file = storm.SFileFindFirstFile(mpq, "", "*")
-			while True:
-				self._listfile.append(file.replace("\\", "/"))
-				try:
-					file = storm.SFileFindNextFile(handle)
-				except storm.NoMoreFilesError:
-					break
-
-	def add_archive(self, name, flags=0):
+		self._set_listing([mpq.list("*") for mpq in self._archives])
+
+	def _set_listing(self, listings):
+		self._listing = listings
+		self._listfile = [
+			name.replace("\\", "/")
+			for listing in self._listing for name in listing.name
+		]
+
+	def _archive_paths(self):
+		paths = [self._archive_names[mpq] for mpq in self._archives]
+		if None in paths or self.is_patched():
+			raise ValueError(
+				"Sidecar indexes need unpatched archives opened from files"
+			)
+		return paths
+
+	def add_archive(
+		self, name, flags=storm.MPQ_OPEN_READ_ONLY, mmap=False, lazy=False
+	):
 		"""
-		Adds an archive to the MPQFile
+		Adds an archive to the MPQFile, opened with the storm.MPQ_OPEN_* \a flags.
+		\a name is either a path or an object supporting the buffer protocol
+		(bytes, bytearray, mmap, memoryview) holding the whole archive.
+		If \a mmap is True, the archive file is memory-mapped instead of read.
+		If \a lazy is True, its listfile and attributes are only loaded once
+		listing files or reading their attributes needs them.
 		"""
-		priority = 0  # Unused by StormLib
-		mpq = storm.SFileOpenArchive(name, priority, flags)
+		if mmap:
+			flags |= storm.BASE_PROVIDER_MAP
+		if isinstance(name, str):
+			priority = 0  # Unused by StormLib
+			mpq = storm.Archive(name, priority, flags, lazy)
+			self._archive_names[mpq] = name
+		else:
+			mpq = storm.Archive.from_buffer(name, flags, lazy)
+			self._archive_names[mpq] = None
+			name = mpq.name
 		self._archives.append(mpq)
-		self._archive_names[mpq] = name
 		self.paths.append(name)
-		self._listfile = []
+		self._listfile = None
+		self._index = None
+		self._patched = {}
+
+	def advise(self, advice, window=32 << 20):
+		"""
+		Sets the page cache hints (storm.ADVISE_*) given when extracting,
+		verifying or reading many files of the archives at once.
+		With storm.ADVISE_WILLNEED, \a window bytes ahead of the reads are
+		fetched in advance.
+		"""
+		for mpq in self._archives:
+			mpq.advise(advice, window)
+
+	def parallel_read(self, threshold, threads=0):
+		"""
+		Sets the size from which reads of compressed files decompress their
+		sectors on \a threads threads (0 for one per core), straight into
+		the result. A \a threshold of 0 always reads serially.
+		"""
+		for mpq in self._archives:
+			mpq.parallel_read(threshold, threads)
 
 	def close(self):
 		"""
-		Flushes all archives in the MPQFile
+		Closes all archives in the MPQFile, along with their open files
 		"""
+		for dispatcher in self._dispatchers.values():
+			dispatcher.close()
+		self._dispatchers.clear()
 		for mpq in self._archives:
-			storm.SFileCloseArchive(mpq)
+			mpq.close()
 
 	def flush(self):
 		"""
 		Flushes all archives in the MPQFile
 		"""
 		for mpq in self._archives:
-			storm.SFileFlushArchive(mpq)
+			mpq.flush()
 
 	def getinfo(self, f):
 		"""
 		Returns a MPQInfo object for either a path or a MPQExtFile object.
 		"""
 		if isinstance(f, str):
-			f = self.open(f.replace("/", "\\"))
-		return MPQInfo(f)
+			name = f.replace("/", "\\")
+			mpq = self._archive_contains(name)
+			if not mpq:
+				raise KeyError("There is no item named %r in the archive" % (f))
+			return MPQInfo.from_archive(mpq, name)
+		return MPQInfo.from_file(f)
+
+	def glob(self, *patterns):
+		"""
+		Returns the names of the files matching any of the glob \a patterns,
+		sorted. ? and * match within a directory, ** across directories: a/**/b
+		matches a/b too.
+		"""
+		return self._name_index().glob(patterns, "/")
 
 	def infolist(self):
 		"""
 		Returns a list of class MPQInfo instances for files in all the archives
-		in the MPQFile.
+		in the MPQFile. No file is opened.
 		"""
-		return [self.getinfo(x) for x in self.namelist()]
+		if self._listfile is None:
+			self._regenerate_listfile()
+		return [
+			info for listing in self._listing
+			for info in MPQInfo.from_list(listing)
+		]
 
 	def is_patched(self):
 		"""
 		Returns whether at least one of the archives in the MPQFile has been patched.
 		"""
 		for mpq in self._archives:
-			if storm.SFileIsPatchedArchive(mpq):
+			if mpq.is_patched():
 				return True
 		return False
 
+	def listdir(self, path=""):
+		"""
+		Returns the subdirectories, then the files, of the directory \a path.
+		Raises a KeyError if no file is in \a path.
+		"""
+		return self._name_index().listdir(path)
+
+	def load_index(self, path, update=False):
+		"""
+		Loads the listing of the archives from the sidecar index at \a path
+		(see mpq.sidecar) instead of enumerating them.
+		Returns whether the index could be used. If it is missing or out of
+		date and \a update is True, it is rebuilt.
+		"""
+		from . import sidecar
+
+		listings = sidecar.read(path, self._archive_paths())
+		if listings is None:
+			if update:
+				self.save_index(path)
+			return False
+		self._set_listing(listings)
+		self._index = storm.NameIndex(self._archives, listings)
+		return True
+
+	def save_index(self, path):
+		"""
+		Writes the sidecar index of the archives to \a path.
+		"""
+		from . import sidecar
+
+		archives = self._archive_paths()
+		if self._listfile is None:
+			self._regenerate_listfile()
+		sidecar.write(path, archives, self._listing)
+
 	def namelist(self):
 		"""
 		Returns a list of file names in all the archives in the MPQFile.
 		"""
-		if not self._listfile:
+		if self._listfile is None:
 			self._regenerate_listfile()
 		return self._listfile
 
@@ -112,29 +278,115 @@ class MPQFile(object):
 		Return file-like object for \a name in mode \a mode.
 		If \a name is an int, it is treated as an index within the MPQFile.
 		If \a patched is True, the file will be opened fully patched,
-		otherwise unpatched.
+		otherwise unpatched. Files no patch touches are opened from the base
+		archive, without going through the patch chain.
 		Raises a KeyError if no file matches \a name.
 		"""
 		if isinstance(name, int):
 			name = "File%08x.xxx" % (int)
 
-		scope = int(bool(patched))
-
 		mpq = self._archive_contains(name)
 		if not mpq:
 			raise KeyError("There is no item named %r in the archive" % (name))
 
-		return MPQExtFile(storm.SFileOpenFileEx(mpq, name, scope), name)
+		scope = self._patched_scope(mpq, name) if patched else 0
+		return MPQExtFile(mpq.open_file(name, scope), name, self.cache, scope)
+
+	def path(self, at=""):
+		"""
+		Returns an MPQPath to \a at, to go through the archives like a zipfile.Path.
+		"""
+		return MPQPath(self, at)
 
 	def patch(self, name, prefix=None, flags=0):
 		"""
 		Patches all archives in the MPQFile with \a name under prefix \a prefix.
 		"""
 		for mpq in self._archives:
-			storm.SFileOpenPatchArchive(mpq, name, prefix, flags)
+			mpq.patch(name, prefix, flags)
+
+		# invalidate the listfile, name index and patched files in memory
+		# (patch indexes notice on their own)
+		self._listfile = None
+		self._index = None
+		self._patched = {}
+
+	def patch_layer(self, name):
+		"""
+		Returns the layer supplying the patched content of \a name: 0 for
+		the base archive, i for the i-th patch applied with patch().
+		Layers are looked up once and kept until the next patch().
+		Raises a KeyError if no file matches \a name.
+		"""
+		mpq = self._archive_contains(name)
+		if not mpq:
+			raise KeyError("There is no item named %r in the archive" % (name))
+		return self._patch_index(mpq)[name]
+
+	def _patched_files(self):
+		# Yields (archive, {name: layer}) for the files each archive supplies first
+		seen = set()
+		for mpq in self._archives:
+			layers = {}
+			for name, layer in self._patch_index(mpq).resolve().items():
+				key = _normalize(name)
+				if key not in seen:
+					seen.add(key)
+					layers[name] = layer
+			yield mpq, layers
+
+	def match_names(self, names, threads=0):
+		"""
+		Returns the candidate \a names found in the hash table of any of the
+		archives, without a listfile. \a names is an iterable of str, or bytes
+		holding a name per line (returned as bytes). Names are hashed on
+		\a threads threads (0 for one per core).
+		"""
+		if not isinstance(names, (str, bytes, bytearray, memoryview)):
+			names = list(names)
+		found = {}
+		for mpq in self._archives:
+			for name in mpq.match_names(names, threads):
+				found[name] = None
+		return list(found)
 
-		# invalidate the listfile
-		self._listfile = []
+	def materialize(self, threads=1):
+		"""
+		Reads every file a patch touches fully patched into memory, on
+		\a threads threads per archive. Patched reads through read() are
+		then served from memory until the next patch().
+		Returns the number of files read.
+		"""
+		patched = {}
+		for mpq, layers in self._patched_files():
+			names = [name for name, layer in layers.items() if layer]
+			if names:
+				contents = mpq.read_many(names, self.PATCHED_SCOPE, threads)
+				for name, data in contents.items():
+					patched[_normalize(name)] = data
+		self._patched = patched
+		return len(patched)
+
+	def flatten(
+		self, path, threads=0,
+		flags=storm.MPQ_FILE_COMPRESS | storm.MPQ_FILE_REPLACEEXISTING,
+		compression=storm.MPQ_COMPRESSION_ZLIB
+	):
+		"""
+		Writes every file of the MPQFile, fully patched, to a new archive at
+		\a path with storm.ArchiveBuilder, on \a threads threads (one per
+		core by default). Files are compressed with \a flags and \a compression.
+		Returns a MPQFile on the new archive, which needs no patching.
+		"""
+		builder = storm.ArchiveBuilder(path)
+		for mpq, layers in self._patched_files():
+			for name, layer in layers.items():
+				if name in self.SPECIAL_FILES:
+					continue
+				scope = self.PATCHED_SCOPE if layer else storm.SFILE_OPEN_BASE_FILE
+				builder.copy(mpq, name, None, flags, compression, scope)
+		builder.build(threads)
+		return self.__class__(path, cache=self.cache)
 
 	def extract(self, name, path=".", patched=False):
 		"""
@@ -146,7 +398,77 @@ class MPQFile(object):
 		mpq = self._archive_contains(name)
 		if not mpq:
 			raise KeyError("There is no item named %r in the archive" % (name))
-		storm.SFileExtractFile(mpq, name, path, scope)
+		if patched:
+			scope = self._patched_scope(mpq, name)
+		mpq.extract(name, path, scope)
+
+	async def extract_async(self, name, path=".", patched=False):
+		"""
+		Coroutine extracting \a name to \a path on a worker thread,
+		see extract().
+		"""
+		scope = int(bool(patched))
+		mpq = self._archive_contains(name)
+		if not mpq:
+			raise KeyError("There is no item named %r in the archive" % (name))
+		dispatcher = self._dispatcher()
+		await dispatcher.submit(dispatcher.pool.extract, mpq, name, path, scope)
+
+	def extract_all(
+		self, path=".", names=None, patched=False, threads=0, progress=None
+	):
+		"""
+		Extracts \a names, or every file in the MPQFile, under \a path on
+		\a threads threads (one per core by default). Each thread opens its
+		own handle on the archives.
+		If \a patched is True, files will be extracted fully patched,
+		otherwise unpatched.
+		\a progress, if given, is called as progress(name, done, total)
+		after each file, from the calling thread.
+		Returns a dict of the names that could not be extracted to their
+		StormLib error code (storm.ERROR_*); it is empty on success.
+		"""
+		scope = int(bool(patched))
+		errors = {}
+		batches = [(mpq, []) for mpq in self._archives]
+		if names is None:
+			if self._listfile is None:
+				self._regenerate_listfile()
+			seen = set()
+			for (mpq, batch), listing in zip(batches, self._listing):
+				batch += [name for name in listing.name if name not in seen]
+				seen.update(batch)
+		else:
+			index = self._name_index()
+			archives = dict(batches)
+			seen = set()
+			for name in names:
+				# Spellings of one file would be written by two workers at once
+				key = _normalize(name)
+				if key in seen:
+					continue
+				seen.add(key)
+				mpq = index.get(name)
+				if mpq is None:
+					errors[name] = storm.ERROR_FILE_NOT_FOUND
+				else:
+					archives[mpq].append(name)
+
+		total = sum(len(batch) for mpq, batch in batches)
+		done = 0
+		for mpq, batch in batches:
+			if not batch:
+				continue
+			if progress is None:
+				callback = None
+			else:
+				def callback(name, count, _, offset=done):
+					progress(name, offset + count, total)
+			errors.update(
+				mpq.extract_all(path, batch, scope, threads, callback)
+			)
+			done += len(batch)
+		return errors
 
 	def printdir(self):
 		"""
@@ -161,63 +483,445 @@ class MPQFile(object):
 		for x in infolist:
 			print(format_string % (x.filename, x.file_size, x.compress_size))
 
-	def read(self, name):
+	def read(self, name, patched=False):
 		"""
 		Return file bytes (as a string) for \a name.
+		If \a patched is True, the file will be read fully patched, from
+		memory if materialize() read it, otherwise unpatched.
+		With a cache, the file is read through it, see read_buffer().
+		"""
+		if self.cache is not None:
+			return bytes(self.read_buffer(name, patched))
+		if isinstance(name, MPQInfo):
+			name = name.filename
+		if patched and self._patched:
+			data = self._patched.get(_normalize(name))
+			if data is not None:
+				return data
+		with self.open(name, patched=patched) as f:
+			return f.read()
+
+	def read_buffer(self, name, patched=False):
+		"""
+		Returns the contents of \a name like read(), without copying them
+		out of the cache: as a read-only storm.Buffer sharing the cached data,
+		in which patched files are only patched once. Without a cache, or for
+		files read into memory by materialize(), returns bytes.
 		"""
+		if self.cache is None:
+			return self.read(name, patched)
 		if isinstance(name, MPQInfo):
-			name = name.name
-		f = self.open(name)
-		return f.read()
+			name = name.filename
+		if patched and self._patched:
+			data = self._patched.get(_normalize(name))
+			if data is not None:
+				return data
+		mpq = self._archive_contains(name)
+		if not mpq:
+			raise KeyError("There is no item named %r in the archive" % (name))
+		scope = self._patched_scope(mpq, name) if patched else 0
+		return self.cache.read(mpq, name, 0, -1, scope)
+
+	def read_many(self, names, patched=False, threads=1, arena=None):
+		"""
+		Reads all of \a names in one call per archive, in the order of their
+		offset in the archive, with the GIL released and on \a threads
+		threads per archive.
+		Returns a dict of names to bytes. If a writable buffer \a arena is
+		given, the files are written to it back to back instead, and an
+		array of (offset, size) pairs in the order of \a names is returned.
+		Raises a KeyError if a name matches no file.
+		"""
+		scope = int(bool(patched))
+		names = list(names)
+		index = self._name_index()
+		batches = {}
+		for i, name in enumerate(names):
+			mpq = index.get(name)
+			if mpq is None:
+				raise KeyError("There is no item named %r in the archive" % (name))
+			batches.setdefault(mpq, []).append(i)
+
+		if arena is None:
+			result = {}
+			for mpq, batch in batches.items():
+				result.update(mpq.read_many([names[i] for i in batch], scope, threads))
+			return result
+
+		table = array("Q", bytes(16 * len(names)))
+		with memoryview(arena) as view:
+			view = view.cast("B")
+			used = 0
+			for mpq, batch in batches.items():
+				batch_names = [names[i] for i in batch]
+				offsets = mpq.read_many(batch_names, scope, threads, view[used:])
+				for j, i in enumerate(batch):
+					table[2 * i] = used + offsets[2 * j]
+					table[2 * i + 1] = offsets[2 * j + 1]
+				used += sum(offsets[1::2])
+		return table
+
+	async def read_async(self, name, patched=False):
+		"""
+		Coroutine returning the bytes of \a name, read on a worker thread.
+		If \a patched is True, the file will be read fully patched,
+		otherwise unpatched.
+		At most MAX_IN_FLIGHT requests run at once per event loop, others wait.
+		"""
+		if isinstance(name, MPQInfo):
+			name = name.filename
+		scope = int(bool(patched))
+		mpq = self._archive_contains(name)
+		if not mpq:
+			raise KeyError("There is no item named %r in the archive" % (name))
+		dispatcher = self._dispatcher()
+		return await dispatcher.submit(dispatcher.pool.read, mpq, name, scope)
 
-	def testmpq(self):
+	async def read_many_async(self, names, patched=False):
+		"""
+		Coroutine returning a dict of the bytes of each of \a names, read
+		concurrently on worker threads.
+		"""
+		names = list(names)
+		results = await asyncio.gather(
+			*[self.read_async(name, patched) for name in names]
+		)
+		return dict(zip(names, results))
+
+	def search(self, *patterns, path=""):
+		"""
+		Returns the names of the files in the directory \a path matching any
+		of the regular expressions \a patterns, sorted. Names are searched
+		case-insensitively, with / between directories.
+		"""
+		return self._name_index().search(patterns, path, "/")
+
+	def verify_signatures(self):
+		"""
+		Returns the result of verifying the signature of each archive, by
+		priority: one of storm.ERROR_NO_SIGNATURE, ERROR_VERIFY_FAILED,
+		ERROR_WEAK_SIGNATURE_OK/ERROR and ERROR_STRONG_SIGNATURE_OK/ERROR.
+		"""
+		return [mpq.verify() for mpq in self._archives]
+
+	def testmpq(self, flags=storm.SFILE_VERIFY_ALL, threads=0, progress=None):
+		"""
+		Verifies the MPQFile: the signature of each archive, then the sector
+		CRCs, CRC32 and MD5 from (attributes) of every file, as requested by
+		\a flags (storm.SFILE_VERIFY_*), on \a threads threads (one per core
+		by default). Each file is verified in the first archive holding it.
+		\a progress, if given, is called as progress(name, done, total) after
+		each file; returning False stops the verification early.
+		Raises storm.error if a signature is invalid, otherwise returns a dict
+		of the names verified to their storm.VERIFY_* flags. Files are damaged
+		when their flags have any of storm.VERIFY_FILE_ERROR_MASK set.
+		"""
+		bad = (
+			storm.ERROR_VERIFY_FAILED,
+			storm.ERROR_WEAK_SIGNATURE_ERROR,
+			storm.ERROR_STRONG_SIGNATURE_ERROR,
+		)
+		for mpq, result in zip(self._archives, self.verify_signatures()):
+			if result in bad:
+				raise storm.error("Invalid signature: %s (%i)" % (mpq.name, result))
+
+		if self._listfile is None:
+			self._regenerate_listfile()
+		batches = []
+		seen = set()
+		for mpq, listing in zip(self._archives, self._listing):
+			batch = [name for name in listing.name if name not in seen]
+			seen.update(batch)
+			batches.append((mpq, batch))
+
+		total = sum(len(batch) for mpq, batch in batches)
+		results = {}
+		stopped = []
+		for mpq, batch in batches:
+			if not batch:
+				continue
+			if progress is None:
+				callback = None
+			else:
+				def callback(name, count, _, offset=len(results)):
+					if progress(name, offset + count, total) is False:
+						stopped.append(name)
+						return False
+			results.update(mpq.verify_all(batch, flags, threads, callback))
+			if stopped:
+				break
+		return results
+
+	def walk(self, top=""):
+		"""
+		Returns the (dirpath, dirnames, filenames) of the directory \a top and
+		of all its subdirectories, top-down, like os.walk().
+		"""
+		return iter(self._name_index().walk(top, "/"))
+
+
+class MPQPath(object):
+	"""
+	A file or directory in an MPQFile, with the interface of zipfile.Path
+	"""
+	def __init__(self, root, at=""):
+		self.root = root
+		self.at = at.replace("\\", "/").strip("/")
+
+	def __eq__(self, other):
+		if not isinstance(other, MPQPath):
+			return False
+		return (
+			(self.root, _normalize(self.at)) == (other.root, _normalize(other.at))
+		)
+
+	def __hash__(self):
+		return hash((self.root, _normalize(self.at)))
+
+	def __repr__(self):
+		return "<%s %r>" % (self.__class__.__name__, self.at)
+
+	def __str__(self):
+		return self.at
+
+	def __truediv__(self, other):
+		return self.joinpath(other)
+
+	@property
+	def name(self):
+		return self.at.rpartition("/")[2]
+
+	@property
+	def parent(self):
+		return MPQPath(self.root, self.at.rpartition("/")[0])
+
+	def exists(self):
+		return self.is_file() or self.is_dir()
+
+	def glob(self, pattern):
+		names = self.root.glob(posixpath.join(self.at, pattern))
+		return [MPQPath(self.root, name) for name in names]
+
+	def is_dir(self):
+		return self.root._name_index().isdir(self.at)
+
+	def is_file(self):
+		return self.at in self.root
+
+	def iterdir(self):
+		return (self / name for name in self.root.listdir(self.at))
+
+	def joinpath(self, *other):
+		return MPQPath(self.root, posixpath.join(self.at, *other))
+
+	def open(self, mode="r", patched=False):
+		return self.root.open(self.at, mode, patched)
+
+	def read_bytes(self, patched=False):
+		return self.root.read(self.at, patched)
+
+	def read_text(self, encoding="utf-8", errors="strict", patched=False):
+		return self.read_bytes(patched).decode(encoding, errors)
+
+
+def _normalize(name):
+	# Matches names the way StormLib does: case-insensitive, / and \ equivalent
+	return name.replace("/", "\\").upper()
+
+
+class _AsyncDispatcher(object):
+	"""
+	Completes the futures of the requests of a storm.Pool on an event loop,
+	which watches the file descriptor signalled by the pool. The pool only
+	serves this loop, and is closed along with the dispatcher.
+	"""
+	def __init__(self, pool, loop, limit):
+		self.pool = pool
+		self.loop = loop
+		self.futures = {}
+		self.semaphore = asyncio.Semaphore(limit)
+		loop.add_reader(pool.fileno(), self._complete)
+
+	def _complete(self):
+		for token, error, data in self.pool.collect():
+			future, name = self.futures.pop(token, (None, None))
+			if future is None or future.done():
+				continue
+			if error == storm.ERROR_FILE_NOT_FOUND:
+				future.set_exception(KeyError(
+					"There is no item named %r in the archive" % (name)
+				))
+			elif error:
+				future.set_exception(storm.error(
+					"Error processing %r: %i" % (name, error)
+				))
+			else:
+				future.set_result(data)
+
+	async def submit(self, method, mpq, name, *args):
+		async with self.semaphore:
+			token = method(mpq, name, *args)
+			future = self.loop.create_future()
+			self.futures[token] = future, name
+			try:
+				return await future
+			except asyncio.CancelledError:
+				# Drop the request if it has not started, its result otherwise
+				self.pool.cancel(token)
+				self.futures.pop(token, None)
+				raise
+
+	def close(self):
+		# A closed loop runs nothing anymore, its futures included
+		if not self.loop.is_closed():
+			self.loop.remove_reader(self.pool.fileno())
+			for future, name in self.futures.values():
+				if not future.done():
+					future.cancel()
+		self.futures.clear()
+		self.pool.close()
+
+
+class _ExecutorPool(object):
+	"""
+	Stands for storm.Pool where it is not available, making the same calls
+	synchronously.
+	"""
+	def _check(self, mpq, name):
+		if not mpq.has_file(name):
+			raise KeyError("There is no item named %r in the archive" % (name))
+
+	def read(self, mpq, name, scope):
+		self._check(mpq, name)
+		file = mpq.open_file(name, scope)
+		try:
+			return file.read()
+		finally:
+			file.close()
+
+	def extract(self, mpq, name, path, scope):
+		self._check(mpq, name)
+		mpq.extract(name, path, scope)
+
+	def close(self):
 		pass
 
 
-class MPQExtFile(object):
-	def __init__(self, file, name):
+class _ExecutorDispatcher(object):
+	"""
+	Runs the requests of an _ExecutorPool on the default executor of an
+	event loop. StormLib releases the GIL, so requests still run in parallel.
+	"""
+	def __init__(self, pool, loop, limit):
+		self.pool = pool
+		self.loop = loop
+		self.semaphore = asyncio.Semaphore(limit)
+
+	async def submit(self, method, mpq, name, *args):
+		async with self.semaphore:
+			call = self.loop.run_in_executor(None, method, mpq, name, *args)
+			return await call
+
+	def close(self):
+		self.pool.close()
+
+
+class MPQExtFile(io.RawIOBase):
+	"""
+	A file within an MPQ archive, as a raw binary stream.
+	Wrap it in an io.BufferedReader for buffered access.
+	If \a cache (a storm.Cache) is given, reads go through it.
+	"""
+	def __init__(self, file, name, cache=None, scope=0):
+		super(MPQExtFile, self).__init__()
 		self._file = file
+		self._cache = cache
+		self._scope = scope
 		self.name = name
 
 	def __repr__(self):
 		return "%s(%r)" % (self.__class__.__name__, self.name)
 
 	def _info(self, type):
-		return storm.SFileGetFileInfo(self._file, type)
+		return self._file.info(type)
 
 	def close(self):
-		storm.SFileCloseFile(self._file)
+		self._file.close()
+		super(MPQExtFile, self).close()
 
-	def read(self, size=None):
+	def readable(self):
+		return True
+
+	def seekable(self):
+		return True
+
+	def _read_cached(self, size):
+		data = self._cache.read(
+			self._file.archive, self.name, self.tell(), size, self._scope
+		)
+		self._file.seek(len(data), os.SEEK_CUR)
+		return data
+
+	def read(self, size=-1):
 		if size is None:
-			size = self.size() - self.tell()
-		return storm.SFileReadFile(self._file, size)
+			size = -1
+		if self._cache is not None:
+			return bytes(self._read_cached(size))
+		return self._file.read(size)
+
+	def readall(self):
+		return self.read()
+
+	def readinto(self, b):
+		"""
+		Reads into the writable buffer \a b without any intermediate copy.
+		Returns the number of bytes read.
+		"""
+		if self._cache is not None:
+			with memoryview(b) as view:
+				data = self._read_cached(view.nbytes)
+				view.cast("B")[:len(data)] = data
+			return len(data)
+		return self._file.readinto(b)
 
 	def seek(self, offset, whence=os.SEEK_SET):
-		storm.SFileSetFilePointer(self._file, offset, whence)
+		return self._file.seek(offset, whence)
 
 	def size(self):
-		return storm.SFileGetFileSize(self._file)
+		return self._file.size()
 
 	def tell(self):
-		return storm.SFileSetFilePointer(self._file, 0, os.SEEK_CUR)
+		return self._file.tell()
 
 
-class MPQInfo(object):
-	def __init__(self, file):
-		self._file = file
+class MPQInfo(storm.FileInfo):
+	"""
+	Information about a file in the MPQFile, see storm.FileInfo.
+	"""
+	__slots__ = ()
+
+	@classmethod
+	def from_file(cls, file):
+		"""
+		Returns a MPQInfo object for the open MPQExtFile \a file.
+		"""
+		return cls.from_handle(file._file)
 
 	@property
 	def basename(self):
 		return os.path.basename(self.filename)
 
-	@property
-	def filename(self):
-		return self._file.name.replace("\\", "/")
-
 	@property
 	def date_time(self):
-		return self._file._info(storm.SFILE_INFO_FILETIME)
+		"""
+		The file time as a (year, month, day, hour, minute, second) tuple,
+		or None if the archive does not store it.
+		"""
+		if not self.file_time:
+			return None
+		# FILETIME counts 100-nanosecond intervals since 1601-01-01
+		time = datetime(1601, 1, 1) + timedelta(microseconds=self.file_time // 10)
+		return time.timetuple()[:6]
 
 	@property
 	def compress_type(self):
@@ -226,11 +930,3 @@ class MPQInfo(object):
 	@property
 	def CRC(self):
 		raise NotImplementedError
-
-	@property
-	def compress_size(self):
-		return self._file._info(storm.SFileInfoCompressedSize)
-
-	@property
-	def file_size(self):
-		return self._file._info(storm.SFileInfoFileSize)
@@ -2,7 +2,7 @@
 
 #include <Python.h>
 
-#include <string>
+#include <climits>
 
 namespace python
 {
@@ -10,97 +10,136 @@ namespace python
   {
     namespace
     {
-      //! \note If compilation fails here, check Python documentation for the
-      //! correct character to be used, and add that to the list.
-      //! \see https://docs.python.org/3/c-api/arg.html
-      template<typename> struct tuple_char_for_type;
-      #define mk_tuple_char_for_type(c_, t_)                          \
-        template<> struct tuple_char_for_type<t_> { static char const v = c_; }
-      mk_tuple_char_for_type ('i', int);
-      mk_tuple_char_for_type ('I', unsigned int);
-      mk_tuple_char_for_type ('k', unsigned long);
-      mk_tuple_char_for_type ('K', unsigned long long);
-      mk_tuple_char_for_type ('s', char*);
-      mk_tuple_char_for_type ('s', char const*);
+      //! \note Converters for return values, with the same semantics as the
+      //! matching Py_BuildValue format characters, without parsing one.
+      inline PyObject* to_python (int v) {
+        return PyLong_FromLong (v);
+      }
+      inline PyObject* to_python (unsigned int v) {
+        return PyLong_FromUnsignedLong (v);
+      }
+      inline PyObject* to_python (unsigned long v) {
+        return PyLong_FromUnsignedLong (v);
+      }
+      inline PyObject* to_python (unsigned long long v) {
+        return PyLong_FromUnsignedLongLong (v);
+      }
+      //! \note Also taken by fixed length char arrays, usually used as
+      //! c-style strings. NULL gives None.
+      inline PyObject* to_python (char const* v) {
+        if (!v) {
+          Py_RETURN_NONE;
+        }
+        return PyUnicode_FromString (v);
+      }
 
-      //! \note fixed length char arrays are usually used as c-style strings
-      template<std::size_t N> struct tuple_char_for_type<char[N]> 
-        : tuple_char_for_type<char*> {};
-      template<std::size_t N> struct tuple_char_for_type<char const[N]> 
-        : tuple_char_for_type<char const*> {};
-      //! \note enums are int in c++03
-      mk_tuple_char_for_type (tuple_char_for_type<int>::v, SFileInfoClass);
-      //! \note HANDLE is supposed to be opaque, and we shouldn't serialize
-      //! \what's behind the pointer, so we just serialize the pointer value.
-      mk_tuple_char_for_type (tuple_char_for_type<std::uintptr_t>::v, HANDLE);
+      inline bool fill_tuple (PyObject*, Py_ssize_t) {
+        return true;
+      }
+      template<typename T, typename... Ts>
+      bool fill_tuple (PyObject* tuple, Py_ssize_t i, T const& v, Ts const&... vs) {
+        PyObject* item = to_python (v);
+        if (!item) {
+          return false;
+        }
+        PyTuple_SET_ITEM (tuple, i, item);
+        return fill_tuple (tuple, i + 1, vs...);
+      }
+
+      //! \note Converters for METH_FASTCALL arguments, with the same
+      //! semantics as the matching PyArg_ParseTuple format characters.
+      inline bool from_python (PyObject* o, int* v) {
+        long value = PyLong_AsLong (o);
+        if (value == -1 && PyErr_Occurred()) {
+          return false;
+        }
+        if (value < INT_MIN || value > INT_MAX) {
+          PyErr_SetString (PyExc_OverflowError, "signed integer is out of range for int");
+          return false;
+        }
+        *v = (int) value;
+        return true;
+      }
+      inline bool from_python (PyObject* o, unsigned int* v) {
+        *v = (unsigned int) PyLong_AsUnsignedLongMask (o);
+        return *v != (unsigned int) -1 || !PyErr_Occurred();
+      }
+      inline bool from_python (PyObject* o, long long* v) {
+        *v = PyLong_AsLongLong (o);
+        return *v != -1 || !PyErr_Occurred();
+      }
+      inline bool from_python (PyObject* o, unsigned long long* v) {
+        *v = PyLong_AsUnsignedLongLongMask (o);
+        return *v != (unsigned long long) -1 || !PyErr_Occurred();
+      }
+      inline bool from_python (PyObject* o, SFileInfoClass* v) {
+        int value;
+        bool result = from_python (o, &value);
+        *v = (SFileInfoClass) value;
+        return result;
+      }
+      inline bool from_python (PyObject* o, char const** v) {
+        if (!PyUnicode_Check (o)) {
+          PyErr_Format (PyExc_TypeError, "argument must be str, not %.50s", Py_TYPE (o)->tp_name);
+          return false;
+        }
+        *v = PyUnicode_AsUTF8 (o);
+        return *v != NULL;
+      }
+      //! \note The caller has to PyBuffer_Release() the buffer.
+      inline bool from_python (PyObject* o, Py_buffer* v) {
+        return PyObject_GetBuffer (o, v, PyBUF_WRITABLE) == 0;
+      }
+      //! \note Borrowed reference.
+      inline bool from_python (PyObject* o, PyObject** v) {
+        *v = o;
+        return true;
+      }
+
+      inline bool unpack (PyObject* const*, Py_ssize_t, Py_ssize_t) {
+        return true;
+      }
+      template<typename T, typename... Ts>
+      bool unpack (PyObject* const* args, Py_ssize_t nargs, Py_ssize_t i, T* v, Ts*... vs) {
+        //! \note Missing optional arguments keep their current value.
+        return i >= nargs || (from_python (args[i], v) && unpack (args, nargs, i + 1, vs...));
+      }
     }
   }
 
   namespace
   {
-    template<typename T1>
-    bool parse_tuple (PyObject* args, char const* fun, T1* v1) {
-      std::string const format 
-        ( std::string (1, detail::tuple_char_for_type<T1>::v) 
-        + ':' + fun
-        );
-      return PyArg_ParseTuple (args, format.c_str(), v1);
-    }
-    template<typename T1, typename T2>
-    bool parse_tuple (PyObject* args, char const* fun, T1* v1, T2* v2) {
-      std::string const format 
-        ( std::string (1, detail::tuple_char_for_type<T1>::v)
-        + std::string (1, detail::tuple_char_for_type<T2>::v) 
-        + ':' + fun
-        );
-      return PyArg_ParseTuple (args, format.c_str(), v1, v2);
-    }
-    template<typename T1, typename T2, typename T3>
-    bool parse_tuple (PyObject* args, char const* fun, T1* v1, T2* v2, T3* v3) {
-      std::string const format 
-        ( std::string (1, detail::tuple_char_for_type<T1>::v)
-        + std::string (1, detail::tuple_char_for_type<T2>::v) 
-        + std::string (1, detail::tuple_char_for_type<T3>::v) 
-        + ':' + fun
-        );
-      return PyArg_ParseTuple (args, format.c_str(), v1, v2, v3);
-    }
-    template<typename T1, typename T2, typename T3, typename T4>
-    bool parse_tuple (PyObject* args, char const* fun, T1* v1, T2* v2, T3* v3, T4* v4) {
-      std::string const format 
-        ( std::string (1, detail::tuple_char_for_type<T1>::v)
-        + std::string (1, detail::tuple_char_for_type<T2>::v) 
-        + std::string (1, detail::tuple_char_for_type<T3>::v) 
-        + std::string (1, detail::tuple_char_for_type<T4>::v) 
-        + ':' + fun
-        );
-      return PyArg_ParseTuple (args, format.c_str(), v1, v2, v3, v4);
+    //! Unpacks positional METH_FASTCALL arguments into \a vs, of which the
+    //! first \a required ones are mandatory.
+    template<typename... Ts>
+    bool parse_args (PyObject* const* args, Py_ssize_t nargs, char const* fun, Py_ssize_t required, Ts*... vs) {
+      Py_ssize_t const max = sizeof... (Ts);
+      if (nargs < required || nargs > max) {
+        if (required == max) {
+          PyErr_Format (PyExc_TypeError, "%s() takes exactly %zd arguments (%zd given)", fun, max, nargs);
+        } else {
+          PyErr_Format (PyExc_TypeError, "%s() takes from %zd to %zd arguments (%zd given)", fun, required, max, nargs);
+        }
+        return false;
+      }
+      return detail::unpack (args, nargs, 0, vs...);
     }
 
-    template<typename T1>
-    PyObject* build_value (T1 const& v1)
-    {
-      std::string const format 
-        ( std::string (1, detail::tuple_char_for_type<T1>::v) 
-        );
-      return Py_BuildValue (format.c_str(), v1);
-    }
-    template<>
-    PyObject* build_value (std::pair<char*, int> const& v1)
-    {
-      std::string const format 
-        ( "y#" 
-        );
-      return Py_BuildValue (format.c_str(), v1.first, v1.second);
+    //! Converts \a v to a new reference, like Py_BuildValue() with a single
+    //! format character.
+    template<typename T>
+    PyObject* build_value (T const& v) {
+      return detail::to_python (v);
     }
-    template<typename T1, typename T2>
-    PyObject* build_value (T1 const& v1, T2 const& v2)
-    {
-      std::string const format 
-        ( std::string (1, detail::tuple_char_for_type<T1>::v) 
-        + std::string (1, detail::tuple_char_for_type<T2>::v) 
-        );
-      return Py_BuildValue (format.c_str(), v1, v2);
+    //! Converts \a vs to a new tuple.
+    template<typename T1, typename T2, typename... Ts>
+    PyObject* build_value (T1 const& v1, T2 const& v2, Ts const&... vs) {
+      PyObject* tuple = PyTuple_New (2 + sizeof... (Ts));
+      if (tuple && !detail::fill_tuple (tuple, 0, v1, v2, vs...)) {
+        Py_DECREF (tuple);
+        return NULL;
+      }
+      return tuple;
     }
   }
 }
@@ -0,0 +1,176 @@
+"""
+Sidecar index files, to open stacks of archives without listing them
+
+A sidecar stores the listing of every archive of a stack (names, hash and
+block table indices, sizes, flags, locales and file times) along with the
+size, modification time and a hash of the header of each archive file. It is
+only used while all of those still match.
+
+The file is little-endian and every section is 8-byte aligned, so that its
+columns can be used in place from a memory map:
+
+	header: magic (8 bytes), version (u32), archive count (u32)
+	each archive:
+		path length (u32), file count (u32), size (u64), mtime in ns (u64)
+		SHA-1 of the first HEADER_SIZE bytes (20 bytes, 4 bytes padding)
+		path (UTF-8)
+		names length (u64), names (UTF-8, NUL-terminated)
+		hash_index, block_index, file_size, compressed_size, flags, locale
+		(u32 each)
+		file_time (u64)
+"""
+import argparse
+import hashlib
+import mmap
+import os
+import struct
+import sys
+from array import array
+
+from . import storm
+
+
+MAGIC = b"MPQSIDE\0"
+VERSION = 1
+# Bytes of each archive hashed, covering the user data and MPQ headers
+HEADER_SIZE = 4096
+
+_HEADER = struct.Struct("<8sII")
+_ARCHIVE = struct.Struct("<IIQQ20s4x")
+_LENGTH = struct.Struct("<Q")
+# storm.FileList columns after the names, with their array typecode
+_COLUMNS = (
+	("hash_index", "I"),
+	("block_index", "I"),
+	("file_size", "I"),
+	("compressed_size", "I"),
+	("flags", "I"),
+	("locale", "I"),
+	("file_time", "Q"),
+)
+
+
+def fingerprint(path):
+	"""
+	Returns the (size, mtime in ns, header hash) of the archive file at \a path.
+	"""
+	st = os.stat(path)
+	with open(path, "rb") as f:
+		digest = hashlib.sha1(f.read(HEADER_SIZE)).digest()
+	return st.st_size, st.st_mtime_ns, digest
+
+
+def _write_aligned(f, data):
+	f.write(data)
+	f.write(b"\0" * (-len(data) % 8))
+
+
+def write(path, archives, listings):
+	"""
+	Writes the sidecar at \a path for the archive files \a archives, listed as
+	\a listings (storm.FileList, as returned by storm.Archive.list()).
+	The file is replaced atomically.
+	"""
+	tmp = "%s.%i.tmp" % (path, os.getpid())
+	with open(tmp, "wb") as f:
+		f.write(_HEADER.pack(MAGIC, VERSION, len(archives)))
+		for name, listing in zip(archives, listings):
+			size, mtime, digest = fingerprint(name)
+			encoded = os.fsencode(name)
+			f.write(_ARCHIVE.pack(len(encoded), len(listing.name), size, mtime, digest))
+			_write_aligned(f, encoded)
+
+			names = b"".join(name.encode() + b"\0" for name in listing.name)
+			f.write(_LENGTH.pack(len(names)))
+			_write_aligned(f, names)
+
+			for column, typecode in _COLUMNS:
+				data = array(typecode, getattr(listing, column))
+				if sys.byteorder == "big":
+					data.byteswap()
+				_write_aligned(f, data.tobytes())
+	os.replace(tmp, path)
+
+
+def _read_listings(data, archives):
+	magic, version, count = _HEADER.unpack_from(data)
+	if magic != MAGIC or version != VERSION or count != len(archives):
+		return None
+	offset = _HEADER.size
+
+	listings = []
+	for name in archives:
+		length, entries, size, mtime, digest = _ARCHIVE.unpack_from(data, offset)
+		offset += _ARCHIVE.size
+		if data[offset:offset + length] != os.fsencode(name):
+			return None
+		if (size, mtime, digest) != fingerprint(name):
+			return None
+		offset += length + (-length % 8)
+
+		length, = _LENGTH.unpack_from(data, offset)
+		offset += _LENGTH.size
+		names = data[offset:offset + length].decode().split("\0")[:-1]
+		if len(names) != entries:
+			return None
+		offset += length + (-length % 8)
+
+		columns = []
+		for column, typecode in _COLUMNS:
+			values = array(typecode)
+			length = entries * values.itemsize
+			if offset + length > len(data):
+				return None
+			values.frombytes(data[offset:offset + length])
+			if sys.byteorder == "big":
+				values.byteswap()
+			columns.append(values)
+			offset += length + (-length % 8)
+
+		listings.append(storm.FileList([names] + columns))
+	return listings
+
+
+def read(path, archives):
+	"""
+	Returns the listings stored in the sidecar at \a path for the archive files
+	\a archives, or None if it is missing, invalid or out of date.
+	"""
+	try:
+		with open(path, "rb") as f:
+			with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as data:
+				return _read_listings(data, archives)
+	except (OSError, ValueError, struct.error):
+		return None
+
+
+def main(argv=None):
+	from . import MPQFile
+
+	parser = argparse.ArgumentParser(
+		prog="mpq-sidecar",
+		description="Builds or checks the sidecar index of a stack of archives",
+	)
+	parser.add_argument("command", choices=("build", "check"))
+	parser.add_argument("index", help="path of the sidecar index")
+	parser.add_argument(
+		"archives", nargs="+", help="archives of the stack, by priority"
+	)
+	args = parser.parse_args(argv)
+
+	if args.command == "check":
+		if read(args.index, args.archives) is None:
+			print("%s: out of date" % (args.index))
+			return 1
+		print("%s: up to date" % (args.index))
+		return 0
+
+	with MPQFile() as f:
+		for name in args.archives:
+			f.add_archive(name)
+		f.save_index(args.index)
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
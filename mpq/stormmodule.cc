@@ -1,11 +1,593 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <structmember.h>
 #define STORM_MODULE
 #include "stormmodule.h"
 
 #include "python_wrapper.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <errno.h>
+#ifdef _WIN32
+#include <direct.h>
+#define make_directory(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#define make_directory(path) mkdir(path, 0777)
+#endif
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#ifdef POSIX_FADV_WILLNEED
+#define HAVE_FADVISE
+#endif
+#endif
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+#define HAVE_MEMFD
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+/* Also set by pyconfig.h */
+#if !defined(HAVE_COPY_FILE_RANGE) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT
+#endif
+#endif
+
+/*
+ * Handle objects
+ *
+ * Archives, files and searches are exposed as storm.Archive, storm.File and
+ * storm.Find objects. Their StormLib handle is closed by close(), when leaving
+ * a with block or when the object is garbage collected. Files and searches
+ * keep their archive alive, and closing an archive closes them as well.
+ *
+ * StormLib handles must not be used from two threads at once, and every file
+ * or search handle shares the file stream of the archive it was opened from.
+ * Every StormLib call therefore runs with the GIL released while holding the
+ * lock of its archive. Threads working on different archive objects run fully
+ * in parallel.
+ */
+
+namespace
+{
+	typedef bool (WINAPI *CloseFunction)(HANDLE);
+
+	//! Whether StormLib keeps its last error per thread, see MOD_INIT(). It
+	//! does on Windows; on POSIX it usually keeps it in a global, which any
+	//! other thread may overwrite between a failing call and GetLastError().
+	bool LocalErrors = true;
+
+	//! The last error StormLib left on this thread, or \a fallback if it is
+	//! not reliable (see LocalErrors) or was not set. Outcomes, such as a
+	//! missing file or the end of a search, must be decided from the return
+	//! values: the error code only details them.
+	DWORD last_error(DWORD fallback) {
+		DWORD error = LocalErrors ? GetLastError() : ERROR_SUCCESS;
+		return error != ERROR_SUCCESS ? error : fallback;
+	}
+
+	//! The error of a StormLib call that returned \a ok, see last_error().
+	DWORD call_error(bool ok, DWORD fallback) {
+		return ok ? ERROR_SUCCESS : last_error(fallback);
+	}
+
+	//! Why StormLib could not open \a name, an archive or a local file, for
+	//! reading or, if \a write, for writing. Does not need the GIL.
+	DWORD path_error(char const *name, bool write) {
+		DWORD error = last_error(ERROR_SUCCESS);
+		if (error != ERROR_SUCCESS) {
+			return error;
+		}
+		FILE *file = fopen(name, write ? "r+b" : "rb");
+		if (!file) {
+			return errno == ENOENT ? ERROR_FILE_NOT_FOUND : ERROR_ACCESS_DENIED;
+		}
+		fclose(file);
+		return ERROR_BAD_FORMAT;
+	}
+
+	//! Opens the file of the archive \a name, just opened by StormLib with
+	//! \a flags, for the reads bypassing StormLib, see archive_descriptor().
+	//! Only read-only archives get one, as StormLib may replace the file of
+	//! the others. Returns -1 if there is none.
+	int open_archive_file(char const *name, DWORD flags) {
+#ifndef _WIN32
+		if (flags & MPQ_OPEN_READ_ONLY) {
+			return open(name, O_RDONLY | O_CLOEXEC);
+		}
+#endif
+		return -1;
+	}
+
+	//! Closes \a fd, from open_archive_file(), unless it is -1.
+	void close_archive_file(int fd) {
+#ifndef _WIN32
+		if (fd >= 0) {
+			close(fd);
+		}
+#endif
+	}
+
+	//! Everything needed to open another handle on an archive, so that worker
+	//! threads can read it without contending for the lock of its owner.
+	struct ArchiveSource {
+		struct Patch {
+			std::string name;
+			std::string prefix;
+			bool hasPrefix;
+			DWORD flags;
+		};
+
+		std::string name;
+		DWORD flags;
+		std::vector<Patch> patches;
+
+		//! Opens the archive with \a extra flags, read-only by default, and
+		//! applies its patches. Does not need the GIL.
+		bool open(HANDLE *mpq, DWORD *error, DWORD extra = MPQ_OPEN_READ_ONLY) const {
+			if (!SFileOpenArchive(name.c_str(), 0, flags | extra, mpq)) {
+				*error = path_error(name.c_str(), !((flags | extra) & MPQ_OPEN_READ_ONLY));
+				return false;
+			}
+			for (Patch const& patch : patches) {
+				char const *prefix = patch.hasPrefix ? patch.prefix.c_str() : NULL;
+				if (!SFileOpenPatchArchive(*mpq, patch.name.c_str(), prefix, patch.flags)) {
+					*error = path_error(patch.name.c_str(), false);
+					SFileCloseArchive(*mpq);
+					*mpq = NULL;
+					return false;
+				}
+			}
+			return true;
+		}
+
+		//! Opens the file of the archive, once open() opened it, for the reads
+		//! bypassing StormLib on that handle, see open_archive_file().
+		int open_file() const {
+			return open_archive_file(name.c_str(), flags | MPQ_OPEN_READ_ONLY);
+		}
+	};
+
+	//! Operations counted by HandleStats, named after the methods making them.
+	enum Operation {
+		OP_ADD_LISTFILE,
+		OP_FLUSH,
+		OP_COMPACT,
+		OP_SET_MAX_FILE_COUNT,
+		OP_PATCH,
+		OP_IS_PATCHED,
+		OP_OPEN_FILE,
+		OP_SIZE,
+		OP_SEEK,
+		OP_TELL,
+		OP_READ,
+		OP_HAS_FILE,
+		OP_GET_NAME,
+		OP_INFO,
+		OP_EXTRACT,
+		OP_FIND,
+		OP_FIND_NEXT,
+		OP_LIST,
+		OP_EXTRACT_ALL,
+		OP_VERIFY,
+		OP_VERIFY_ALL,
+		OP_READ_MANY,
+		OP_CACHE_READ,
+		OP_SUBMIT,
+		OP_BUILD,
+		OP_PATCH_INDEX,
+		OP_STAT,
+		OP_TABLES,
+		OP_LOAD,
+		OP_READ_SECTORS,
+		OP_MATCH_NAMES,
+		OP_COUNT
+	};
+
+	char const *const OperationNames[OP_COUNT] = {
+		"add_listfile",
+		"flush",
+		"compact",
+		"set_max_file_count",
+		"patch",
+		"is_patched",
+		"open_file",
+		"size",
+		"seek",
+		"tell",
+		"read",
+		"has_file",
+		"get_name",
+		"info",
+		"extract",
+		"find",
+		"find_next",
+		"list",
+		"extract_all",
+		"verify",
+		"verify_all",
+		"read_many",
+		"cache_read",
+		"submit",
+		"build",
+		"patch_index",
+		"stat",
+		"tables",
+		"load",
+		"read_sectors",
+		"match_names",
+	};
+
+	//! Counters of an archive or file handle, updated holding the archive lock.
+	struct HandleStats {
+		uint64_t calls[OP_COUNT];
+		uint64_t nanoseconds[OP_COUNT]; /* in StormLib, holding the lock */
+		uint64_t waitNanoseconds; /* waiting for the lock */
+		uint64_t bytesRequested;
+		uint64_t bytesRead;
+		uint64_t bytesCopied; /* extracted without StormLib, see extract_file() */
+		uint64_t bytesParallel; /* read by sector on several threads, see read_sectors() */
+		uint64_t patchedOpens;
+		uint64_t patchDepth; /* sum over patched opens */
+		std::map<DWORD, uint64_t> errors;
+
+		HandleStats() {
+			reset();
+		}
+
+		void reset() {
+			std::fill(calls, calls + OP_COUNT, 0);
+			std::fill(nanoseconds, nanoseconds + OP_COUNT, 0);
+			waitNanoseconds = bytesRequested = bytesRead = bytesCopied = bytesParallel = patchedOpens = patchDepth = 0;
+			errors.clear();
+		}
+
+		void record(Operation op, uint64_t wait, uint64_t elapsed, DWORD error) {
+			++calls[op];
+			nanoseconds[op] += elapsed;
+			waitNanoseconds += wait;
+			/* Reaching the end of a file or search is not an error */
+			if (error != ERROR_SUCCESS && error != ERROR_HANDLE_EOF && error != ERROR_NO_MORE_FILES) {
+				++errors[error];
+			}
+		}
+	};
+
+	//! Returns a new identifier for the contents of an archive, never reused.
+	uint64_t next_archive_id() {
+		static std::atomic<uint64_t> last(0);
+		return ++last;
+	}
+
+	//! Parts of an archive whose loading a lazy open defers, see ensure_loaded()
+	enum Deferred {
+		DEFER_LISTFILE = 1,
+		DEFER_ATTRIBUTES = 2,
+	};
+
+	//! Page cache hints of an archive, see AccessPlan
+	enum Advice {
+		ADVISE_NONE = 0,
+		ADVISE_WILLNEED = 1,
+		ADVISE_DONTNEED = 2,
+	};
+
+	struct ArchiveState {
+		std::mutex lock;
+		/* Open file and search handles of the archive */
+		std::unordered_map<HANDLE *, CloseFunction> children;
+		ArchiveSource source;
+		/* Memory file the archive was opened from, see Archive.from_buffer() */
+		int memory;
+		/* Archive file, opened along with the archive, see open_archive_file() */
+		int file;
+		/* Identifies the contents of the archive, renewed when it is patched */
+		std::atomic<uint64_t> id;
+		/* Calls on the archive and on its files */
+		HandleStats stats;
+		/* Deferred parts still to load (DEFER_*) */
+		std::atomic<unsigned int> deferred;
+		/* Handles replaced by reopening the archive, kept open for their files */
+		std::vector<HANDLE> retired;
+		/* Access hints given by batches (ADVISE_*), see AccessPlan */
+		unsigned int advice;
+		uint64_t adviceWindow;
+		/* Reads decompressed on several threads from this size, see read_sectors() */
+		std::atomic<uint64_t> parallelThreshold;
+		std::atomic<unsigned int> parallelThreads;
+
+		ArchiveState() : memory(-1), file(-1), id(next_archive_id()), deferred(0), advice(ADVISE_NONE), adviceWindow(32 << 20), parallelThreshold(16 << 20), parallelThreads(0) {}
+		~ArchiveState() {
+			close_retired();
+			set_file(-1);
+#ifdef HAVE_MEMFD
+			if (memory >= 0) {
+				close(memory);
+			}
+#endif
+		}
+
+		//! Replaces the archive file with \a fd. Must hold the lock, or own the
+		//! archive.
+		void set_file(int fd) {
+			close_archive_file(file);
+			file = fd;
+		}
+
+		//! Closes the retired handles. Must hold the lock, or own the archive.
+		void close_retired() {
+			for (HANDLE mpq : retired) {
+				SFileCloseArchive(mpq);
+			}
+			retired.clear();
+		}
+	};
+}
+
+typedef struct {
+	PyObject_HEAD
+	HANDLE mpq;
+	PyObject *name;
+	ArchiveState *state;
+} ArchiveObject;
+
+typedef struct {
+	PyObject_HEAD
+	HANDLE file;
+	ArchiveObject *archive;
+	HandleStats *stats;
+} FileObject;
+
+typedef struct {
+	PyObject_HEAD
+	HANDLE find;
+	ArchiveObject *archive;
+	bool listfile;
+	bool pending; /* first result, returned by the next call to __next__ */
+	bool exhausted;
+	SFILE_FIND_DATA first;
+} FindObject;
+
+namespace
+{
+	typedef PyObject * (*FastMethod)(PyObject *, PyObject *const *, Py_ssize_t);
+
+	//! Global tracing callback, see storm.set_trace()
+	PyObject *Tracer = NULL;
+
+	uint64_t now_ns() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	//! Calls the tracing callback, which must not raise.
+	void trace(Operation op, ArchiveObject *archive, uint64_t nanoseconds, DWORD error) {
+		PyObject *tracer = Tracer;
+		Py_INCREF(tracer);
+		PyObject *result = PyObject_CallFunction(tracer, "sOdk", OperationNames[op], (PyObject *)archive, nanoseconds / 1e9, (unsigned long)error);
+		if (!result) {
+			PyErr_WriteUnraisable(tracer);
+		}
+		Py_XDECREF(result);
+		Py_DECREF(tracer);
+	}
+
+	//! Whether StormLib answers \a op from memory, without touching the file
+	//! stream: releasing the GIL would then cost more than the call itself.
+	inline bool is_cheap(Operation op) {
+		switch (op) {
+			case OP_IS_PATCHED:
+			case OP_SIZE:
+			case OP_SEEK:
+			case OP_TELL:
+			case OP_HAS_FILE:
+			case OP_GET_NAME:
+				return true;
+			default:
+				return false;
+		}
+	}
+
+	//! Runs \a fn and counts it. Must hold the archive lock.
+	template<typename F>
+	bool run_locked(ArchiveObject *archive, HANDLE const *handle, Operation op, HandleStats *file, uint64_t start, F& fn, uint64_t *elapsed, DWORD *error) {
+		if (*handle == NULL) {
+			return false;
+		}
+		uint64_t locked = now_ns();
+		/* So that last_error() does not see the error of an earlier call */
+		SetLastError(ERROR_SUCCESS);
+		*error = fn();
+		*elapsed = now_ns() - locked;
+		archive->state->stats.record(op, locked - start, *elapsed, *error);
+		if (file) {
+			file->record(op, locked - start, *elapsed, *error);
+		}
+#ifdef HAVE_USDT
+		DTRACE_PROBE3(python_mpq, call, OperationNames[op], *elapsed, *error);
+#endif
+		return true;
+	}
+
+	//! Runs \a fn with the GIL released, holding the lock of \a archive.
+	//! Cheap operations (see is_cheap()) keep the GIL if the lock is free.
+	//! \a handle is the archive's handle or one of its children's; if it has
+	//! been closed, \a fn is not run and a ValueError is raised instead.
+	//! The call is counted as \a op in the stats of \a archive and in \a file,
+	//! if any, along with the error \a fn returns. StormLib may keep its last
+	//! error in a global, so \a fn must derive it from return values, see
+	//! call_error().
+	template<typename F>
+	bool call_locked(ArchiveObject *archive, HANDLE const *handle, Operation op, HandleStats *file, F fn) {
+		bool valid;
+		uint64_t elapsed = 0;
+		DWORD error = ERROR_SUCCESS;
+		std::unique_lock<std::mutex> guard(archive->state->lock, std::defer_lock);
+		if (is_cheap(op) && guard.try_lock()) {
+			valid = run_locked(archive, handle, op, file, now_ns(), fn, &elapsed, &error);
+			guard.unlock();
+		} else {
+			Py_BEGIN_ALLOW_THREADS
+			uint64_t start = now_ns();
+			guard.lock();
+			valid = run_locked(archive, handle, op, file, start, fn, &elapsed, &error);
+			guard.unlock();
+			Py_END_ALLOW_THREADS
+		}
+
+		if (!valid) {
+			PyErr_SetString(PyExc_ValueError, "I/O operation on closed handle");
+			return false;
+		}
+		if (Tracer) {
+			trace(op, archive, elapsed, error);
+		}
+		return true;
+	}
+
+	template<typename F>
+	bool call_locked(ArchiveObject *archive, HANDLE const *handle, Operation op, F fn) {
+		return call_locked(archive, handle, op, NULL, fn);
+	}
+
+	//! Registers the child \a handle of \a archive. Must hold the archive lock.
+	void add_child(ArchiveObject *archive, HANDLE *handle, CloseFunction close) {
+		archive->state->children[handle] = close;
+	}
+
+	//! Closes the child \a handle of \a archive. Must hold the archive lock.
+	bool close_child(ArchiveObject *archive, HANDLE *handle) {
+		auto it = archive->state->children.find(handle);
+		bool result = it->second(*handle);
+		archive->state->children.erase(it);
+		*handle = NULL;
+		return result;
+	}
+
+	//! Closes the child \a handle of \a archive, unless already closed.
+	bool close_child_locked(ArchiveObject *archive, HANDLE *handle) {
+		bool result = true;
+		Py_BEGIN_ALLOW_THREADS
+		{
+			std::lock_guard<std::mutex> guard(archive->state->lock);
+			if (*handle) {
+				result = close_child(archive, handle);
+			}
+		}
+		Py_END_ALLOW_THREADS
+		return result;
+	}
+
+	//! Converts an optional str argument, None giving NULL.
+	bool optional_string(PyObject *o, char const **v) {
+		if (o == Py_None) {
+			*v = NULL;
+			return true;
+		}
+		*v = PyUnicode_AsUTF8(o);
+		return *v != NULL;
+	}
+
+	uint64_t make_uint64(DWORD low, DWORD high) {
+		return (((uint64_t)low  << 0)  & 0x00000000FFFFFFFF)
+		     | (((uint64_t)high << 32) & 0xFFFFFFFF00000000);
+	}
+
+	//! Why \a name did not open in \a mpq with \a scope: missing, or present
+	//! but unreadable. Must hold the archive lock.
+	DWORD open_error(HANDLE mpq, char const *name, DWORD scope) {
+		DWORD error = last_error(ERROR_SUCCESS);
+		if (error != ERROR_SUCCESS) {
+			return error;
+		}
+		if (scope == SFILE_OPEN_LOCAL_FILE) {
+			return path_error(name, false);
+		}
+		return SFileHasFile(mpq, name) ? ERROR_FILE_CORRUPT : ERROR_FILE_NOT_FOUND;
+	}
+
+	//! Why SFileReadFile() failed on \a file: ERROR_HANDLE_EOF if it stopped
+	//! at the end of the file, as StormLib does for short reads, or a corrupt
+	//! file. Must hold the archive lock.
+	DWORD read_error(HANDLE file) {
+		DWORD error = last_error(ERROR_SUCCESS);
+		if (error != ERROR_SUCCESS) {
+			return error;
+		}
+		DWORD sizeHigh;
+		DWORD sizeLow = SFileGetFileSize(file, &sizeHigh);
+		LONG posHigh = 0;
+		DWORD posLow = SFileSetFilePointer(file, 0, &posHigh, FILE_CURRENT);
+		if (sizeLow != SFILE_INVALID_SIZE && posLow != SFILE_INVALID_SIZE && make_uint64(posLow, posHigh) >= make_uint64(sizeLow, sizeHigh)) {
+			return ERROR_HANDLE_EOF;
+		}
+		return ERROR_FILE_CORRUPT;
+	}
+
+	//! Exposes \a method of \a type as a module function taking the object as
+	//! its first argument, e.g. SFileHasFile(mpq, name) for mpq.has_file(name).
+	template<PyTypeObject *type, FastMethod method>
+	PyObject * forward(PyObject *module, PyObject *const *args, Py_ssize_t nargs) {
+		if (nargs < 1 || !PyObject_TypeCheck(args[0], type)) {
+			PyErr_Format(PyExc_TypeError, "first argument must be a %s", type->tp_name);
+			return NULL;
+		}
+		return method(args[0], args + 1, nargs - 1);
+	}
+
+	//! Copies \a column into a new \a type (array.array) of \a typecode.
+	template<typename T>
+	PyObject * build_array(PyObject *type, char const *typecode, std::vector<T> const& column) {
+		/* y# gives None rather than b"" for NULL, which empty vectors may return */
+		char const *data = column.empty() ? "" : (char const *)column.data();
+		return PyObject_CallFunction(type, "sy#", typecode, data, (Py_ssize_t)(column.size() * sizeof(T)));
+	}
+
+	//! Copies the \a count items of \a o, a buffer of T, into \a column.
+	template<typename T>
+	bool copy_column(PyObject *o, size_t count, std::vector<T> *column) {
+		Py_buffer view;
+		if (PyObject_GetBuffer(o, &view, PyBUF_ND) < 0) {
+			return false;
+		}
+		bool valid = view.itemsize == sizeof(T) && (size_t)view.len == count * sizeof(T);
+		if (valid) {
+			column->assign((T const *)view.buf, (T const *)view.buf + count);
+		} else {
+			PyErr_Format(PyExc_ValueError, "FileList columns must hold one %zu-byte item per name", sizeof(T));
+		}
+		PyBuffer_Release(&view);
+		return valid;
+	}
+}
+
+#define FASTCALL(f) (PyCFunction)(void (*)(void))(f)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -13,23 +595,70 @@ extern "C" {
 static PyObject *StormError;
 static PyObject *NoMoreFilesError;
 
+static PyTypeObject ArchiveType = { PyVarObject_HEAD_INIT(NULL, 0) };
+static PyTypeObject FileType = { PyVarObject_HEAD_INIT(NULL, 0) };
+static PyTypeObject FindType = { PyVarObject_HEAD_INIT(NULL, 0) };
+static PyTypeObject FileListType;
+static PyTypeObject NameIndexType = { PyVarObject_HEAD_INIT(NULL, 0) };
+static PyObject *ArrayType; /* array.array */
+
+static PyObject * Handle_enter(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	Py_INCREF(self);
+	return self;
+}
+
 /*
  * Manipulating MPQ archives
  */
 
-static PyObject * Storm_SFileOpenArchive(PyObject *self, PyObject *args) {
+/* Wraps \a mpq, opened from \a name with \a flags, or closes it on failure */
+static PyObject * new_archive(PyTypeObject *type, HANDLE mpq, char const *name, DWORD flags) {
+	ArchiveObject *self = (ArchiveObject *)type->tp_alloc(type, 0);
+	if (!self) {
+		SFileCloseArchive(mpq);
+		return NULL;
+	}
+	self->mpq = mpq;
+	self->state = new ArchiveState;
+	self->state->source.name = name;
+	self->state->source.flags = flags;
+	self->state->set_file(open_archive_file(name, flags));
+	self->name = PyUnicode_FromString(name);
+	if (!self->name) {
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	return (PyObject *)self;
+}
+
+/*
+ * Opens \a name with \a flags. A \a lazy open skips the listfile and, for
+ * read-only archives, the attributes, until ensure_loaded() needs them.
+ */
+static PyObject * open_archive(PyTypeObject *type, char const *name, DWORD priority, DWORD flags, bool lazy) {
 	HANDLE mpq = NULL;
-	TCHAR *name;
-	DWORD priority;
-	int flags;
+	bool result;
+	DWORD error = ERROR_SUCCESS;
 
-	if (!python::parse_tuple(args, "SFileOpenArchive", &name, &priority, &flags)) {
-		return NULL;
+	unsigned int deferred = 0;
+	if (lazy) {
+		if (!(flags & MPQ_OPEN_NO_LISTFILE)) {
+			deferred |= DEFER_LISTFILE;
+		}
+		/* Loading attributes reopens the archive, which only readers can share */
+		if (!(flags & MPQ_OPEN_NO_ATTRIBUTES) && (flags & MPQ_OPEN_READ_ONLY)) {
+			deferred |= DEFER_ATTRIBUTES;
+		}
+		flags |= (deferred & DEFER_LISTFILE ? MPQ_OPEN_NO_LISTFILE : 0) | (deferred & DEFER_ATTRIBUTES ? MPQ_OPEN_NO_ATTRIBUTES : 0);
 	}
-	bool result = SFileOpenArchive(name, priority, MPQ_OPEN_READ_ONLY, &mpq);
+
+	Py_BEGIN_ALLOW_THREADS
+	result = SFileOpenArchive(name, priority, flags, &mpq);
+	if (!result) error = path_error(name, !(flags & MPQ_OPEN_READ_ONLY));
+	Py_END_ALLOW_THREADS
 
 	if (!result) {
-		DWORD error = GetLastError();
 		switch (error) {
 			case ERROR_FILE_NOT_FOUND:
 				PyErr_Format(PyExc_IOError, "Could not open archive: No such file or directory: %s", name);
@@ -42,17 +671,100 @@ static PyObject * Storm_SFileOpenArchive(PyObject *self, PyObject *args) {
 		return NULL;
 	}
 
-	return python::build_value(mpq);
+	PyObject *self = new_archive(type, mpq, name, flags);
+	if (self) {
+		((ArchiveObject *)self)->state->deferred = deferred;
+	}
+	return self;
 }
 
-static PyObject * Storm_SFileAddListFile(PyObject *self, PyObject *args) {
-	HANDLE mpq = NULL;
-	TCHAR *name;
+/*
+ * Loads the \a parts (DEFER_*) of \a archive its lazy open deferred, if any.
+ * The listfile is added in place. StormLib only loads the attributes when
+ * opening, so the archive is reopened for them; the previous handle stays open
+ * until the archive is closed, for the files and searches opened from it.
+ */
+static bool ensure_loaded(ArchiveObject *archive, unsigned int parts) {
+	if (!(archive->state->deferred & parts)) {
+		return true;
+	}
+	DWORD error = ERROR_SUCCESS;
+	if (!call_locked(archive, &archive->mpq, OP_LOAD, [&]() -> DWORD {
+		ArchiveState *state = archive->state;
+		unsigned int pending = state->deferred & parts;
+		if (pending & DEFER_ATTRIBUTES) {
+			ArchiveSource source = state->source;
+			source.flags &= ~(DWORD)MPQ_OPEN_NO_ATTRIBUTES;
+			if (pending & DEFER_LISTFILE) {
+				source.flags &= ~(DWORD)MPQ_OPEN_NO_LISTFILE;
+			}
+			HANDLE mpq;
+			if (!source.open(&mpq, &error, 0)) {
+				return error;
+			}
+			if (state->children.empty()) {
+				SFileCloseArchive(archive->mpq);
+			} else {
+				state->retired.push_back(archive->mpq);
+			}
+			archive->mpq = mpq;
+			state->source.flags = source.flags;
+			state->set_file(open_archive_file(source.name.c_str(), source.flags));
+		} else if (pending & DEFER_LISTFILE) {
+			error = SFileAddListFile(archive->mpq, NULL);
+			if (error != ERROR_SUCCESS) {
+				return error;
+			}
+			state->source.flags &= ~(DWORD)MPQ_OPEN_NO_LISTFILE;
+		}
+		state->deferred &= ~pending;
+		return ERROR_SUCCESS;
+	})) {
+		return false;
+	}
+
+	if (error != ERROR_SUCCESS) {
+		PyErr_Format(StormError, "Error loading archive %U: %i", archive->name, error);
+		return false;
+	}
+	return true;
+}
+
+static PyObject * Archive_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	static char const *kwlist[] = {"name", "priority", "flags", "lazy", NULL};
+	char const *name;
+	DWORD priority = 0;
+	DWORD flags = MPQ_OPEN_READ_ONLY;
+	int lazy = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|IIp:Archive", (char **)kwlist, &name, &priority, &flags, &lazy)) {
+		return NULL;
+	}
+
+	return open_archive(type, name, priority, flags, lazy);
+}
+
+static void Archive_dealloc(ArchiveObject *self) {
+	/* Files and searches keep the archive alive, so none are left open */
+	if (self->mpq) {
+		SFileCloseArchive(self->mpq);
+	}
+	delete self->state;
+	Py_XDECREF(self->name);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject * Archive_add_listfile(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	char const *name;
 
-	if (!python::parse_tuple(args, "SFileAddListFile", &mpq, &name)) {
+	if (!python::parse_args(args, nargs, "add_listfile", 1, &name)) {
+		return NULL;
+	}
+	DWORD result;
+	if (!call_locked(self, &self->mpq, OP_ADD_LISTFILE, [&]() -> DWORD { result = SFileAddListFile(self->mpq, name); return result; })) {
 		return NULL;
 	}
-	int result = SFileAddListFile(mpq, name);
 
 	if (result != ERROR_SUCCESS) {
 		PyErr_SetString(StormError, "Error adding listfile");
@@ -62,13 +774,64 @@ static PyObject * Storm_SFileAddListFile(PyObject *self, PyObject *args) {
 	Py_RETURN_NONE;
 }
 
-static PyObject * Storm_SFileFlushArchive(PyObject *self, PyObject *args) {
-	HANDLE mpq = NULL;
+static PyObject * Archive_load(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	if (!python::parse_args(args, nargs, "load", 0)) {
+		return NULL;
+	}
+	if (!ensure_loaded((ArchiveObject *)self_, DEFER_LISTFILE | DEFER_ATTRIBUTES)) {
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject * Archive_advise(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	unsigned int advice;
+	unsigned long long window = 32 << 20;
+
+	if (!python::parse_args(args, nargs, "advise", 1, &advice, &window)) {
+		return NULL;
+	}
+	if (advice & ~(unsigned int)(ADVISE_WILLNEED | ADVISE_DONTNEED)) {
+		PyErr_SetString(PyExc_ValueError, "advice must be a combination of ADVISE_* flags");
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	{
+		std::lock_guard<std::mutex> guard(self->state->lock);
+		self->state->advice = advice;
+		self->state->adviceWindow = window;
+	}
+	Py_END_ALLOW_THREADS
+
+	Py_RETURN_NONE;
+}
+
+static PyObject * Archive_parallel_read(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	unsigned long long threshold;
+	unsigned int threads = 0;
+
+	if (!python::parse_args(args, nargs, "parallel_read", 1, &threshold, &threads)) {
+		return NULL;
+	}
+	self->state->parallelThreshold = threshold;
+	self->state->parallelThreads = threads;
 
-	if (!python::parse_tuple(args, "SFileFlushArchive", &mpq)) {
+	Py_RETURN_NONE;
+}
+
+static PyObject * Archive_flush(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+
+	if (!python::parse_args(args, nargs, "flush", 0)) {
+		return NULL;
+	}
+	bool result;
+	if (!call_locked(self, &self->mpq, OP_FLUSH, [&]() -> DWORD { result = SFileFlushArchive(self->mpq); return call_error(result, ERROR_CAN_NOT_COMPLETE); })) {
 		return NULL;
 	}
-	bool result = SFileFlushArchive(mpq);
 
 	if (!result) {
 		PyErr_SetString(StormError, "Error flushing archive, archive may be corrupted!");
@@ -78,13 +841,27 @@ static PyObject * Storm_SFileFlushArchive(PyObject *self, PyObject *args) {
 	Py_RETURN_NONE;
 }
 
-static PyObject * Storm_SFileCloseArchive(PyObject *self, PyObject *args) {
-	HANDLE mpq = NULL;
+static PyObject * Archive_close(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
 
-	if (!python::parse_tuple (args, "SFileCloseArchive", &mpq)) {
+	if (!python::parse_args(args, nargs, "close", 0)) {
 		return NULL;
 	}
-	bool result = SFileCloseArchive(mpq);
+	bool result = true;
+	Py_BEGIN_ALLOW_THREADS
+	{
+		std::lock_guard<std::mutex> guard(self->state->lock);
+		if (self->mpq) {
+			while (!self->state->children.empty()) {
+				close_child(self, self->state->children.begin()->first);
+			}
+			result = SFileCloseArchive(self->mpq);
+			self->mpq = NULL;
+			self->state->close_retired();
+			self->state->set_file(-1);
+		}
+	}
+	Py_END_ALLOW_THREADS
 
 	if (!result) {
 		PyErr_SetString(StormError, "Error closing archive");
@@ -94,15 +871,26 @@ static PyObject * Storm_SFileCloseArchive(PyObject *self, PyObject *args) {
 	Py_RETURN_NONE;
 }
 
-static PyObject * Storm_SFileCompactArchive(PyObject *self, PyObject *args) {
-	HANDLE mpq = NULL;
-	TCHAR *listfile;
+static PyObject * Archive_exit(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	return Archive_close(self, NULL, 0);
+}
+
+static PyObject * Archive_compact(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	PyObject *listfileObject = Py_None;
+	char const *listfile;
 	bool reserved = 0; /* Unused */
 
-	if (!python::parse_tuple(args, "SFileCompactArchive", &mpq, &listfile)) {
+	if (!python::parse_args(args, nargs, "compact", 0, &listfileObject)) {
+		return NULL;
+	}
+	if (!optional_string(listfileObject, &listfile)) {
+		return NULL;
+	}
+	bool result;
+	if (!call_locked(self, &self->mpq, OP_COMPACT, [&]() -> DWORD { result = SFileCompactArchive(self->mpq, listfile, reserved); return call_error(result, ERROR_CAN_NOT_COMPLETE); })) {
 		return NULL;
 	}
-	bool result = SFileCompactArchive(mpq, listfile, reserved);
 
 	if (!result) {
 		PyErr_SetString(StormError, "Error compacting archive");
@@ -112,441 +900,5986 @@ static PyObject * Storm_SFileCompactArchive(PyObject *self, PyObject *args) {
 	Py_RETURN_NONE;
 }
 
+static PyObject * Archive_set_max_file_count(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	DWORD count;
+
+	if (!python::parse_args(args, nargs, "set_max_file_count", 1, &count)) {
+		return NULL;
+	}
+	bool result;
+	DWORD error = ERROR_SUCCESS;
+	if (!call_locked(self, &self->mpq, OP_SET_MAX_FILE_COUNT, [&]() -> DWORD {
+		result = SFileSetMaxFileCount(self->mpq, count);
+		error = call_error(result, ERROR_CAN_NOT_COMPLETE);
+		return error;
+	})) {
+		return NULL;
+	}
+
+	if (!result) {
+		PyErr_Format(StormError, "Error setting the maximum file count: %i", error);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
 /*
- * Using Patched archives
+ * Creating archives
+ *
+ * Created archives are writable. Other handles on them, such as those of
+ * worker threads, only see what has been flushed to the disk.
  */
 
-static PyObject * Storm_SFileOpenPatchArchive(PyObject *self, PyObject *args) {
+static PyObject * create_archive(PyTypeObject *type, char const *name, DWORD flags, DWORD maxFileCount) {
 	HANDLE mpq = NULL;
-	TCHAR *name;
-	char *prefix;
-	DWORD flags;
+	bool result;
+	DWORD error = ERROR_SUCCESS;
 
-	if (!python::parse_tuple(args, "SFileOpenPatchArchive", &mpq, &name, &prefix, &flags)) {
-		return NULL;
-	}
-	bool result = SFileOpenPatchArchive(mpq, name, prefix, flags);
+	Py_BEGIN_ALLOW_THREADS
+	result = SFileCreateArchive(name, flags, maxFileCount, &mpq);
+	if (!result) error = last_error(ERROR_CAN_NOT_COMPLETE);
+	Py_END_ALLOW_THREADS
 
 	if (!result) {
-		DWORD error = GetLastError();
-		switch (error) {
-			case ERROR_INVALID_HANDLE:
-				PyErr_SetString(PyExc_TypeError, "Could not patch archive: Invalid handle");
-				break;
-
-			case ERROR_INVALID_PARAMETER:
-				PyErr_SetString(PyExc_TypeError, "Could not patch archive: Invalid file name or patch prefix");
-				break;
+		PyErr_Format(StormError, "Error creating archive %s: %i", name, error);
+		return NULL;
+	}
 
-			case ERROR_FILE_NOT_FOUND:
-				PyErr_Format(PyExc_IOError, "Could not patch archive: No such file or directory: %s", name);
-				break;
+	return new_archive(type, mpq, name, MPQ_OPEN_READ_ONLY);
+}
 
-			case ERROR_ACCESS_DENIED:
-				PyErr_SetString(PyExc_IOError, "Could not patch archive: Access denied");
-				break;
+static PyObject * Archive_create(PyObject *cls, PyObject *const *args, Py_ssize_t nargs) {
+	char const *name;
+	DWORD flags = MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES;
+	DWORD maxFileCount = HASH_TABLE_SIZE_DEFAULT;
 
-			default:
-				PyErr_Format(StormError, "Could not patch archive: %i", error);
-				break;
-		}
+	if (!python::parse_args(args, nargs, "create", 1, &name, &flags, &maxFileCount)) {
 		return NULL;
 	}
 
-	Py_RETURN_TRUE;
+	return create_archive((PyTypeObject *)cls, name, flags, maxFileCount);
 }
 
-static PyObject * Storm_SFileIsPatchedArchive(PyObject *self, PyObject *args) {
-	HANDLE mpq = NULL;
+/*
+ * Archives in memory
+ *
+ * StormLib only opens archives by name. Archive.from_buffer() copies the buffer
+ * once into an anonymous memory file and opens that through /proc with
+ * BASE_PROVIDER_MAP, so StormLib maps the same pages: there is no temporary
+ * file on disk and no read() syscall per sector. The memory file lives as long
+ * as the archive object, which lets worker threads open it again.
+ */
+
+static PyObject * Archive_from_buffer(PyObject *cls, PyObject *const *args, Py_ssize_t nargs) {
+	PyObject *bufferObject;
+	DWORD flags = 0;
+	PyObject *lazyObject = Py_False;
+
+	if (!python::parse_args(args, nargs, "from_buffer", 1, &bufferObject, &flags, &lazyObject)) {
+		return NULL;
+	}
+	int lazy = PyObject_IsTrue(lazyObject);
+	if (lazy < 0) {
+		return NULL;
+	}
+#ifdef HAVE_MEMFD
+	Py_buffer buffer;
+	if (PyObject_GetBuffer(bufferObject, &buffer, PyBUF_SIMPLE) < 0) {
+		return NULL;
+	}
+	int fd;
+	int error = 0;
+	Py_BEGIN_ALLOW_THREADS
+	fd = memfd_create("mpq", MFD_CLOEXEC);
+	if (fd < 0) {
+		error = errno;
+	} else if (ftruncate(fd, buffer.len) != 0) {
+		error = errno;
+	} else {
+		char const *data = (char const *)buffer.buf;
+		Py_ssize_t written = 0;
+		while (written < buffer.len) {
+			ssize_t count = pwrite(fd, data + written, buffer.len - written, written);
+			if (count < 0 && errno != EINTR) {
+				error = errno;
+				break;
+			}
+			written += std::max<ssize_t>(count, 0);
+		}
+	}
+	if (error && fd >= 0) {
+		close(fd);
+	}
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&buffer);
+
+	if (error) {
+		errno = error;
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+
+	char name[32];
+	snprintf(name, sizeof(name), "/proc/self/fd/%d", fd);
+	/* The memory file is only written once, before it is mapped */
+	PyObject *self = open_archive((PyTypeObject *)cls, name, 0, flags | BASE_PROVIDER_MAP | MPQ_OPEN_READ_ONLY, lazy);
+	if (!self) {
+		close(fd);
+		return NULL;
+	}
+	((ArchiveObject *)self)->state->memory = fd;
+	return self;
+#else
+	PyErr_SetString(PyExc_NotImplementedError, "Opening archives from memory is only supported on Linux");
+	return NULL;
+#endif
+}
+
+/*
+ * Using Patched archives
+ */
+
+static PyObject * Archive_patch(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	char const *name;
+	PyObject *prefixObject = Py_None;
+	char const *prefix;
+	DWORD flags = 0;
+
+	if (!python::parse_args(args, nargs, "patch", 1, &name, &prefixObject, &flags)) {
+		return NULL;
+	}
+	if (!optional_string(prefixObject, &prefix)) {
+		return NULL;
+	}
+	bool result;
+	DWORD error = ERROR_SUCCESS;
+	if (!call_locked(self, &self->mpq, OP_PATCH, [&]() -> DWORD {
+		result = SFileOpenPatchArchive(self->mpq, name, prefix, flags);
+		if (!result) {
+			error = path_error(name, false);
+		} else {
+			ArchiveSource::Patch patch = {name, prefix ? prefix : "", prefix != NULL, flags};
+			self->state->source.patches.push_back(patch);
+			self->state->id = next_archive_id();
+		}
+		return error;
+	})) {
+		return NULL;
+	}
+
+	if (!result) {
+		switch (error) {
+			case ERROR_INVALID_HANDLE:
+				PyErr_SetString(PyExc_TypeError, "Could not patch archive: Invalid handle");
+				break;
+
+			case ERROR_INVALID_PARAMETER:
+				PyErr_SetString(PyExc_TypeError, "Could not patch archive: Invalid file name or patch prefix");
+				break;
+
+			case ERROR_FILE_NOT_FOUND:
+				PyErr_Format(PyExc_IOError, "Could not patch archive: No such file or directory: %s", name);
+				break;
+
+			case ERROR_ACCESS_DENIED:
+				PyErr_SetString(PyExc_IOError, "Could not patch archive: Access denied");
+				break;
+
+			default:
+				PyErr_Format(StormError, "Could not patch archive: %i", error);
+				break;
+		}
+		return NULL;
+	}
+
+	Py_RETURN_TRUE;
+}
+
+static PyObject * Archive_is_patched(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+
+	if (!python::parse_args(args, nargs, "is_patched", 0)) {
+		return NULL;
+	}
+	bool result;
+	if (!call_locked(self, &self->mpq, OP_IS_PATCHED, [&]() -> DWORD { result = SFileIsPatchedArchive(self->mpq); return ERROR_SUCCESS; })) {
+		return NULL;
+	}
+
+	if (!result) {
+		Py_RETURN_FALSE;
+	}
+
+	Py_RETURN_TRUE;
+}
+
+/*
+ * Reading Files
+ */
+
+/* Reads the names of the archives holding \a file, from the base one. Returns false if StormLib cannot tell. */
+static bool patch_chain(HANDLE file, std::vector<std::string> *names) {
+	char chain[0x1000];
+	if (!SFileGetFileInfo(file, SFileInfoPatchChain, chain, sizeof(chain) - 1, NULL)) {
+		return false;
+	}
+	chain[sizeof(chain) - 1] = '\0';
+	for (char const *name = chain; name < chain + sizeof(chain) && *name; name += strlen(name) + 1) {
+		names->push_back(name);
+	}
+	return true;
+}
+
+/* Counts the length of the patch chain of \a file. Must hold the archive lock. */
+static void count_patch_depth(FileObject *file) {
+	std::vector<std::string> chain;
+	DWORD depth;
+	if (patch_chain(file->file, &chain)) {
+		depth = (DWORD)chain.size();
+	} else {
+		/* Chain too long, or not provided by this StormLib: assume every patch */
+		depth = (DWORD)file->archive->state->source.patches.size() + 1;
+	}
+	for (HandleStats *stats : {&file->archive->state->stats, file->stats}) {
+		++stats->patchedOpens;
+		stats->patchDepth += depth > 0 ? depth - 1 : 0;
+	}
+}
+
+static PyObject * Archive_open_file(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	char const *name;
+	DWORD scope = SFILE_OPEN_FROM_MPQ;
+
+	if (!python::parse_args(args, nargs, "open_file", 1, &name, &scope)) {
+		return NULL;
+	}
+	FileObject *file = (FileObject *)FileType.tp_alloc(&FileType, 0);
+	if (!file) {
+		return NULL;
+	}
+	Py_INCREF(self);
+	file->archive = self;
+	file->stats = new HandleStats;
+
+	bool result;
+	if (!call_locked(self, &self->mpq, OP_OPEN_FILE, [&]() -> DWORD {
+		result = SFileOpenFileEx(self->mpq, name, scope, &file->file);
+		if (!result) {
+			return open_error(self->mpq, name, scope);
+		}
+		add_child(self, &file->file, SFileCloseFile);
+		if (!self->state->source.patches.empty()) {
+			count_patch_depth(file);
+		}
+		return ERROR_SUCCESS;
+	})) {
+		Py_DECREF(file);
+		return NULL;
+	}
+
+	if (!result) {
+		PyErr_SetString(StormError, "Error opening file");
+		Py_DECREF(file);
+		return NULL;
+	}
+
+	return (PyObject *)file;
+}
+
+static void File_dealloc(FileObject *self) {
+	if (self->archive) {
+		close_child_locked(self->archive, &self->file);
+		Py_DECREF(self->archive);
+	}
+	delete self->stats;
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject * File_size(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	FileObject *self = (FileObject *)self_;
+
+	if (!python::parse_args(args, nargs, "size", 0)) {
+		return NULL;
+	}
+	DWORD sizeHigh;
+	DWORD sizeLow;
+	if (!call_locked(self->archive, &self->file, OP_SIZE, self->stats, [&]() -> DWORD {
+		sizeLow = SFileGetFileSize(self->file, &sizeHigh);
+		return call_error(sizeLow != SFILE_INVALID_SIZE, ERROR_CAN_NOT_COMPLETE);
+	})) {
+		return NULL;
+	}
+
+	if (sizeLow == SFILE_INVALID_SIZE) {
+		PyErr_SetString(StormError, "Error getting file size");
+		return NULL;
+	}
+
+	return python::build_value(make_uint64(sizeLow, sizeHigh));
+}
+
+static PyObject * File_seek(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	FileObject *self = (FileObject *)self_;
+	long long offset = 0;
+	DWORD whence = FILE_BEGIN;
+
+	if (!python::parse_args(args, nargs, "seek", 1, &offset, &whence)) {
+		return NULL;
+	}
+
+	//! \note The StormLib API is broken here: LONG is signed, while it surely
+	//! should be unsigned.
+	LONG posLow =  (offset & 0x00000000FFFFFFFF) >> 0;
+	LONG posHigh = (offset & 0xFFFFFFFF00000000) >> 32;
+	DWORD result;
+	DWORD error = ERROR_SUCCESS;
+	if (!call_locked(self->archive, &self->file, OP_SEEK, self->stats, [&]() -> DWORD {
+		result = SFileSetFilePointer(self->file, posLow, &posHigh, whence);
+		error = call_error(result != SFILE_INVALID_SIZE, ERROR_INVALID_PARAMETER);
+		return error;
+	})) {
+		return NULL;
+	}
+
+	if (result == SFILE_INVALID_SIZE) {
+		switch (error) {
+			case ERROR_INVALID_HANDLE:
+				PyErr_SetString(PyExc_TypeError, "Could not seek within file: Invalid handle");
+				break;
+			case ERROR_INVALID_PARAMETER:
+				if (whence != FILE_BEGIN && whence != FILE_CURRENT && whence != FILE_END) {
+					PyErr_Format(PyExc_TypeError, "Could not seek within file: %i is not a valid whence", whence);
+				} else {
+					PyErr_Format(PyExc_TypeError, "Could not seek within file: offset %lld is too large", offset);
+				}
+				break;
+			default:
+				PyErr_Format(StormError, "Error seeking in file: %i", error);
+				break;
+		}
+		return NULL;
+	}
+
+	return python::build_value(make_uint64(result, posHigh));
+}
+
+static PyObject * File_tell(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	FileObject *self = (FileObject *)self_;
+
+	if (!python::parse_args(args, nargs, "tell", 0)) {
+		return NULL;
+	}
+	DWORD posLow;
+	LONG posHigh = 0;
+	if (!call_locked(self->archive, &self->file, OP_TELL, self->stats, [&]() -> DWORD {
+		posLow = SFileSetFilePointer(self->file, 0, &posHigh, FILE_CURRENT);
+		return call_error(posLow != SFILE_INVALID_SIZE, ERROR_CAN_NOT_COMPLETE);
+	})) {
+		return NULL;
+	}
+
+	if (posLow == SFILE_INVALID_SIZE) {
+		PyErr_SetString(StormError, "Error getting file position");
+		return NULL;
+	}
+
+	return python::build_value(make_uint64(posLow, posHigh));
+}
+
+/*
+ * Sector reads
+ *
+ * StormLib decompresses the sectors of a file one after the other, on the
+ * thread reading it. Reads of at least the archive's threshold, see
+ * Archive.parallel_read(), look the sectors they span up in the sector offset
+ * table of the file instead. Runs of sectors are then read from the archive
+ * file and decompressed on several threads, straight into the destination
+ * buffer; only the sectors a read starts or ends within go through a buffer
+ * of their own. The archive file is read through the descriptor opened along
+ * with the archive, so that a file replaced on disk since is not read from.
+ * Files StormLib has to decrypt, patch or check the sector CRCs of,
+ * single-unit files and archives whose files do not lie at their offset in the
+ * archive file (see archive_descriptor()) are left to StormLib, as are files
+ * whose sector table does not check out or whose sectors fail to decompress.
+ */
+
+#ifndef _WIN32
+/*
+ * Finds the \a offset of \a mpq in the file holding it, if files lie at their
+ * byte offset there. Must hold the archive lock.
+ */
+static bool flat_archive(HANDLE mpq, ULONGLONG *offset) {
+	DWORD streamFlags;
+	return SFileGetFileInfo(mpq, SFileMpqStreamFlags, &streamFlags, sizeof(streamFlags), NULL)
+		&& (streamFlags & STREAM_PROVIDER_MASK) == STREAM_PROVIDER_FLAT
+		&& (streamFlags & BASE_PROVIDER_MASK) != BASE_PROVIDER_HTTP
+		&& SFileGetFileInfo(mpq, SFileMpqHeaderOffset, offset, sizeof(*offset), NULL);
+}
+
+/*
+ * Duplicates \a file, the descriptor of the file \a mpq was opened from (see
+ * open_archive_file()), holding the archive at \a offset, see flat_archive().
+ * Returns -1 if there is none, or if files do not lie at their offset there.
+ * Must hold the archive lock.
+ */
+static int archive_descriptor(int file, HANDLE mpq, ULONGLONG *offset) {
+	if (file < 0 || !flat_archive(mpq, offset)) {
+		return -1;
+	}
+	return fcntl(file, F_DUPFD_CLOEXEC, 0);
+}
+#endif
+
+/* Where the sectors of a file lie, and how they are compressed */
+struct SectorPlan {
+	ULONGLONG offset; /* of the file in the archive file */
+	DWORD flags;
+	bool version2; /* archive of format 2 or later, see decompress_sector() */
+	DWORD sectorSize;
+	uint64_t fileSize;
+	uint64_t position; /* of the file pointer */
+};
+
+/*
+ * Whether \a file of \a mpq, opened from \a state, can be read by sector, and
+ * how. Sets \a fd to a descriptor of the archive file, to be closed, if so.
+ * Must hold the archive lock.
+ */
+static bool plan_sectors(ArchiveState const& state, HANDLE mpq, HANDLE file, SectorPlan *plan, int *fd) {
+#ifndef _WIN32
+	DWORD serial = MPQ_FILE_ENCRYPTED | MPQ_FILE_PATCH_FILE | MPQ_FILE_DELETE_MARKER | MPQ_FILE_SINGLE_UNIT | MPQ_FILE_SECTOR_CRC;
+	DWORD fileSize;
+	ULONGLONG byteOffset;
+	ULONGLONG headerOffset;
+	TMPQHeader header;
+	if (!SFileGetFileInfo(file, SFileInfoFlags, &plan->flags, sizeof(plan->flags), NULL)
+		|| !(plan->flags & MPQ_FILE_EXISTS) || !(plan->flags & MPQ_FILE_COMPRESS_MASK) || (plan->flags & serial)
+		|| !SFileGetFileInfo(file, SFileInfoFileSize, &fileSize, sizeof(fileSize), NULL)
+		|| !SFileGetFileInfo(file, SFileInfoByteOffset, &byteOffset, sizeof(byteOffset), NULL)
+		|| !SFileGetFileInfo(mpq, SFileMpqSectorSize, &plan->sectorSize, sizeof(plan->sectorSize), NULL)
+		|| !plan->sectorSize
+		|| !SFileGetFileInfo(mpq, SFileMpqHeader, &header, sizeof(header), NULL)) {
+		return false;
+	}
+	std::vector<std::string> chain;
+	if (SFileIsPatchedArchive(mpq) && (!patch_chain(file, &chain) || chain.size() > 1)) {
+		return false;
+	}
+	LONG positionHigh = 0;
+	DWORD positionLow = SFileSetFilePointer(file, 0, &positionHigh, FILE_CURRENT);
+	if (positionLow == SFILE_INVALID_SIZE) {
+		return false;
+	}
+	*fd = archive_descriptor(state.file, mpq, &headerOffset);
+	if (*fd < 0) {
+		return false;
+	}
+
+	plan->offset = headerOffset + byteOffset;
+	plan->version2 = header.wFormatVersion >= MPQ_FORMAT_VERSION_2;
+	plan->fileSize = fileSize;
+	plan->position = make_uint64(positionLow, positionHigh);
+	return true;
+#else
+	return false;
+#endif
+}
+
+#ifndef _WIN32
+/* Reads \a size bytes of \a fd at \a offset into \a buffer */
+static bool pread_all(int fd, char *buffer, size_t size, uint64_t offset) {
+	while (size) {
+		ssize_t count = pread(fd, buffer, size, (off_t)offset);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			return false;
+		}
+		buffer += count;
+		size -= count;
+		offset += count;
+	}
+	return true;
+}
+
+/*
+ * Decompresses the sector of \a inSize bytes at \a in into the \a outSize
+ * bytes at \a out, as StormLib does: sectors compression did not make smaller
+ * are stored as is.
+ */
+static bool decompress_sector(SectorPlan const& plan, char *in, DWORD inSize, char *out, DWORD outSize) {
+	if (inSize == outSize) {
+		memcpy(out, in, inSize);
+		return true;
+	}
+	int length = (int)outSize;
+	int result;
+	if (plan.flags & MPQ_FILE_IMPLODE) {
+		result = SCompExplode(out, &length, in, (int)inSize);
+	} else if (plan.version2) {
+		result = SCompDecompress2(out, &length, in, (int)inSize);
+	} else {
+		result = SCompDecompress(out, &length, in, (int)inSize);
+	}
+	return result && length == (int)outSize;
+}
+
+/* A read split by sector, see read_sectors() */
+struct SectorJob {
+	SectorPlan plan;
+	int fd; /* archive file, see archive_descriptor() */
+	char *buffer;
+	uint64_t start; /* of the read in the file */
+	uint64_t end;
+	uint64_t first; /* sector the read starts within */
+	/* Offsets of the sectors of the read in the file, and the end of the last one */
+	std::vector<DWORD> table;
+	uint64_t chunk; /* sectors taken at once by a thread */
+
+	std::atomic<uint64_t> next; /* next sector to take, from first */
+	std::atomic<bool> failed;
+
+	SectorJob() : fd(-1), buffer(NULL), start(0), end(0), first(0), chunk(1), next(0), failed(false) {}
+	~SectorJob() {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+};
+
+static void sector_worker(SectorJob *job) {
+	DWORD sectorSize = job->plan.sectorSize;
+	uint64_t count = job->table.size() - 1;
+	std::vector<char> input;
+	std::vector<char> output;
+	while (!job->failed) {
+		uint64_t begin = job->next.fetch_add(job->chunk);
+		if (begin >= count) {
+			break;
+		}
+		uint64_t end = std::min(begin + job->chunk, count);
+
+		/* Sectors follow each other in the archive file, read them at once */
+		input.resize(job->table[end] - job->table[begin]);
+		if (!pread_all(job->fd, &input[0], input.size(), job->plan.offset + job->table[begin])) {
+			job->failed = true;
+			break;
+		}
+		for (uint64_t i = begin; i < end; ++i) {
+			uint64_t sectorStart = (job->first + i) * sectorSize;
+			DWORD outSize = (DWORD)std::min<uint64_t>(sectorSize, job->plan.fileSize - sectorStart);
+			bool whole = sectorStart >= job->start && sectorStart + outSize <= job->end;
+			if (!whole) {
+				output.resize(outSize);
+			}
+			char *out = whole ? job->buffer + (sectorStart - job->start) : &output[0];
+			if (!decompress_sector(job->plan, &input[job->table[i] - job->table[begin]], job->table[i + 1] - job->table[i], out, outSize)) {
+				job->failed = true;
+				break;
+			}
+			if (!whole) {
+				uint64_t from = std::max(sectorStart, job->start);
+				uint64_t to = std::min(sectorStart + outSize, job->end);
+				memcpy(job->buffer + (from - job->start), &output[from - sectorStart], to - from);
+			}
+		}
+	}
+}
+
+/* Loads the sector table of \a job, then decompresses its sectors on up to \a threads threads */
+static bool run_sectors(SectorJob *job, unsigned int threads) {
+	/* The table holds the offset of each sector and the end of the last one */
+	DWORD sectorSize = job->plan.sectorSize;
+	uint64_t sectors = (job->plan.fileSize + sectorSize - 1) / sectorSize;
+	job->first = job->start / sectorSize;
+	job->table.resize((job->end - 1) / sectorSize - job->first + 2);
+	DWORD tableSize;
+	bool valid = pread_all(job->fd, (char *)&tableSize, sizeof(tableSize), job->plan.offset)
+		&& tableSize == (sectors + 1) * sizeof(DWORD)
+		&& pread_all(job->fd, (char *)&job->table[0], job->table.size() * sizeof(DWORD), job->plan.offset + job->first * sizeof(DWORD));
+	for (size_t i = 0; valid && i + 1 < job->table.size(); ++i) {
+		uint64_t outSize = std::min<uint64_t>(sectorSize, job->plan.fileSize - (job->first + i) * sectorSize);
+		valid = job->table[i] >= tableSize && job->table[i] < job->table[i + 1] && job->table[i + 1] - job->table[i] <= outSize;
+	}
+
+	if (valid) {
+		uint64_t count = job->table.size() - 1;
+		job->chunk = std::max<uint64_t>((256 << 10) / sectorSize, 1);
+		if (!threads) {
+			threads = std::max(std::thread::hardware_concurrency(), 1u);
+		}
+		threads = (unsigned int)std::min<uint64_t>(threads, (count + job->chunk - 1) / job->chunk);
+
+		/* This thread takes part, and is enough if no other could be started */
+		std::vector<std::thread> workers;
+		for (unsigned int i = 1; i < threads; ++i) {
+			try {
+				workers.emplace_back(sector_worker, job);
+			} catch (std::system_error const&) {
+				break;
+			}
+		}
+		sector_worker(job);
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+		valid = !job->failed;
+	}
+	return valid;
+}
+#endif
+
+/*
+ * Reads up to \a size bytes into \a buffer by sector, on several threads, if
+ * \a self allows it. Sets \a done to false, leaving the file pointer as is,
+ * if the read is left to StormLib.
+ */
+static bool read_sectors(FileObject *self, char *buffer, DWORD size, DWORD *bytesRead, bool *done) {
+	*done = false;
+#ifndef _WIN32
+	ArchiveState *state = self->archive->state;
+	uint64_t threshold = state->parallelThreshold;
+	if (!threshold || size < threshold) {
+		return true;
+	}
+
+	SectorJob job;
+	bool planned;
+	if (!call_locked(self->archive, &self->file, OP_READ_SECTORS, self->stats, [&]() -> DWORD {
+		/* Files that cannot be planned are read by StormLib instead */
+		planned = plan_sectors(*state, self->archive->mpq, self->file, &job.plan, &job.fd);
+		return ERROR_SUCCESS;
+	})) {
+		return false;
+	}
+	job.buffer = buffer;
+	job.start = planned ? std::min(job.plan.position, job.plan.fileSize) : 0;
+	job.end = planned ? std::min<uint64_t>(job.start + size, job.plan.fileSize) : 0;
+	if (job.end - job.start < threshold) {
+		return true;
+	}
+
+	unsigned int threads = state->parallelThreads;
+	Py_BEGIN_ALLOW_THREADS
+	*done = run_sectors(&job, threads);
+	Py_END_ALLOW_THREADS
+	if (!*done) {
+		return true;
+	}
+
+	/* Move the file pointer past the read, as StormLib would have */
+	*bytesRead = (DWORD)(job.end - job.start);
+	return call_locked(self->archive, &self->file, OP_READ_SECTORS, self->stats, [&]() -> DWORD {
+		LONG high = (LONG)(job.end >> 32);
+		SFileSetFilePointer(self->file, (LONG)(DWORD)job.end, &high, FILE_BEGIN);
+		for (HandleStats *stats : {&state->stats, self->stats}) {
+			stats->bytesRequested += size;
+			stats->bytesRead += *bytesRead;
+			stats->bytesParallel += *bytesRead;
+		}
+		return ERROR_SUCCESS;
+	});
+#else
+	return true;
+#endif
+}
+
+/* Reads up to \a size bytes into \a buffer, which must stay valid without the GIL */
+static bool read_file(FileObject *self, char *buffer, DWORD size, DWORD *bytesRead) {
+	bool result;
+	DWORD error = ERROR_SUCCESS;
+	*bytesRead = 0;
+	bool done;
+	if (!read_sectors(self, buffer, size, bytesRead, &done)) {
+		return false;
+	}
+	if (done) {
+		return true;
+	}
+	if (!call_locked(self->archive, &self->file, OP_READ, self->stats, [&]() -> DWORD {
+		result = SFileReadFile(self->file, buffer, size, bytesRead, NULL);
+		if (!result) error = read_error(self->file);
+		for (HandleStats *stats : {&self->archive->state->stats, self->stats}) {
+			stats->bytesRequested += size;
+			stats->bytesRead += *bytesRead;
+		}
+		return error;
+	})) {
+		return false;
+	}
+
+	/* Emulate python's read() behaviour => we don't care if we go past EOF */
+	if (!result && error != ERROR_HANDLE_EOF) {
+		switch (error) {
+			case ERROR_INVALID_HANDLE:
+				PyErr_SetString(PyExc_TypeError, "Could not read file: Invalid handle");
+				break;
+			case ERROR_FILE_CORRUPT:
+				PyErr_SetString(PyExc_IOError, "Could not read file: File is corrupt");
+				break;
+			default:
+				PyErr_Format(StormError, "Could not read file: %i", error);
+				break;
+		}
+		return false;
+	}
+
+	return true;
+}
+
+static PyObject * File_read(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	FileObject *self = (FileObject *)self_;
+	long long size = -1;
+	DWORD bytesRead;
+
+	if (!python::parse_args(args, nargs, "read", 0, &size)) {
+		return NULL;
+	}
+
+	if (size < 0) {
+		/* Read up to the end of the file */
+		DWORD sizeLow, sizeHigh, posLow;
+		LONG posHigh = 0;
+		if (!call_locked(self->archive, &self->file, OP_SIZE, self->stats, [&]() -> DWORD {
+			sizeLow = SFileGetFileSize(self->file, &sizeHigh);
+			posLow = SFileSetFilePointer(self->file, 0, &posHigh, FILE_CURRENT);
+			return call_error(sizeLow != SFILE_INVALID_SIZE && posLow != SFILE_INVALID_SIZE, ERROR_CAN_NOT_COMPLETE);
+		})) {
+			return NULL;
+		}
+		if (sizeLow == SFILE_INVALID_SIZE || posLow == SFILE_INVALID_SIZE) {
+			PyErr_SetString(StormError, "Error getting file size");
+			return NULL;
+		}
+		size = make_uint64(sizeLow, sizeHigh) - make_uint64(posLow, posHigh);
+	}
+
+	/* Larger reads are short, as allowed by read() */
+	DWORD toRead = (DWORD)std::min<long long>(size, std::numeric_limits<DWORD>::max() - 1);
+
+	/* Read straight into the bytes object, shrinking it on short reads */
+	PyObject *buffer = PyBytes_FromStringAndSize(NULL, toRead);
+	if (!buffer) {
+		return NULL;
+	}
+
+	if (!read_file(self, PyBytes_AS_STRING(buffer), toRead, &bytesRead)) {
+		Py_DECREF(buffer);
+		return NULL;
+	}
+
+	if (bytesRead != toRead && _PyBytes_Resize(&buffer, bytesRead) < 0) {
+		return NULL;
+	}
+
+	return buffer;
+}
+
+static PyObject * File_readinto(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	FileObject *self = (FileObject *)self_;
+	Py_buffer buffer;
+	DWORD bytesRead;
+
+	if (!python::parse_args(args, nargs, "readinto", 1, &buffer)) {
+		return NULL;
+	}
+
+	/* Larger buffers get a short read, as allowed by readinto() */
+	DWORD size = (DWORD)std::min<Py_ssize_t>(buffer.len, std::numeric_limits<DWORD>::max() - 1);
+	bool result = read_file(self, (char *)buffer.buf, size, &bytesRead);
+	PyBuffer_Release(&buffer);
+
+	if (!result) {
+		return NULL;
+	}
+
+	return python::build_value(bytesRead);
+}
+
+static PyObject * File_close(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	FileObject *self = (FileObject *)self_;
+
+	if (!python::parse_args(args, nargs, "close", 0)) {
+		return NULL;
+	}
+
+	if (!close_child_locked(self->archive, &self->file)) {
+		PyErr_SetString(StormError, "Error closing file");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject * File_exit(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	return File_close(self, NULL, 0);
+}
+
+static PyObject * Archive_has_file(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	char const *name;
+
+	if (!python::parse_args(args, nargs, "has_file", 1, &name)) {
+		return NULL;
+	}
+	bool result;
+	DWORD error = ERROR_SUCCESS;
+	if (!call_locked(self, &self->mpq, OP_HAS_FILE, [&]() -> DWORD {
+		result = SFileHasFile(self->mpq, name);
+		error = call_error(result, ERROR_FILE_NOT_FOUND);
+		return error;
+	})) {
+		return NULL;
+	}
+
+	if (!result) {
+		if (error == ERROR_FILE_NOT_FOUND) {
+			Py_RETURN_FALSE;
+		} else {
+			PyErr_SetString(StormError, "Error searching for file");
+			return NULL;
+		}
+	}
+
+	Py_RETURN_TRUE;
+}
+
+static PyObject * File_get_name(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	FileObject *self = (FileObject *)self_;
+	char name[MAX_PATH];
+
+	if (!python::parse_args(args, nargs, "get_name", 0)) {
+		return NULL;
+	}
+	bool result;
+	if (!call_locked(self->archive, &self->file, OP_GET_NAME, self->stats, [&]() -> DWORD { result = SFileGetFileName(self->file, name); return call_error(result, ERROR_CAN_NOT_COMPLETE); })) {
+		return NULL;
+	}
+
+	if (!result) {
+		PyErr_SetString(StormError, "Error getting file name");
+		return NULL;
+	}
+
+	return python::build_value(name);
+}
+
+/* Returns the list of the NUL-separated strings in the \a size bytes at \a strings, ending at an empty one */
+static PyObject * build_string_list(char const *strings, size_t size) {
+	PyObject *result = PyList_New(0);
+	for (char const *end = strings + size; result && strings < end && *strings; strings += strlen(strings) + 1) {
+		PyObject *item = PyUnicode_FromStringAndSize(strings, strnlen(strings, end - strings));
+		if (!item || PyList_Append(result, item) < 0) {
+			Py_CLEAR(result);
+		}
+		Py_XDECREF(item);
+	}
+	return result;
+}
+
+/*
+ * Counted in the stats of \a archive and in \a stats, those of the file if any.
+ * Values of 4 and 8 bytes are returned as int, strings as str, the patch chain
+ * as a list of str and other structures as bytes.
+ */
+static PyObject * get_info(ArchiveObject *archive, HANDLE const *handle, HandleStats *stats, PyObject *const *args, Py_ssize_t nargs) {
+	SFileInfoClass infoClass;
+
+	if (!python::parse_args(args, nargs, "info", 1, &infoClass)) {
+		return NULL;
+	}
+
+	/* Most classes fit 8 bytes, others are read again once their size is known */
+	ULONGLONG value = 0;
+	std::vector<char> buffer;
+	DWORD needed = 0;
+	bool result;
+	DWORD error = ERROR_SUCCESS;
+	if (!call_locked(archive, handle, OP_INFO, stats, [&]() -> DWORD {
+		result = SFileGetFileInfo(*handle, infoClass, &value, sizeof(value), &needed);
+		/* StormLib tells the size it needs when the buffer is too small */
+		if (!result && needed > sizeof(value)) {
+			buffer.resize(needed);
+			result = SFileGetFileInfo(*handle, infoClass, buffer.data(), needed, &needed);
+		}
+		error = call_error(result, infoClass > SFileInfoCRC32 ? ERROR_INVALID_PARAMETER : ERROR_CAN_NOT_COMPLETE);
+		return error;
+	})) {
+		return NULL;
+	}
+
+	if (!result) {
+		if (error == ERROR_INVALID_PARAMETER) {
+			PyErr_SetString(PyExc_TypeError, "Invalid INFO_TYPE queried");
+			return NULL;
+		} else {
+			PyErr_SetString(StormError, "Error getting info");
+			return NULL;
+		}
+	}
+
+	char const *data = buffer.empty() ? (char const *)&value : buffer.data();
+	switch (infoClass) {
+		case SFileMpqFileName:
+			return PyUnicode_FromStringAndSize(data, strnlen(data, needed));
+		case SFileInfoPatchChain:
+			return build_string_list(data, needed);
+		default:
+			break;
+	}
+	if (needed == sizeof(DWORD)) {
+		DWORD dword;
+		memcpy(&dword, data, sizeof(dword));
+		return python::build_value(dword);
+	}
+	if (needed == sizeof(ULONGLONG)) {
+		return python::build_value((unsigned long long)value);
+	}
+
+	return PyBytes_FromStringAndSize(data, needed);
+}
+
+static PyObject * Archive_info(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	return get_info(self, &self->mpq, NULL, args, nargs);
+}
+
+static PyObject * File_info(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	FileObject *self = (FileObject *)self_;
+	return get_info(self->archive, &self->file, self->stats, args, nargs);
+}
+
+/*
+ * Stored files
+ *
+ * Files stored as is, neither compressed nor encrypted, lie in one piece in
+ * the archive file, at the offset of the archive plus their own. Unless they
+ * are patched, extract_file() copies them in the kernel, from the archive file
+ * to the destination, with copy_file_range() or sendfile(), or else with
+ * pread() and pwrite(). StormLib's buffers are skipped entirely. The archive
+ * file is read through the descriptor opened along with the handle, so that a
+ * file replaced on disk since is not copied from. Archives without one, and
+ * those read through a stream provider other than the flat one (partial,
+ * encrypted, HTTP...), which do not keep files at their offset, always go
+ * through StormLib, as do files the copy fails for.
+ */
+
+#ifndef _WIN32
+/* Where the data of a file stored as is lies */
+struct StoredRange {
+	int fd; /* archive file, see archive_descriptor() */
+	ULONGLONG offset;
+	ULONGLONG size;
+
+	StoredRange() : fd(-1), offset(0), size(0) {}
+	~StoredRange() {
+		close_archive_file(fd);
+	}
+};
+
+/*
+ * Whether \a file of \a mpq, opened from \a archiveFile, is stored as is, and
+ * where. Must hold the archive lock.
+ */
+static bool find_stored(int archiveFile, HANDLE mpq, HANDLE file, StoredRange *range) {
+	DWORD flags;
+	DWORD fileSize;
+	DWORD compressedSize;
+	ULONGLONG byteOffset;
+	ULONGLONG headerOffset;
+	DWORD unstored = MPQ_FILE_COMPRESS_MASK | MPQ_FILE_ENCRYPTED | MPQ_FILE_PATCH_FILE | MPQ_FILE_DELETE_MARKER | MPQ_FILE_SECTOR_CRC;
+	if (!SFileGetFileInfo(file, SFileInfoFlags, &flags, sizeof(flags), NULL)
+		|| !(flags & MPQ_FILE_EXISTS) || (flags & unstored)
+		|| !SFileGetFileInfo(file, SFileInfoFileSize, &fileSize, sizeof(fileSize), NULL)
+		|| !SFileGetFileInfo(file, SFileInfoCompressedSize, &compressedSize, sizeof(compressedSize), NULL)
+		|| fileSize != compressedSize
+		|| !SFileGetFileInfo(file, SFileInfoByteOffset, &byteOffset, sizeof(byteOffset), NULL)) {
+		return false;
+	}
+	std::vector<std::string> chain;
+	if (SFileIsPatchedArchive(mpq) && (!patch_chain(file, &chain) || chain.size() > 1)) {
+		return false;
+	}
+	range->fd = archive_descriptor(archiveFile, mpq, &headerOffset);
+	if (range->fd < 0) {
+		return false;
+	}
+
+	range->offset = headerOffset + byteOffset;
+	range->size = fileSize;
+	return true;
+}
+
+/* Copies \a range to \a path. On failure, part of it may have been written. */
+static bool copy_stored(StoredRange const& range, char const *path) {
+	int in = range.fd;
+	int out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (out < 0) {
+		return false;
+	}
+
+	/* Each way picks up where the previous one stopped, if it is not supported */
+	off_t offset = (off_t)range.offset;
+	ULONGLONG copied = 0;
+#ifdef HAVE_COPY_FILE_RANGE
+	while (copied < range.size) {
+		ssize_t count = copy_file_range(in, &offset, out, NULL, (size_t)std::min<ULONGLONG>(range.size - copied, 1 << 30), 0);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			break;
+		}
+		copied += count;
+	}
+#endif
+#ifdef __linux__
+	while (copied < range.size) {
+		ssize_t count = sendfile(out, in, &offset, (size_t)std::min<ULONGLONG>(range.size - copied, 1 << 30));
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			break;
+		}
+		copied += count;
+	}
+#endif
+	std::vector<char> buffer;
+	while (copied < range.size) {
+		buffer.resize(1 << 20);
+		ssize_t count = pread(in, &buffer[0], (size_t)std::min<ULONGLONG>(range.size - copied, buffer.size()), offset);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			break;
+		}
+		for (ssize_t written = 0; written < count;) {
+			ssize_t result = pwrite(out, &buffer[written], count - written, (off_t)(copied + written));
+			if (result < 0 && errno != EINTR) {
+				close(out);
+				return false;
+			}
+			written += std::max<ssize_t>(result, 0);
+		}
+		offset += count;
+		copied += count;
+	}
+
+	return close(out) == 0 && copied == range.size;
+}
+#endif
+
+/* The error of the last failing call to the C library, as a StormLib error */
+static DWORD local_error() {
+#ifdef _WIN32
+	switch (errno) {
+		case ENOENT: return ERROR_FILE_NOT_FOUND;
+		case EACCES: return ERROR_ACCESS_DENIED;
+		case ENOSPC: return ERROR_DISK_FULL;
+		case ENOMEM: return ERROR_NOT_ENOUGH_MEMORY;
+		default: return ERROR_CAN_NOT_COMPLETE;
+	}
+#else
+	/* StormLib's errors are errno values on POSIX */
+	return errno ? errno : ERROR_CAN_NOT_COMPLETE;
+#endif
+}
+
+/*
+ * Extracts \a name, opened with \a scope, to \a path like SFileExtractFile(),
+ * copying it directly from \a archiveFile, the file \a mpq was opened from,
+ * if it is stored as is (see find_stored()). Adds the bytes copied so to
+ * \a copied. Returns the error, told without StormLib's last error when that
+ * is not reliable (see last_error()). Must hold the archive lock.
+ */
+static DWORD extract_file(HANDLE mpq, int archiveFile, char const *name, char const *path, DWORD scope, uint64_t *copied) {
+	HANDLE file;
+	if (!SFileOpenFileEx(mpq, name, scope, &file)) {
+		return open_error(mpq, name, scope);
+	}
+#ifndef _WIN32
+	StoredRange range;
+	if (find_stored(archiveFile, mpq, file, &range) && copy_stored(range, path)) {
+		SFileCloseFile(file);
+		*copied += range.size;
+		return ERROR_SUCCESS;
+	}
+#endif
+	FILE *out = fopen(path, "wb");
+	if (!out) {
+		DWORD error = local_error();
+		SFileCloseFile(file);
+		return error;
+	}
+	DWORD error = ERROR_SUCCESS;
+	std::vector<char> buffer(0x10000);
+	for (;;) {
+		DWORD bytesRead = 0;
+		bool result = SFileReadFile(file, buffer.data(), (DWORD)buffer.size(), &bytesRead, NULL);
+		if (bytesRead && fwrite(buffer.data(), 1, bytesRead, out) != bytesRead) {
+			error = local_error();
+			break;
+		}
+		if (!result) {
+			error = read_error(file);
+			if (error == ERROR_HANDLE_EOF) {
+				error = ERROR_SUCCESS;
+			}
+			break;
+		}
+		if (bytesRead < buffer.size()) {
+			break;
+		}
+	}
+	if (fclose(out) != 0 && error == ERROR_SUCCESS) {
+		error = local_error();
+	}
+	SFileCloseFile(file);
+	return error;
+}
+
+static PyObject * Archive_extract(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	char const *name;
+	char const *localName;
+	DWORD scope = SFILE_OPEN_FROM_MPQ;
+
+	if (!python::parse_args(args, nargs, "extract", 2, &name, &localName, &scope)) {
+		return NULL;
+	}
+	DWORD error = ERROR_SUCCESS;
+	if (!call_locked(self, &self->mpq, OP_EXTRACT, [&]() -> DWORD {
+		error = extract_file(self->mpq, self->state->file, name, localName, scope, &self->state->stats.bytesCopied);
+		return error;
+	})) {
+		return NULL;
+	}
+
+	if (error != ERROR_SUCCESS) {
+		if (error == ERROR_UNKNOWN_FILE_KEY) {
+			PyErr_Format(StormError, "Error extracting file: File Key `%s' unknown", name);
+			return NULL;
+		} else {
+			PyErr_Format(StormError, "Error extracting file: %i", error);
+			return NULL;
+		}
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject * Archive_verify_file(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	char const *name;
+	DWORD flags = SFILE_VERIFY_ALL;
+
+	if (!python::parse_args(args, nargs, "verify_file", 1, &name, &flags)) {
+		return NULL;
+	}
+	/* CRC32 and MD5 are checked against the attributes */
+	if (!ensure_loaded(self, DEFER_ATTRIBUTES)) {
+		return NULL;
+	}
+	DWORD result;
+	if (!call_locked(self, &self->mpq, OP_VERIFY, [&]() -> DWORD { result = SFileVerifyFile(self->mpq, name, flags); return ERROR_SUCCESS; })) {
+		return NULL;
+	}
+
+	return python::build_value(result);
+}
+
+static PyObject * Archive_verify(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+
+	if (!python::parse_args(args, nargs, "verify", 0)) {
+		return NULL;
+	}
+	DWORD result;
+	if (!call_locked(self, &self->mpq, OP_VERIFY, [&]() -> DWORD { result = SFileVerifyArchive(self->mpq); return ERROR_SUCCESS; })) {
+		return NULL;
+	}
+
+	return python::build_value(result);
+}
+
+/*
+ * File searching
+ */
+
+static PyObject * open_find(ArchiveObject *archive, char const *mask, bool listfile) {
+	if (!listfile && !ensure_loaded(archive, DEFER_LISTFILE)) {
+		return NULL;
+	}
+	FindObject *self = (FindObject *)FindType.tp_alloc(&FindType, 0);
+	if (!self) {
+		return NULL;
+	}
+	Py_INCREF(archive);
+	self->archive = archive;
+	self->listfile = listfile;
+
+	HANDLE find;
+	DWORD error = ERROR_SUCCESS;
+	if (!call_locked(archive, &archive->mpq, OP_FIND, [&]() -> DWORD {
+		if (listfile) {
+			find = SListFileFindFirstFile(archive->mpq, NULL, mask, &self->first);
+		} else {
+			find = SFileFindFirstFile(archive->mpq, mask, &self->first, NULL);
+		}
+		if (find) {
+			self->find = find;
+			add_child(archive, &self->find, listfile ? SListFileFindClose : SFileFindClose);
+		} else {
+			error = last_error(ERROR_NO_MORE_FILES);
+		}
+		return error;
+	})) {
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	if (!find) {
+		if (error == ERROR_NO_MORE_FILES) {
+			self->exhausted = true;
+			return (PyObject *)self;
+		}
+		PyErr_SetString(StormError, listfile ? "Error searching listfile" : "Error searching archive");
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	self->pending = true;
+	return (PyObject *)self;
+}
+
+static PyObject * Archive_find(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	char const *mask = "*";
+
+	if (!python::parse_args(args, nargs, "find", 0, &mask)) {
+		return NULL;
+	}
+
+	return open_find((ArchiveObject *)self_, mask, false);
+}
+
+static PyObject * Archive_find_listfile(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	char const *mask = "*";
+
+	if (!python::parse_args(args, nargs, "find_listfile", 0, &mask)) {
+		return NULL;
+	}
+
+	return open_find((ArchiveObject *)self_, mask, true);
+}
+
+static void Find_dealloc(FindObject *self) {
+	if (self->archive) {
+		close_child_locked(self->archive, &self->find);
+		Py_DECREF(self->archive);
+	}
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Returns NULL without an exception set once the search is exhausted */
+static PyObject * Find_next(FindObject *self) {
+	if (self->pending) {
+		self->pending = false;
+		return python::build_value(self->first.cFileName);
+	}
+	if (self->exhausted) {
+		return NULL;
+	}
+
+	SFILE_FIND_DATA findFileData;
+	bool result;
+	DWORD error = ERROR_SUCCESS;
+	if (!call_locked(self->archive, &self->find, OP_FIND_NEXT, [&]() -> DWORD {
+		if (self->listfile) {
+			result = SListFileFindNextFile(self->find, &findFileData);
+		} else {
+			result = SFileFindNextFile(self->find, &findFileData);
+		}
+		if (!result) {
+			error = last_error(ERROR_NO_MORE_FILES);
+			/* Release the search as soon as it is done */
+			if (error == ERROR_NO_MORE_FILES) close_child(self->archive, &self->find);
+		}
+		return error;
+	})) {
+		return NULL;
+	}
+
+	if (!result) {
+		if (error == ERROR_NO_MORE_FILES) {
+			self->exhausted = true;
+			return NULL;
+		} else if (self->listfile) {
+			PyErr_SetString(StormError, "Error searching for next result in listfile");
+			return NULL;
+		} else {
+			PyErr_SetString(StormError, "Error searching for next result in archive");
+			return NULL;
+		}
+	}
+
+	return python::build_value(findFileData.cFileName);
+}
+
+static PyObject * Find_close(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	FindObject *self = (FindObject *)self_;
+
+	if (!python::parse_args(args, nargs, "close", 0)) {
+		return NULL;
+	}
+
+	self->pending = false;
+	self->exhausted = true;
+	if (!close_child_locked(self->archive, &self->find)) {
+		PyErr_SetString(StormError, self->listfile ? "Error closing listfile search" : "Error closing archive search");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject * Find_exit(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	return Find_close(self, NULL, 0);
+}
+
+/*
+ * Bulk enumeration
+ *
+ * Archive.list() walks the whole archive in a single call without the GIL
+ * and returns the search results as columns: a list of names and one
+ * array.array per SFILE_FIND_DATA field.
+ */
+
+static PyStructSequence_Field FileListFields[] = {
+	{(char *)"name", (char *)"File names, as stored in the archive"},
+	{(char *)"hash_index", (char *)"Hash table indices (array of uint32)"},
+	{(char *)"block_index", (char *)"Block table indices (array of uint32)"},
+	{(char *)"file_size", (char *)"Uncompressed file sizes (array of uint32)"},
+	{(char *)"compressed_size", (char *)"Compressed file sizes (array of uint32)"},
+	{(char *)"flags", (char *)"MPQ_FILE_* flags (array of uint32)"},
+	{(char *)"locale", (char *)"File locales (array of uint32)"},
+	{(char *)"file_time", (char *)"File times as FILETIME, 0 if unknown (array of uint64)"},
+	{NULL}
+};
+
+static PyStructSequence_Desc FileListDesc = {
+	(char *)"storm.FileList",
+	(char *)"Files of an MPQ archive, as columns",
+	FileListFields,
+	8,
+};
+
+struct FileListing {
+	std::string names; /* NUL-separated */
+	std::vector<DWORD> hashIndex;
+	std::vector<DWORD> blockIndex;
+	std::vector<DWORD> fileSize;
+	std::vector<DWORD> compressedSize;
+	std::vector<DWORD> flags;
+	std::vector<DWORD> locale;
+	std::vector<uint64_t> fileTime;
+
+	void append(SFILE_FIND_DATA const& data) {
+		names.append(data.cFileName);
+		names.push_back('\0');
+		hashIndex.push_back(data.dwHashIndex);
+		blockIndex.push_back(data.dwBlockIndex);
+		fileSize.push_back(data.dwFileSize);
+		compressedSize.push_back(data.dwCompSize);
+		flags.push_back(data.dwFileFlags);
+		locale.push_back(data.lcLocale);
+		fileTime.push_back(make_uint64(data.dwFileTimeLo, data.dwFileTimeHi));
+	}
+};
+
+static PyObject * build_file_list(FileListing const& listing) {
+	PyObject *result = PyStructSequence_New(&FileListType);
+	if (!result) {
+		return NULL;
+	}
+
+	PyObject *names = PyList_New(listing.fileSize.size());
+	if (!names) {
+		Py_DECREF(result);
+		return NULL;
+	}
+	PyStructSequence_SET_ITEM(result, 0, names);
+	char const *name = listing.names.data();
+	for (size_t i = 0; i < listing.fileSize.size(); ++i) {
+		size_t length = strlen(name);
+		PyObject *item = PyUnicode_DecodeUTF8(name, length, NULL);
+		if (!item) {
+			Py_DECREF(result);
+			return NULL;
+		}
+		PyList_SET_ITEM(names, i, item);
+		name += length + 1;
+	}
+
+	PyObject *columns[] = {
+		build_array(ArrayType, "I", listing.hashIndex),
+		build_array(ArrayType, "I", listing.blockIndex),
+		build_array(ArrayType, "I", listing.fileSize),
+		build_array(ArrayType, "I", listing.compressedSize),
+		build_array(ArrayType, "I", listing.flags),
+		build_array(ArrayType, "I", listing.locale),
+		build_array(ArrayType, "Q", listing.fileTime),
+	};
+	bool failed = false;
+	for (size_t i = 0; i < sizeof(columns) / sizeof(*columns); ++i) {
+		failed = failed || !columns[i];
+		PyStructSequence_SET_ITEM(result, i + 1, columns[i]);
+	}
+	if (failed) {
+		Py_DECREF(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+/* Fills \a listing back from a storm.FileList */
+static bool listing_from_python(PyObject *fileList, FileListing *listing) {
+	if (!PyObject_TypeCheck(fileList, &FileListType)) {
+		PyErr_Format(PyExc_TypeError, "listings must be %s, not %.50s", FileListType.tp_name, Py_TYPE(fileList)->tp_name);
+		return false;
+	}
+	PyObject *names = PyStructSequence_GET_ITEM(fileList, 0);
+	if (!PyList_Check(names)) {
+		PyErr_SetString(PyExc_TypeError, "FileList.name must be a list");
+		return false;
+	}
+	size_t count = PyList_GET_SIZE(names);
+	for (size_t i = 0; i < count; ++i) {
+		char const *name;
+		if (!python::detail::from_python(PyList_GET_ITEM(names, i), &name)) {
+			return false;
+		}
+		listing->names.append(name);
+		listing->names.push_back('\0');
+	}
+
+	std::vector<DWORD> *columns[] = {
+		&listing->hashIndex,
+		&listing->blockIndex,
+		&listing->fileSize,
+		&listing->compressedSize,
+		&listing->flags,
+		&listing->locale,
+	};
+	for (size_t i = 0; i < sizeof(columns) / sizeof(*columns); ++i) {
+		if (!copy_column(PyStructSequence_GET_ITEM(fileList, i + 1), count, columns[i])) {
+			return false;
+		}
+	}
+	return copy_column(PyStructSequence_GET_ITEM(fileList, 7), count, &listing->fileTime);
+}
+
+/* Searches \a mpq for \a mask, returning ERROR_NO_MORE_FILES on success */
+static DWORD list_files(HANDLE mpq, char const *mask, FileListing *listing) {
+	SFILE_FIND_DATA findFileData;
+	HANDLE find = SFileFindFirstFile(mpq, mask, &findFileData, NULL);
+	if (!find) {
+		return last_error(ERROR_NO_MORE_FILES);
+	}
+	do {
+		listing->append(findFileData);
+	} while (SFileFindNextFile(find, &findFileData));
+	DWORD error = last_error(ERROR_NO_MORE_FILES);
+	SFileFindClose(find);
+	return error;
+}
+
+static PyObject * Archive_list(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	char const *mask = "*";
+
+	if (!python::parse_args(args, nargs, "list", 0, &mask)) {
+		return NULL;
+	}
+	/* File times come from the attributes */
+	if (!ensure_loaded(self, DEFER_LISTFILE | DEFER_ATTRIBUTES)) {
+		return NULL;
+	}
+	FileListing listing;
+	DWORD error = ERROR_SUCCESS;
+	if (!call_locked(self, &self->mpq, OP_LIST, [&]() -> DWORD { error = list_files(self->mpq, mask, &listing); return error; })) {
+		return NULL;
+	}
+
+	if (error != ERROR_NO_MORE_FILES) {
+		PyErr_SetString(StormError, "Error searching archive");
+		return NULL;
+	}
+
+	return build_file_list(listing);
+}
+
+/*
+ * File information
+ *
+ * storm.FileInfo holds everything StormLib tells about a file: sizes, offset,
+ * flags, locale, encryption key, hashes, file time and patch chain. stat()
+ * reads them all in a single locked call; from_list() takes them from a
+ * storm.FileList without touching the archive, leaving the fields a listing
+ * lacks at 0 and patch_chain at None. As in zipfile.ZipInfo, filename uses /
+ * as separator.
+ */
+
+struct FileStat {
+	std::string name;
+	uint64_t fileSize;
+	DWORD compressedSize;
+	uint64_t byteOffset;
+	DWORD flags;
+	DWORD locale;
+	DWORD fileIndex;
+	DWORD hashIndex;
+	DWORD nameHash1;
+	DWORD nameHash2;
+	uint64_t nameHash3;
+	DWORD encryptionKey;
+	DWORD encryptionKeyRaw;
+	uint64_t fileTime;
+	std::vector<std::string> patchChain;
+	bool hasPatchChain;
+};
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *filename;
+	unsigned long long fileSize;
+	unsigned long long compressSize;
+	unsigned long long byteOffset;
+	unsigned int flags;
+	unsigned int locale;
+	unsigned int fileIndex;
+	unsigned int hashIndex;
+	unsigned int nameHash1;
+	unsigned int nameHash2;
+	unsigned long long nameHash3;
+	unsigned int encryptionKey;
+	unsigned int encryptionKeyRaw;
+	unsigned long long fileTime;
+	PyObject *patchChain; /* tuple of str, or None */
+} FileInfoObject;
+
+static PyTypeObject FileInfoType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+/* Reads every info class of \a file, opened as \a name if known. Must hold the archive lock. */
+static bool stat_file(HANDLE file, char const *name, FileStat *stat) {
+	if (name) {
+		stat->name = name;
+	} else {
+		char buffer[MAX_PATH];
+		if (!SFileGetFileName(file, buffer)) {
+			return false;
+		}
+		stat->name = buffer;
+	}
+	DWORD sizeHigh = 0;
+	DWORD sizeLow = SFileGetFileSize(file, &sizeHigh);
+	if (sizeLow == SFILE_INVALID_SIZE) {
+		return false;
+	}
+	stat->fileSize = make_uint64(sizeLow, sizeHigh);
+
+	struct {
+		SFileInfoClass infoClass;
+		void *value;
+		DWORD size;
+	} const classes[] = {
+		{SFileInfoCompressedSize, &stat->compressedSize, sizeof(stat->compressedSize)},
+		{SFileInfoByteOffset, &stat->byteOffset, sizeof(stat->byteOffset)},
+		{SFileInfoFlags, &stat->flags, sizeof(stat->flags)},
+		{SFileInfoLocale, &stat->locale, sizeof(stat->locale)},
+		{SFileInfoFileIndex, &stat->fileIndex, sizeof(stat->fileIndex)},
+		{SFileInfoHashIndex, &stat->hashIndex, sizeof(stat->hashIndex)},
+		{SFileInfoNameHash1, &stat->nameHash1, sizeof(stat->nameHash1)},
+		{SFileInfoNameHash2, &stat->nameHash2, sizeof(stat->nameHash2)},
+		{SFileInfoNameHash3, &stat->nameHash3, sizeof(stat->nameHash3)},
+		{SFileInfoEncryptionKey, &stat->encryptionKey, sizeof(stat->encryptionKey)},
+		{SFileInfoEncryptionKeyRaw, &stat->encryptionKeyRaw, sizeof(stat->encryptionKeyRaw)},
+		{SFileInfoFileTime, &stat->fileTime, sizeof(stat->fileTime)},
+	};
+	for (auto const& c : classes) {
+		/* Left at 0 when unknown, e.g. file times without (attributes) */
+		memset(c.value, 0, c.size);
+		SFileGetFileInfo(file, c.infoClass, c.value, c.size, NULL);
+	}
+	stat->patchChain.clear();
+	stat->hasPatchChain = patch_chain(file, &stat->patchChain);
+	return true;
+}
+
+/* Returns \a name with / as separator */
+static PyObject * slash_name(char const *name, size_t length) {
+	std::string result(name, length);
+	std::replace(result.begin(), result.end(), '\\', '/');
+	return PyUnicode_FromStringAndSize(result.data(), result.size());
+}
+
+static FileInfoObject * new_file_info(PyTypeObject *type, char const *name) {
+	FileInfoObject *self = (FileInfoObject *)type->tp_alloc(type, 0);
+	if (!self) {
+		return NULL;
+	}
+	self->filename = slash_name(name, strlen(name));
+	if (!self->filename) {
+		Py_DECREF(self);
+		return NULL;
+	}
+	Py_INCREF(Py_None);
+	self->patchChain = Py_None;
+	return self;
+}
+
+static PyObject * build_file_info(PyTypeObject *type, FileStat const& stat) {
+	FileInfoObject *self = new_file_info(type, stat.name.c_str());
+	if (!self) {
+		return NULL;
+	}
+	self->fileSize = stat.fileSize;
+	self->compressSize = stat.compressedSize;
+	self->byteOffset = stat.byteOffset;
+	self->flags = stat.flags;
+	self->locale = stat.locale;
+	self->fileIndex = stat.fileIndex;
+	self->hashIndex = stat.hashIndex;
+	self->nameHash1 = stat.nameHash1;
+	self->nameHash2 = stat.nameHash2;
+	self->nameHash3 = stat.nameHash3;
+	self->encryptionKey = stat.encryptionKey;
+	self->encryptionKeyRaw = stat.encryptionKeyRaw;
+	self->fileTime = stat.fileTime;
+	if (stat.hasPatchChain) {
+		PyObject *chain = PyTuple_New(stat.patchChain.size());
+		for (size_t i = 0; chain && i < stat.patchChain.size(); ++i) {
+			PyObject *item = PyUnicode_FromStringAndSize(stat.patchChain[i].data(), stat.patchChain[i].size());
+			if (!item) {
+				Py_CLEAR(chain);
+				break;
+			}
+			PyTuple_SET_ITEM(chain, i, item);
+		}
+		if (!chain) {
+			Py_DECREF(self);
+			return NULL;
+		}
+		Py_SETREF(self->patchChain, chain);
+	}
+
+	return (PyObject *)self;
+}
+
+/* Returns a \a type describing the open \a file */
+static PyObject * stat_handle(PyTypeObject *type, FileObject *file) {
+	FileStat stat;
+	bool result;
+	if (!call_locked(file->archive, &file->file, OP_STAT, file->stats, [&]() -> DWORD { result = stat_file(file->file, NULL, &stat); return call_error(result, ERROR_CAN_NOT_COMPLETE); })) {
+		return NULL;
+	}
+	if (!result) {
+		PyErr_SetString(StormError, "Error getting file information");
+		return NULL;
+	}
+
+	return build_file_info(type, stat);
+}
+
+/* Returns a \a type describing \a name in \a archive, opened with \a scope */
+static PyObject * stat_archive(PyTypeObject *type, ArchiveObject *archive, char const *name, DWORD scope) {
+	if (!ensure_loaded(archive, DEFER_ATTRIBUTES)) {
+		return NULL;
+	}
+	FileStat stat;
+	bool result;
+	DWORD error = ERROR_SUCCESS;
+	if (!call_locked(archive, &archive->mpq, OP_STAT, [&]() -> DWORD {
+		HANDLE file;
+		result = SFileOpenFileEx(archive->mpq, name, scope, &file);
+		if (!result) {
+			error = open_error(archive->mpq, name, scope);
+			return error;
+		}
+		result = stat_file(file, name, &stat);
+		if (!result) {
+			error = last_error(ERROR_CAN_NOT_COMPLETE);
+		}
+		SFileCloseFile(file);
+		return error;
+	})) {
+		return NULL;
+	}
+	if (!result) {
+		if (error == ERROR_FILE_NOT_FOUND) {
+			PyErr_Format(PyExc_KeyError, "There is no item named '%s' in the archive", name);
+		} else {
+			PyErr_SetString(StormError, "Error getting file information");
+		}
+		return NULL;
+	}
+
+	return build_file_info(type, stat);
+}
+
+static PyObject * FileInfo_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	static char const *kwlist[] = {"filename", "file_size", "compress_size", "flags", "locale", "file_time", NULL};
+	PyObject *filename;
+	unsigned long long fileSize = 0;
+	unsigned long long compressSize = 0;
+	unsigned int flags = 0;
+	unsigned int locale = 0;
+	unsigned long long fileTime = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "U|KKIIK:FileInfo", (char **)kwlist, &filename, &fileSize, &compressSize, &flags, &locale, &fileTime)) {
+		return NULL;
+	}
+	Py_ssize_t length;
+	char const *name = PyUnicode_AsUTF8AndSize(filename, &length);
+	if (!name) {
+		return NULL;
+	}
+	FileInfoObject *self = new_file_info(type, name);
+	if (!self) {
+		return NULL;
+	}
+	self->fileSize = fileSize;
+	self->compressSize = compressSize;
+	self->flags = flags;
+	self->locale = locale;
+	self->fileTime = fileTime;
+
+	return (PyObject *)self;
+}
+
+static void FileInfo_dealloc(FileInfoObject *self) {
+	Py_XDECREF(self->filename);
+	Py_XDECREF(self->patchChain);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject * FileInfo_repr(FileInfoObject *self) {
+	return PyUnicode_FromFormat("<%s %R file_size=%llu compress_size=%llu>", Py_TYPE(self)->tp_name, self->filename, self->fileSize, self->compressSize);
+}
+
+static PyObject * FileInfo_from_handle(PyObject *cls, PyObject *const *args, Py_ssize_t nargs) {
+	PyObject *file;
+
+	if (!python::parse_args(args, nargs, "from_handle", 1, &file)) {
+		return NULL;
+	}
+	if (!PyObject_TypeCheck(file, &FileType)) {
+		PyErr_Format(PyExc_TypeError, "file must be %s, not %.50s", FileType.tp_name, Py_TYPE(file)->tp_name);
+		return NULL;
+	}
+
+	return stat_handle((PyTypeObject *)cls, (FileObject *)file);
+}
+
+static PyObject * FileInfo_from_archive(PyObject *cls, PyObject *const *args, Py_ssize_t nargs) {
+	PyObject *archive;
+	char const *name;
+	DWORD scope = SFILE_OPEN_FROM_MPQ;
+
+	if (!python::parse_args(args, nargs, "from_archive", 2, &archive, &name, &scope)) {
+		return NULL;
+	}
+	if (!PyObject_TypeCheck(archive, &ArchiveType)) {
+		PyErr_Format(PyExc_TypeError, "archive must be %s, not %.50s", ArchiveType.tp_name, Py_TYPE(archive)->tp_name);
+		return NULL;
+	}
+
+	return stat_archive((PyTypeObject *)cls, (ArchiveObject *)archive, name, scope);
+}
+
+static PyObject * FileInfo_from_list(PyObject *cls, PyObject *const *args, Py_ssize_t nargs) {
+	PyObject *fileList;
+
+	if (!python::parse_args(args, nargs, "from_list", 1, &fileList)) {
+		return NULL;
+	}
+	FileListing listing;
+	if (!listing_from_python(fileList, &listing)) {
+		return NULL;
+	}
+	PyObject *result = PyList_New(listing.hashIndex.size());
+	if (!result) {
+		return NULL;
+	}
+	char const *name = listing.names.c_str();
+	for (size_t i = 0; i < listing.hashIndex.size(); ++i, name += strlen(name) + 1) {
+		FileInfoObject *info = new_file_info((PyTypeObject *)cls, name);
+		if (!info) {
+			Py_DECREF(result);
+			return NULL;
+		}
+		info->fileSize = listing.fileSize[i];
+		info->compressSize = listing.compressedSize[i];
+		info->flags = listing.flags[i];
+		info->locale = listing.locale[i];
+		info->fileIndex = listing.blockIndex[i];
+		info->hashIndex = listing.hashIndex[i];
+		info->fileTime = listing.fileTime[i];
+		PyList_SET_ITEM(result, i, (PyObject *)info);
+	}
+
+	return result;
+}
+
+static PyObject * File_stat(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	if (!python::parse_args(args, nargs, "stat", 0)) {
+		return NULL;
+	}
+	return stat_handle(&FileInfoType, (FileObject *)self);
+}
+
+static PyObject * Archive_stat(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	char const *name;
+	DWORD scope = SFILE_OPEN_FROM_MPQ;
+
+	if (!python::parse_args(args, nargs, "stat", 1, &name, &scope)) {
+		return NULL;
+	}
+	return stat_archive(&FileInfoType, (ArchiveObject *)self, name, scope);
+}
+
+/*
+ * Access hints
+ *
+ * extract_all(), verify_all() and read_many() read many files of an archive in
+ * one go. Given an advice by Archive.advise(), they read the files in the order
+ * of their offsets and tell the kernel what comes next. ADVISE_WILLNEED has the
+ * files up to a window ahead of the reads fetched with
+ * posix_fadvise(POSIX_FADV_WILLNEED). ADVISE_DONTNEED drops the pages already
+ * read with POSIX_FADV_DONTNEED, so that one-shot passes over large archives
+ * do not evict the rest of the page cache. Only archives whose files lie at
+ * their offset in the archive file get hints, see archive_descriptor().
+ */
+
+struct AccessPlan {
+	int fd; /* archive file, if giving hints */
+	unsigned int advice;
+	uint64_t window;
+	ULONGLONG base; /* offset of the archive in its file */
+	/* Files, in the order they are read */
+	std::vector<uint64_t> offsets;
+	std::vector<uint64_t> sizes;
+	uint64_t end; /* of the file ending last */
+
+	std::mutex lock;
+	size_t advised; /* files hinted WILLNEED */
+	size_t consumed; /* files read, along with all those before them */
+	uint64_t dropped; /* end of the range hinted DONTNEED */
+	std::vector<bool> done;
+
+	AccessPlan() : fd(-1), advice(ADVISE_NONE), window(0), base(0), end(0), advised(0), consumed(0), dropped(0) {}
+	~AccessPlan() {
+#ifdef HAVE_FADVISE
+		if (fd >= 0) {
+			close(fd);
+		}
+#endif
+	}
+
+	//! Prepares hints on the file of \a mpq, if \a state advises any.
+	//! Must hold the archive lock.
+	bool open(ArchiveState const& state, HANDLE mpq) {
+#ifdef HAVE_FADVISE
+		if (state.advice == ADVISE_NONE) {
+			return false;
+		}
+		fd = archive_descriptor(state.file, mpq, &base);
+		advice = state.advice;
+		window = state.adviceWindow;
+		return fd >= 0;
+#else
+		return false;
+#endif
+	}
+
+	//! Adds the next file read, at \a offset of the archive and taking \a size bytes there.
+	void add(uint64_t offset, uint64_t size) {
+		offsets.push_back(base + offset);
+		sizes.push_back(size);
+		end = std::max<uint64_t>(end, base + offset + size);
+	}
+
+	//! Hints the files up to the window ahead of the file \a i, about to be read.
+	void start(size_t i) {
+#ifdef HAVE_FADVISE
+		if (fd < 0 || !(advice & ADVISE_WILLNEED)) {
+			return;
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		/* Files close enough are hinted together */
+		uint64_t begin = 0;
+		uint64_t end = 0;
+		for (uint64_t limit = offsets[i] + window; advised < offsets.size() && (advised <= i || offsets[advised] < limit); ++advised) {
+			if (!sizes[advised]) {
+				continue;
+			}
+			uint64_t offset = offsets[advised];
+			if (end > begin && offset > end + 0x10000) {
+				posix_fadvise(fd, (off_t)begin, (off_t)(end - begin), POSIX_FADV_WILLNEED);
+				begin = end = 0;
+			}
+			if (end == begin) {
+				begin = offset;
+			}
+			end = std::max(end, offset + sizes[advised]);
+		}
+		if (end > begin) {
+			posix_fadvise(fd, (off_t)begin, (off_t)(end - begin), POSIX_FADV_WILLNEED);
+		}
+#endif
+	}
+
+	//! Drops the pages read, up to the first file not read yet, now that \a i is.
+	void finish(size_t i) {
+#ifdef HAVE_FADVISE
+		if (fd < 0 || !(advice & ADVISE_DONTNEED)) {
+			return;
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		if (done.empty()) {
+			done.assign(offsets.size(), false);
+			dropped = offsets[0];
+		}
+		done[i] = true;
+		while (consumed < done.size() && done[consumed]) {
+			++consumed;
+		}
+		uint64_t limit = end;
+		if (consumed < offsets.size()) {
+			/* Keep the page the next file starts in */
+			static uint64_t const page = (uint64_t)sysconf(_SC_PAGESIZE);
+			limit = offsets[consumed] / page * page;
+		}
+		if (limit > dropped) {
+			posix_fadvise(fd, (off_t)dropped, (off_t)(limit - dropped), POSIX_FADV_DONTNEED);
+			dropped = limit;
+		}
+#endif
+	}
+};
+
+/*
+ * Sorts \a names by their offset in \a mpq, opened with \a scope, and adds them
+ * to \a plan in that order. Must hold the archive lock.
+ */
+static void plan_batch(HANDLE mpq, DWORD scope, std::vector<std::string> *names, AccessPlan *plan) {
+	struct Planned {
+		uint64_t offset;
+		uint64_t size;
+		size_t index;
+	};
+	std::vector<Planned> files(names->size());
+	for (size_t i = 0; i < names->size(); ++i) {
+		/* Files that do not open go first, and fail fast */
+		Planned planned = {0, 0, i};
+		HANDLE file;
+		if (SFileOpenFileEx(mpq, (*names)[i].c_str(), scope, &file)) {
+			ULONGLONG offset;
+			DWORD size;
+			if (SFileGetFileInfo(file, SFileInfoByteOffset, &offset, sizeof(offset), NULL) && SFileGetFileInfo(file, SFileInfoCompressedSize, &size, sizeof(size), NULL)) {
+				planned.offset = offset;
+				planned.size = size;
+			}
+			SFileCloseFile(file);
+		}
+		files[i] = planned;
+	}
+	std::stable_sort(files.begin(), files.end(), [](Planned const& a, Planned const& b) { return a.offset < b.offset; });
+
+	std::vector<std::string> sorted;
+	sorted.reserve(files.size());
+	for (Planned const& planned : files) {
+		sorted.push_back(std::move((*names)[planned.index]));
+		plan->add(planned.offset, planned.size);
+	}
+	names->swap(sorted);
+}
+
+/*
+ * Parallel extraction
+ *
+ * Archive.extract_all() extracts and Archive.verify_all() verifies many files
+ * on a pool of threads. Every worker opens its own handle on the archive, with
+ * the same patches applied, so that reading and decompressing run in parallel.
+ * The calling thread waits without the GIL and only takes it back to report
+ * progress. Returning False from the progress callback stops the workers after
+ * their current file.
+ */
+
+struct ExtractJob {
+	ArchiveSource source;
+	std::string destination;
+	DWORD scope;
+	DWORD verifyFlags;
+	std::vector<std::string> names;
+	std::vector<DWORD> errors; /* or verification results */
+	/* Extracts or verifies a file, returning the result for errors */
+	DWORD (*run)(HANDLE mpq, int archiveFile, ExtractJob const& job, std::string const& name);
+	AccessPlan plan;
+
+	std::atomic<size_t> next; /* next name to be claimed by a worker */
+	std::atomic<bool> stop;
+	mutable std::atomic<uint64_t> copied; /* by extract_file(), without StormLib */
+
+	std::mutex lock;
+	std::condition_variable changed;
+	std::vector<size_t> finished; /* indices of names, in completion order */
+	size_t running;
+	DWORD openError;
+
+	ExtractJob() : scope(SFILE_OPEN_FROM_MPQ), verifyFlags(0), run(NULL), next(0), stop(false), copied(0), running(0), openError(ERROR_SUCCESS) {}
+};
+
+/* Creates the directories of \a path ending at a slash at or after \a start */
+static bool make_directories(std::string path, size_t start) {
+	for (size_t i = start; i < path.size(); ++i) {
+		if (path[i] != '/') {
+			continue;
+		}
+		path[i] = '\0';
+		if (make_directory(path.c_str()) != 0 && errno != EEXIST) {
+			return false;
+		}
+		path[i] = '/';
+	}
+	return true;
+}
+
+static DWORD extract_one(HANDLE mpq, int archiveFile, ExtractJob const& job, std::string const& name) {
+	std::string path = job.destination + '/';
+	size_t start = path.size();
+	for (char c : name) {
+		path += c == '\\' ? '/' : c;
+	}
+
+	/* Refuse names that would escape the destination */
+	if (name.empty() || path[start] == '/' || name.find(':') != std::string::npos) {
+		return ERROR_INVALID_PARAMETER;
+	}
+	for (size_t begin = start, end; begin < path.size(); begin = end + 1) {
+		end = std::min(path.find('/', begin), path.size());
+		if (path.compare(begin, end - begin, "..") == 0) {
+			return ERROR_INVALID_PARAMETER;
+		}
+	}
+
+	if (!make_directories(path, start)) {
+		return local_error();
+	}
+	uint64_t copied = 0;
+	DWORD error = extract_file(mpq, archiveFile, name.c_str(), path.c_str(), job.scope, &copied);
+	job.copied += copied;
+	return error;
+}
+
+static void extract_worker(ExtractJob *job) {
+	HANDLE mpq = NULL;
+	DWORD error = ERROR_SUCCESS;
+
+	if (job->source.open(&mpq, &error)) {
+		int archiveFile = job->source.open_file();
+		size_t i;
+		while (!job->stop && (i = job->next++) < job->names.size()) {
+			job->plan.start(i);
+			job->errors[i] = job->run(mpq, archiveFile, *job, job->names[i]);
+			job->plan.finish(i);
+
+			std::lock_guard<std::mutex> guard(job->lock);
+			job->finished.push_back(i);
+			job->changed.notify_one();
+		}
+		close_archive_file(archiveFile);
+		SFileCloseArchive(mpq);
+	}
+
+	std::lock_guard<std::mutex> guard(job->lock);
+	if (error != ERROR_SUCCESS) {
+		job->openError = error;
+	}
+	--job->running;
+	job->changed.notify_one();
+}
+
+/* Waits for \a job, calling \a progress as files complete. Returns false if it raised. */
+static bool wait_extract(ExtractJob& job, PyObject *progress) {
+	size_t reported = 0;
+	bool failed = false;
+	bool done;
+
+	do {
+		std::vector<size_t> batch;
+		Py_BEGIN_ALLOW_THREADS
+		{
+			std::unique_lock<std::mutex> guard(job.lock);
+			job.changed.wait(guard, [&] { return job.finished.size() > reported || job.running == 0; });
+			batch.assign(job.finished.begin() + reported, job.finished.end());
+			done = job.running == 0;
+		}
+		Py_END_ALLOW_THREADS
+
+		for (size_t i : batch) {
+			++reported;
+			if (progress == Py_None || job.stop) {
+				continue;
+			}
+			PyObject *result = PyObject_CallFunction(progress, "snn", job.names[i].c_str(), (Py_ssize_t)reported, (Py_ssize_t)job.names.size());
+			if (!result || result == Py_False) {
+				/* Let the workers finish their current file and stop */
+				failed = !result;
+				job.stop = true;
+			}
+			Py_XDECREF(result);
+		}
+	} while (!done);
+
+	return !failed;
+}
+
+/*
+ * Runs \a job over \a namesObject, or every file of \a archive if None, on
+ * \a threads threads, reporting to \a progress. Returns false if it raised.
+ */
+static bool run_batch(ArchiveObject *archive, ExtractJob& job, Operation op, PyObject *namesObject, unsigned int threads, PyObject *progress) {
+	if (progress != Py_None && !PyCallable_Check(progress)) {
+		PyErr_SetString(PyExc_TypeError, "progress must be callable");
+		return false;
+	}
+	if (namesObject != Py_None) {
+		PyObject *iterator = PyObject_GetIter(namesObject);
+		if (!iterator) {
+			return false;
+		}
+		PyObject *item;
+		while ((item = PyIter_Next(iterator))) {
+			char const *name;
+			bool valid = python::detail::from_python(item, &name);
+			Py_DECREF(item);
+			if (!valid) {
+				Py_DECREF(iterator);
+				return false;
+			}
+			job.names.push_back(name);
+		}
+		Py_DECREF(iterator);
+		if (PyErr_Occurred()) {
+			return false;
+		}
+	} else if (!ensure_loaded(archive, DEFER_LISTFILE)) {
+		return false;
+	}
+
+	DWORD error = ERROR_NO_MORE_FILES;
+	if (!call_locked(archive, &archive->mpq, op, [&]() -> DWORD {
+		job.source = archive->state->source;
+		if (namesObject == Py_None) {
+			FileListing listing;
+			error = list_files(archive->mpq, "*", &listing);
+			for (size_t i = 0, offset = 0; i < listing.fileSize.size(); ++i) {
+				job.names.push_back(listing.names.c_str() + offset);
+				offset += job.names.back().size() + 1;
+			}
+		}
+		if (job.plan.open(*archive->state, archive->mpq)) {
+			plan_batch(archive->mpq, job.scope, &job.names, &job.plan);
+		}
+		return error;
+	})) {
+		return false;
+	}
+	if (error != ERROR_NO_MORE_FILES) {
+		PyErr_SetString(StormError, "Error searching archive");
+		return false;
+	}
+
+	job.errors.assign(job.names.size(), ERROR_SUCCESS);
+	if (!threads) {
+		threads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	threads = (unsigned int)std::min<size_t>(threads, job.names.size());
+
+	std::vector<std::thread> workers;
+	Py_BEGIN_ALLOW_THREADS
+	for (unsigned int i = 0; i < threads; ++i) {
+		{
+			std::lock_guard<std::mutex> guard(job.lock);
+			++job.running;
+		}
+		try {
+			workers.emplace_back(extract_worker, &job);
+		} catch (std::system_error const&) {
+			std::lock_guard<std::mutex> guard(job.lock);
+			--job.running;
+			break;
+		}
+	}
+	if (workers.empty() && !job.names.empty()) {
+		/* No thread could be started, run on this one */
+		++job.running;
+		extract_worker(&job);
+	}
+	Py_END_ALLOW_THREADS
+
+	bool result = wait_extract(job, progress);
+	Py_BEGIN_ALLOW_THREADS
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+	{
+		std::lock_guard<std::mutex> guard(archive->state->lock);
+		archive->state->stats.bytesCopied += job.copied;
+	}
+	Py_END_ALLOW_THREADS
+	return result;
+}
+
+static PyObject * Archive_extract_all(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	char const *destination;
+	PyObject *namesObject = Py_None;
+	DWORD scope = SFILE_OPEN_FROM_MPQ;
+	unsigned int threads = 0;
+	PyObject *progress = Py_None;
+
+	if (!python::parse_args(args, nargs, "extract_all", 1, &destination, &namesObject, &scope, &threads, &progress)) {
+		return NULL;
+	}
+
+	ExtractJob job;
+	job.run = extract_one;
+	job.destination = destination;
+	job.scope = scope;
+	bool created;
+	Py_BEGIN_ALLOW_THREADS
+	created = make_directories(job.destination + '/', 1);
+	Py_END_ALLOW_THREADS
+	if (!created) {
+		PyErr_Format(PyExc_IOError, "Could not create directory: %s", destination);
+		return NULL;
+	}
+
+	if (!run_batch(self, job, OP_EXTRACT_ALL, namesObject, threads, progress)) {
+		return NULL;
+	}
+
+	/* Names no worker got to, because none of them could open the archive */
+	for (size_t i = std::min<size_t>(job.next, job.names.size()); i < job.names.size(); ++i) {
+		job.errors[i] = job.openError != ERROR_SUCCESS ? job.openError : ERROR_CAN_NOT_COMPLETE;
+	}
+
+	PyObject *errors = PyDict_New();
+	if (!errors) {
+		return NULL;
+	}
+	for (size_t i = 0; i < job.names.size(); ++i) {
+		if (job.errors[i] == ERROR_SUCCESS) {
+			continue;
+		}
+		PyObject *name = PyUnicode_FromString(job.names[i].c_str());
+		PyObject *code = PyLong_FromUnsignedLong(job.errors[i]);
+		if (!name || !code || PyDict_SetItem(errors, name, code) < 0) {
+			Py_XDECREF(name);
+			Py_XDECREF(code);
+			Py_DECREF(errors);
+			return NULL;
+		}
+		Py_DECREF(name);
+		Py_DECREF(code);
+	}
+
+	return errors;
+}
+
+static DWORD verify_one(HANDLE mpq, int, ExtractJob const& job, std::string const& name) {
+	return SFileVerifyFile(mpq, name.c_str(), job.verifyFlags);
+}
+
+static PyObject * Archive_verify_all(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	PyObject *namesObject = Py_None;
+	DWORD flags = SFILE_VERIFY_ALL;
+	unsigned int threads = 0;
+	PyObject *progress = Py_None;
+
+	if (!python::parse_args(args, nargs, "verify_all", 0, &namesObject, &flags, &threads, &progress)) {
+		return NULL;
+	}
+
+	if (!ensure_loaded(self, DEFER_ATTRIBUTES)) {
+		return NULL;
+	}
+	ExtractJob job;
+	job.run = verify_one;
+	job.verifyFlags = flags;
+	if (!run_batch(self, job, OP_VERIFY_ALL, namesObject, threads, progress)) {
+		return NULL;
+	}
+	if (job.finished.empty() && !job.names.empty() && job.openError != ERROR_SUCCESS) {
+		PyErr_Format(StormError, "Error opening archive: %i", job.openError);
+		return NULL;
+	}
+
+	/* Files left when stopped early have no result */
+	PyObject *results = PyDict_New();
+	if (!results) {
+		return NULL;
+	}
+	for (size_t i : job.finished) {
+		PyObject *name = PyUnicode_FromString(job.names[i].c_str());
+		PyObject *result = PyLong_FromUnsignedLong(job.errors[i]);
+		if (!name || !result || PyDict_SetItem(results, name, result) < 0) {
+			Py_XDECREF(name);
+			Py_XDECREF(result);
+			Py_DECREF(results);
+			return NULL;
+		}
+		Py_DECREF(name);
+		Py_DECREF(result);
+	}
+
+	return results;
+}
+
+/*
+ * Name index
+ *
+ * storm.NameIndex maps the names listed by a stack of archives to the first
+ * archive holding them, in a flat open-addressing table keyed by the name the
+ * way StormLib hashes it: case-insensitive, with / and \ equivalent. Archives
+ * listing unnamed files (FileXXXXXXXX.xxx) may hold more than was indexed, so
+ * lookups missing the table still probe those with SFileHasFile.
+ *
+ * The listings of the archives can be passed in, e.g. when read back from a
+ * sidecar file, to skip enumerating them.
+ */
+
+struct NameEntry {
+	uint64_t hash;
+	size_t name; /* offset of the name in NameTable::names and NameTable::originals */
+	size_t length;
+	size_t archive;
+	DWORD hashIndex;
+	DWORD blockIndex;
+};
+
+struct NameTable;
+
+/* Directories of the names in a NameTable, see "Directory tree" below */
+struct DirectoryTree {
+	struct Node {
+		size_t name; /* offset of the component in NameTable::originals */
+		size_t length;
+		std::map<std::string, size_t> children; /* by normalized component */
+		std::vector<size_t> files; /* entries, by normalized name */
+	};
+
+	std::vector<Node> nodes; /* the root first */
+
+	void build(NameTable const& table);
+	long find(std::string const& key, size_t length) const;
+};
+
+struct NameTable {
+	std::string names; /* normalized */
+	std::string originals; /* as listed, at the same offsets */
+	std::vector<NameEntry> entries;
+	std::vector<size_t> slots; /* index in entries + 1, 0 if empty */
+	std::vector<bool> complete; /* for each archive, whether all its files are named */
+	/* Built by the first directory query */
+	std::mutex treeLock;
+	std::unique_ptr<DirectoryTree> tree;
+
+	DirectoryTree const& directories() {
+		std::lock_guard<std::mutex> guard(treeLock);
+		if (!tree) {
+			tree.reset(new DirectoryTree);
+			tree->build(*this);
+		}
+		return *tree;
+	}
+
+	static void normalize(char const *name, std::string *key) {
+		key->clear();
+		for (; *name; ++name) {
+			char c = *name;
+			key->push_back(c == '/' ? '\\' : (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c);
+		}
+	}
+
+	/* FNV-1a */
+	static uint64_t hash(std::string const& key) {
+		uint64_t h = 0xcbf29ce484222325ULL;
+		for (char c : key) {
+			h = (h ^ (unsigned char)c) * 0x100000001b3ULL;
+		}
+		return h;
+	}
+
+	/* Whether StormLib made \a name up for a file missing from the listfile */
+	static bool is_unnamed(char const *name) {
+		if (strncmp(name, "File", 4) != 0) {
+			return false;
+		}
+		for (int i = 4; i < 12; ++i) {
+			if (name[i] < '0' || name[i] > '9') {
+				return false;
+			}
+		}
+		return name[12] == '.';
+	}
+
+	int compare(size_t a, size_t b) const {
+		NameEntry const& x = entries[a];
+		NameEntry const& y = entries[b];
+		return names.compare(x.name, x.length, names, y.name, y.length);
+	}
+
+	/* Sets \a name to the name of \a entry as listed, with \a separator between its components */
+	void display(size_t entry, char separator, std::string *name) const {
+		name->assign(originals, entries[entry].name, entries[entry].length);
+		for (char& c : *name) {
+			if (c == '\\' || c == '/') {
+				c = separator;
+			}
+		}
+	}
+
+	/* Returns the slot holding \a key, or the empty slot where it belongs */
+	size_t probe(std::string const& key, uint64_t h) const {
+		size_t mask = slots.size() - 1;
+		for (size_t i = h & mask;; i = (i + 1) & mask) {
+			if (!slots[i]) {
+				return i;
+			}
+			NameEntry const& entry = entries[slots[i] - 1];
+			if (entry.hash == h && entry.length == key.size() && names.compare(entry.name, entry.length, key) == 0) {
+				return i;
+			}
+		}
+	}
+
+	NameEntry const * find(std::string const& key) const {
+		size_t slot = probe(key, hash(key));
+		return slots[slot] ? &entries[slots[slot] - 1] : NULL;
+	}
+
+	void build(std::vector<FileListing> const& listings) {
+		size_t count = 0;
+		for (FileListing const& listing : listings) {
+			count += listing.hashIndex.size();
+		}
+		size_t capacity = 16;
+		while (capacity < count * 2) {
+			capacity *= 2;
+		}
+		slots.assign(capacity, 0);
+		entries.reserve(count);
+
+		std::string key;
+		for (size_t archive = 0; archive < listings.size(); ++archive) {
+			FileListing const& listing = listings[archive];
+			bool named = true;
+			char const *name = listing.names.c_str();
+			for (size_t i = 0; i < listing.hashIndex.size(); ++i, name += strlen(name) + 1) {
+				named = named && !is_unnamed(name);
+				normalize(name, &key);
+				uint64_t h = hash(key);
+				size_t slot = probe(key, h);
+				if (slots[slot]) {
+					continue; /* already in an earlier archive */
+				}
+				NameEntry entry = {h, names.size(), key.size(), archive, listing.hashIndex[i], listing.blockIndex[i]};
+				names += key;
+				originals += name;
+				entries.push_back(entry);
+				slots[slot] = entries.size();
+			}
+			complete.push_back(named);
+		}
+	}
+};
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *archives; /* tuple of storm.Archive */
+	NameTable *table;
+} NameIndexObject;
+
+static PyObject * NameIndex_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	static char const *kwlist[] = {"archives", "listings", NULL};
+	PyObject *archivesObject;
+	PyObject *listingsObject = Py_None;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:NameIndex", (char **)kwlist, &archivesObject, &listingsObject)) {
+		return NULL;
+	}
+	PyObject *archives = PySequence_Tuple(archivesObject);
+	if (!archives) {
+		return NULL;
+	}
+	PyObject *listingsTuple = NULL;
+	if (listingsObject != Py_None) {
+		listingsTuple = PySequence_Tuple(listingsObject);
+		if (!listingsTuple) {
+			Py_DECREF(archives);
+			return NULL;
+		}
+		if (PyTuple_GET_SIZE(listingsTuple) != PyTuple_GET_SIZE(archives)) {
+			PyErr_SetString(PyExc_ValueError, "listings must hold one FileList per archive");
+			Py_DECREF(listingsTuple);
+			Py_DECREF(archives);
+			return NULL;
+		}
+	}
+
+	std::vector<FileListing> listings(PyTuple_GET_SIZE(archives));
+	for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(archives); ++i) {
+		PyObject *item = PyTuple_GET_ITEM(archives, i);
+		if (!PyObject_TypeCheck(item, &ArchiveType)) {
+			PyErr_Format(PyExc_TypeError, "archives must be %s, not %.50s", ArchiveType.tp_name, Py_TYPE(item)->tp_name);
+			Py_XDECREF(listingsTuple);
+			Py_DECREF(archives);
+			return NULL;
+		}
+		if (listingsTuple) {
+			if (!listing_from_python(PyTuple_GET_ITEM(listingsTuple, i), &listings[i])) {
+				Py_DECREF(listingsTuple);
+				Py_DECREF(archives);
+				return NULL;
+			}
+			continue;
+		}
+		ArchiveObject *archive = (ArchiveObject *)item;
+		DWORD error;
+		if (!ensure_loaded(archive, DEFER_LISTFILE) || !call_locked(archive, &archive->mpq, OP_LIST, [&]() -> DWORD { error = list_files(archive->mpq, "*", &listings[i]); return error; })) {
+			Py_DECREF(archives);
+			return NULL;
+		}
+		if (error != ERROR_NO_MORE_FILES) {
+			PyErr_SetString(StormError, "Error searching archive");
+			Py_DECREF(archives);
+			return NULL;
+		}
+	}
+	Py_XDECREF(listingsTuple);
+
+	NameIndexObject *self = (NameIndexObject *)type->tp_alloc(type, 0);
+	if (!self) {
+		Py_DECREF(archives);
+		return NULL;
+	}
+	self->archives = archives;
+	self->table = new NameTable;
+	Py_BEGIN_ALLOW_THREADS
+	self->table->build(listings);
+	Py_END_ALLOW_THREADS
+
+	return (PyObject *)self;
+}
+
+static void NameIndex_dealloc(NameIndexObject *self) {
+	delete self->table;
+	Py_XDECREF(self->archives);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Returns a borrowed reference to the first archive holding \a name, Py_None if none does, NULL on error */
+static PyObject * name_index_get(NameIndexObject *self, PyObject *nameObject) {
+	char const *name;
+	if (!python::detail::from_python(nameObject, &name)) {
+		return NULL;
+	}
+	std::string key;
+	NameTable::normalize(name, &key);
+	NameEntry const *entry = self->table->find(key);
+
+	size_t end = entry ? entry->archive : self->table->complete.size();
+	for (size_t i = 0; i < end; ++i) {
+		if (self->table->complete[i]) {
+			continue;
+		}
+		ArchiveObject *archive = (ArchiveObject *)PyTuple_GET_ITEM(self->archives, i);
+		bool found;
+		if (!call_locked(archive, &archive->mpq, OP_HAS_FILE, [&]() -> DWORD { found = SFileHasFile(archive->mpq, name); return call_error(found, ERROR_FILE_NOT_FOUND); })) {
+			return NULL;
+		}
+		if (found) {
+			return (PyObject *)archive;
+		}
+	}
+
+	return entry ? PyTuple_GET_ITEM(self->archives, entry->archive) : Py_None;
+}
+
+static PyObject * NameIndex_get(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	PyObject *name;
+
+	if (!python::parse_args(args, nargs, "get", 1, &name)) {
+		return NULL;
+	}
+	PyObject *archive = name_index_get((NameIndexObject *)self, name);
+	Py_XINCREF(archive);
+	return archive;
+}
+
+static PyObject * NameIndex_entry(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	NameIndexObject *self = (NameIndexObject *)self_;
+	char const *name;
+
+	if (!python::parse_args(args, nargs, "entry", 1, &name)) {
+		return NULL;
+	}
+	std::string key;
+	NameTable::normalize(name, &key);
+	NameEntry const *entry = self->table->find(key);
+	if (!entry) {
+		Py_RETURN_NONE;
+	}
+
+	return Py_BuildValue("(Okk)", PyTuple_GET_ITEM(self->archives, entry->archive), (unsigned long)entry->hashIndex, (unsigned long)entry->blockIndex);
+}
+
+static PyObject * NameIndex_contains(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	PyObject *names;
+
+	if (!python::parse_args(args, nargs, "contains", 1, &names)) {
+		return NULL;
+	}
+	PyObject *sequence = PySequence_Fast(names, "names must be iterable");
+	if (!sequence) {
+		return NULL;
+	}
+	Py_ssize_t size = PySequence_Fast_GET_SIZE(sequence);
+	PyObject *result = PyList_New(size);
+	if (!result) {
+		Py_DECREF(sequence);
+		return NULL;
+	}
+	for (Py_ssize_t i = 0; i < size; ++i) {
+		PyObject *archive = name_index_get((NameIndexObject *)self, PySequence_Fast_GET_ITEM(sequence, i));
+		if (!archive) {
+			Py_DECREF(result);
+			Py_DECREF(sequence);
+			return NULL;
+		}
+		PyList_SET_ITEM(result, i, PyBool_FromLong(archive != Py_None));
+	}
+	Py_DECREF(sequence);
+
+	return result;
+}
+
+static int NameIndex_sq_contains(PyObject *self, PyObject *name) {
+	PyObject *archive = name_index_get((NameIndexObject *)self, name);
+	return archive ? archive != Py_None : -1;
+}
+
+static Py_ssize_t NameIndex_sq_length(PyObject *self) {
+	return ((NameIndexObject *)self)->table->entries.size();
+}
+
+/*
+ * Directory tree
+ *
+ * Archives have no directories, only names. The first directory query on a
+ * storm.NameIndex splits its names on separators into a tree of directories
+ * holding their files, so that listdir(), walk(), glob() and search() only
+ * visit the directories they return or search. Components compare the way
+ * names do, case-insensitively, and keep the case they were first listed with.
+ *
+ * Globs are matched natively: ? and * stop at separators, ** crosses them,
+ * and a whole ** component may also stand for no directory at all.
+ * The literal directories a glob starts with select the subtree it searches,
+ * and globs without ** only look at the depth their separators give.
+ * search() takes ECMAScript regular expressions, searched case-insensitively
+ * in the names. Both run with the GIL released.
+ */
+
+void DirectoryTree::build(NameTable const& table) {
+	nodes.assign(1, Node());
+	nodes[0].name = 0;
+	nodes[0].length = 0;
+	std::string component;
+	for (size_t i = 0; i < table.entries.size(); ++i) {
+		NameEntry const& entry = table.entries[i];
+		size_t node = 0;
+		size_t end = entry.name + entry.length;
+		for (size_t start = entry.name, separator; (separator = table.names.find('\\', start)) < end; start = separator + 1) {
+			component.assign(table.names, start, separator - start);
+			auto it = nodes[node].children.find(component);
+			if (it != nodes[node].children.end()) {
+				node = it->second;
+				continue;
+			}
+			size_t child = nodes.size();
+			nodes[node].children[component] = child;
+			nodes.push_back(Node());
+			nodes[child].name = start;
+			nodes[child].length = separator - start;
+			node = child;
+		}
+		nodes[node].files.push_back(i);
+	}
+
+	for (Node& node : nodes) {
+		std::sort(node.files.begin(), node.files.end(), [&](size_t a, size_t b) {
+			return table.compare(a, b) < 0;
+		});
+	}
+}
+
+/* Returns the node of the directory named by the first \a length characters of the normalized \a key, or -1 */
+long DirectoryTree::find(std::string const& key, size_t length) const {
+	size_t node = 0;
+	std::string component;
+	for (size_t start = 0; start < length;) {
+		size_t separator = std::min(key.find('\\', start), length);
+		if (separator > start) {
+			component.assign(key, start, separator - start);
+			auto it = nodes[node].children.find(component);
+			if (it == nodes[node].children.end()) {
+				return -1;
+			}
+			node = it->second;
+		}
+		start = separator + 1;
+	}
+	return node;
+}
+
+/* Matches the normalized name from \a name to \a end against the normalized \a pattern,
+ * which starts a component of the name unless \a inside */
+static bool glob_match(char const *pattern, char const *name, char const *end, bool inside = false) {
+	for (; *pattern; inside = *pattern != '\\', ++pattern, ++name) {
+		if (*pattern == '*') {
+			bool any = pattern[1] == '*';
+			/* A whole **\ component also matches no directory, as a\**\b does a\b */
+			if (any && !inside && pattern[2] == '\\' && glob_match(pattern + 3, name, end)) {
+				return true;
+			}
+			pattern += any ? 2 : 1;
+			for (;; ++name) {
+				if (glob_match(pattern, name, end, true)) {
+					return true;
+				}
+				if (name == end || (!any && *name == '\\')) {
+					return false;
+				}
+			}
+		}
+		if (name == end || (*pattern == '?' ? *name == '\\' : *pattern != *name)) {
+			return false;
+		}
+	}
+	return name == end;
+}
+
+/* Files found by glob() or search(), once each. Does not need the GIL. */
+struct DirectoryQuery {
+	NameTable const *table;
+	DirectoryTree const *tree;
+	std::vector<size_t> found; /* entries */
+	std::vector<bool> seen; /* by entry, when several patterns may find the same files */
+
+	void add(size_t entry) {
+		if (!seen.empty()) {
+			if (seen[entry]) {
+				return;
+			}
+			seen[entry] = true;
+		}
+		found.push_back(entry);
+	}
+
+	/* Appends the directories \a depth levels below \a node, or at any depth if negative, to \a directories */
+	void visit(size_t node, int depth, std::vector<DirectoryTree::Node const *> *directories) const {
+		DirectoryTree::Node const& directory = tree->nodes[node];
+		if (depth <= 0) {
+			directories->push_back(&directory);
+		}
+		if (depth != 0) {
+			for (auto const& child : directory.children) {
+				visit(child.second, depth < 0 ? depth : depth - 1, directories);
+			}
+		}
+	}
+
+	void glob(std::string const& pattern) {
+		size_t prefix = pattern.rfind('\\', pattern.find_first_of("*?"));
+		prefix = prefix == std::string::npos ? 0 : prefix + 1;
+		long node = tree->find(pattern, prefix);
+		if (node < 0) {
+			return;
+		}
+		int depth = -1;
+		if (pattern.find("**", prefix) == std::string::npos) {
+			depth = std::count(pattern.begin() + prefix, pattern.end(), '\\');
+		}
+		std::vector<DirectoryTree::Node const *> directories;
+		visit(node, depth, &directories);
+		for (DirectoryTree::Node const *directory : directories) {
+			for (size_t entry : directory->files) {
+				/* Files below the node share the prefix */
+				NameEntry const& e = table->entries[entry];
+				char const *name = table->names.data() + e.name;
+				if (glob_match(pattern.c_str() + prefix, name + prefix, name + e.length)) {
+					add(entry);
+				}
+			}
+		}
+	}
+
+	//! \throw std::regex_error if a match gets too complex
+	void search(std::vector<std::regex> const& patterns, size_t node, char separator) {
+		std::vector<DirectoryTree::Node const *> directories;
+		visit(node, -1, &directories);
+		std::string name;
+		for (DirectoryTree::Node const *directory : directories) {
+			for (size_t entry : directory->files) {
+				table->display(entry, separator, &name);
+				for (std::regex const& pattern : patterns) {
+					if (std::regex_search(name, pattern)) {
+						add(entry);
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	void sort() {
+		std::sort(found.begin(), found.end(), [&](size_t a, size_t b) {
+			return table->compare(a, b) < 0;
+		});
+	}
+};
+
+/* Reads \a object, a str or an iterable of them, into \a strings */
+static bool strings_from_python(PyObject *object, std::vector<std::string> *strings) {
+	char const *string;
+	if (PyUnicode_Check(object)) {
+		if (!python::detail::from_python(object, &string)) {
+			return false;
+		}
+		strings->push_back(string);
+		return true;
+	}
+	PyObject *iterator = PyObject_GetIter(object);
+	if (!iterator) {
+		return false;
+	}
+	PyObject *item;
+	while ((item = PyIter_Next(iterator))) {
+		bool valid = python::detail::from_python(item, &string);
+		Py_DECREF(item);
+		if (!valid) {
+			Py_DECREF(iterator);
+			return false;
+		}
+		strings->push_back(string);
+	}
+	Py_DECREF(iterator);
+	return !PyErr_Occurred();
+}
+
+static bool separator_from_python(char const *string, char *separator) {
+	if (strlen(string) != 1) {
+		PyErr_SetString(PyExc_ValueError, "separator must be a single character");
+		return false;
+	}
+	*separator = string[0];
+	return true;
+}
+
+/* Returns the names of \a entries, with \a separator between their components */
+static PyObject * build_names(NameTable const& table, std::vector<size_t> const& entries, char separator) {
+	PyObject *list = PyList_New(entries.size());
+	if (!list) {
+		return NULL;
+	}
+	std::string name;
+	for (size_t i = 0; i < entries.size(); ++i) {
+		table.display(entries[i], separator, &name);
+		PyObject *item = PyUnicode_FromStringAndSize(name.data(), name.size());
+		if (!item) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i, item);
+	}
+	return list;
+}
+
+/* Returns the names of the subdirectories of \a directory */
+static PyObject * build_subdirectories(NameTable const& table, DirectoryTree const& tree, DirectoryTree::Node const& directory) {
+	PyObject *list = PyList_New(directory.children.size());
+	if (!list) {
+		return NULL;
+	}
+	Py_ssize_t i = 0;
+	for (auto const& child : directory.children) {
+		DirectoryTree::Node const& node = tree.nodes[child.second];
+		PyObject *item = PyUnicode_FromStringAndSize(table.originals.data() + node.name, node.length);
+		if (!item) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i++, item);
+	}
+	return list;
+}
+
+/* Returns the names of the files in \a directory, without their directory */
+static PyObject * build_files(NameTable const& table, DirectoryTree::Node const& directory) {
+	PyObject *list = PyList_New(directory.files.size());
+	if (!list) {
+		return NULL;
+	}
+	Py_ssize_t i = 0;
+	for (size_t entry : directory.files) {
+		NameEntry const& e = table.entries[entry];
+		size_t start = table.names.rfind('\\', e.name + e.length - 1);
+		start = start == std::string::npos || start < e.name ? e.name : start + 1;
+		PyObject *item = PyUnicode_FromStringAndSize(table.originals.data() + start, e.name + e.length - start);
+		if (!item) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i++, item);
+	}
+	return list;
+}
+
+/* Returns the directory of \a table named \a path, or NULL with a KeyError */
+static DirectoryTree::Node const * find_directory(NameTable *table, char const *path) {
+	std::string key;
+	NameTable::normalize(path, &key);
+	DirectoryTree const *tree;
+	long node;
+	Py_BEGIN_ALLOW_THREADS
+	tree = &table->directories();
+	node = tree->find(key, key.size());
+	Py_END_ALLOW_THREADS
+	if (node < 0) {
+		PyErr_SetString(PyExc_KeyError, path);
+		return NULL;
+	}
+	return &tree->nodes[node];
+}
+
+static PyObject * NameIndex_listdir(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	NameIndexObject *self = (NameIndexObject *)self_;
+	char const *path = "";
+
+	if (!python::parse_args(args, nargs, "listdir", 0, &path)) {
+		return NULL;
+	}
+	DirectoryTree::Node const *directory = find_directory(self->table, path);
+	if (!directory) {
+		return NULL;
+	}
+
+	PyObject *list = build_subdirectories(*self->table, *self->table->tree, *directory);
+	PyObject *files = list ? build_files(*self->table, *directory) : NULL;
+	if (!files || PyList_SetSlice(list, PyList_GET_SIZE(list), PyList_GET_SIZE(list), files) < 0) {
+		Py_XDECREF(files);
+		Py_XDECREF(list);
+		return NULL;
+	}
+	Py_DECREF(files);
+	return list;
+}
+
+static PyObject * NameIndex_isdir(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	NameIndexObject *self = (NameIndexObject *)self_;
+	char const *path;
+
+	if (!python::parse_args(args, nargs, "isdir", 1, &path)) {
+		return NULL;
+	}
+	if (!find_directory(self->table, path)) {
+		if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
+			return NULL;
+		}
+		PyErr_Clear();
+		Py_RETURN_FALSE;
+	}
+
+	Py_RETURN_TRUE;
+}
+
+struct WalkStep {
+	DirectoryTree::Node const *directory;
+	std::string path;
+};
+
+/* Appends \a node and its subdirectories, top-down, to \a steps */
+static void walk_tree(NameTable const& table, DirectoryTree const& tree, size_t node, std::string const& path, char separator, std::vector<WalkStep> *steps) {
+	DirectoryTree::Node const& directory = tree.nodes[node];
+	steps->push_back(WalkStep{&directory, path});
+	for (auto const& child : directory.children) {
+		DirectoryTree::Node const& subdirectory = tree.nodes[child.second];
+		std::string subpath = path;
+		if (!subpath.empty()) {
+			subpath += separator;
+		}
+		subpath.append(table.originals, subdirectory.name, subdirectory.length);
+		walk_tree(table, tree, child.second, subpath, separator, steps);
+	}
+}
+
+static PyObject * NameIndex_walk(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	NameIndexObject *self = (NameIndexObject *)self_;
+	char const *path = "";
+	char const *separatorString = "\\";
+	char separator;
+
+	if (!python::parse_args(args, nargs, "walk", 0, &path, &separatorString) || !separator_from_python(separatorString, &separator)) {
+		return NULL;
+	}
+	/* Directories are named like os.walk() does, from the path given */
+	std::string key;
+	NameTable::normalize(path, &key);
+	std::string top = path;
+	while (!top.empty() && (top.back() == '\\' || top.back() == '/')) {
+		top.pop_back();
+	}
+	std::replace(top.begin(), top.end(), separator == '/' ? '\\' : '/', separator);
+	NameTable *table = self->table;
+	DirectoryTree const *tree;
+	std::vector<WalkStep> steps;
+	Py_BEGIN_ALLOW_THREADS
+	tree = &table->directories();
+	long node = tree->find(key, key.size());
+	if (node >= 0) {
+		walk_tree(*table, *tree, node, top, separator, &steps);
+	}
+	Py_END_ALLOW_THREADS
+
+	PyObject *list = PyList_New(steps.size());
+	if (!list) {
+		return NULL;
+	}
+	for (size_t i = 0; i < steps.size(); ++i) {
+		DirectoryTree::Node const& directory = *steps[i].directory;
+		PyObject *directories = build_subdirectories(*table, *tree, directory);
+		PyObject *files = directories ? build_files(*table, directory) : NULL;
+		PyObject *item = files ? Py_BuildValue("(s#OO)", steps[i].path.data(), (Py_ssize_t)steps[i].path.size(), directories, files) : NULL;
+		Py_XDECREF(directories);
+		Py_XDECREF(files);
+		if (!item) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i, item);
+	}
+	return list;
+}
+
+static PyObject * NameIndex_glob(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	NameIndexObject *self = (NameIndexObject *)self_;
+	PyObject *patternsObject;
+	char const *separatorString = "\\";
+	char separator;
+
+	if (!python::parse_args(args, nargs, "glob", 1, &patternsObject, &separatorString) || !separator_from_python(separatorString, &separator)) {
+		return NULL;
+	}
+	std::vector<std::string> patterns;
+	if (!strings_from_python(patternsObject, &patterns)) {
+		return NULL;
+	}
+	for (std::string& pattern : patterns) {
+		std::string key;
+		NameTable::normalize(pattern.c_str(), &key);
+		pattern.swap(key);
+	}
+
+	DirectoryQuery query;
+	query.table = self->table;
+	Py_BEGIN_ALLOW_THREADS
+	query.tree = &self->table->directories();
+	if (patterns.size() > 1) {
+		query.seen.assign(self->table->entries.size(), false);
+	}
+	for (std::string const& pattern : patterns) {
+		query.glob(pattern);
+	}
+	query.sort();
+	Py_END_ALLOW_THREADS
+
+	return build_names(*self->table, query.found, separator);
+}
+
+static PyObject * NameIndex_search(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	NameIndexObject *self = (NameIndexObject *)self_;
+	PyObject *patternsObject;
+	char const *path = "";
+	char const *separatorString = "\\";
+	char separator;
+
+	if (!python::parse_args(args, nargs, "search", 1, &patternsObject, &path, &separatorString) || !separator_from_python(separatorString, &separator)) {
+		return NULL;
+	}
+	std::vector<std::string> strings;
+	if (!strings_from_python(patternsObject, &strings)) {
+		return NULL;
+	}
+	std::vector<std::regex> patterns;
+	std::string key;
+	NameTable::normalize(path, &key);
+
+	DirectoryQuery query;
+	query.table = self->table;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		for (std::string const& string : strings) {
+			patterns.emplace_back(string, std::regex::ECMAScript | std::regex::icase | std::regex::optimize);
+		}
+		query.tree = &self->table->directories();
+		long node = query.tree->find(key, key.size());
+		if (node >= 0) {
+			if (patterns.size() > 1) {
+				query.seen.assign(self->table->entries.size(), false);
+			}
+			query.search(patterns, node, separator);
+			query.sort();
+		}
+	} catch (std::regex_error const& e) {
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS
+	if (!error.empty()) {
+		PyErr_Format(PyExc_ValueError, "Invalid pattern: %s", error.c_str());
+		return NULL;
+	}
+
+	return build_names(*self->table, query.found, separator);
+}
+
+/*
+ * Patch index
+ *
+ * Opening a file patched makes StormLib look it up in every patch of the
+ * archive and apply them in turn, at every open. storm.PatchIndex records the
+ * layer of an archive supplying the final content of each file: 0 for the
+ * base archive, i + 1 for its i-th patch. Files of layer 0 read the same from
+ * the base archive alone (SFILE_OPEN_BASE_FILE), skipping the patch chain.
+ *
+ * Layers are resolved on first lookup, or in bulk by resolve(), and kept
+ * until the archive is patched again.
+ */
+
+struct PatchLayers {
+	uint64_t archive; /* ArchiveState::id the layers were resolved for */
+	std::unordered_map<std::string, int> layers; /* by normalized name */
+
+	/* Drops the layers resolved before the archive became \a id */
+	void renew(uint64_t id) {
+		if (archive != id) {
+			layers.clear();
+			archive = id;
+		}
+	}
+};
+
+typedef struct {
+	PyObject_HEAD
+	ArchiveObject *archive;
+	DWORD scope;
+	PatchLayers *table;
+} PatchIndexObject;
+
+static PyTypeObject PatchIndexType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+/* Returns the layer of \a source at the end of \a chain, the names of the archives holding a file */
+static int archive_layer(ArchiveSource const& source, std::vector<std::string> const& chain) {
+	for (size_t i = source.patches.size(); i > 0; --i) {
+		if (source.patches[i - 1].name == chain.back()) {
+			return (int)i;
+		}
+	}
+	/* Held by a single archive that is no patch: the base one, whatever StormLib calls it */
+	return chain.size() == 1 ? 0 : (int)source.patches.size();
+}
+
+/* Returns the layer supplying \a name in \a archive, -1 if it has no such file. Must hold the archive lock. */
+static int resolve_layer(ArchiveObject *archive, char const *name, DWORD scope) {
+	ArchiveSource const& source = archive->state->source;
+	if (source.patches.empty()) {
+		return SFileHasFile(archive->mpq, name) ? 0 : -1;
+	}
+	HANDLE file;
+	if (!SFileOpenFileEx(archive->mpq, name, scope, &file)) {
+		return -1;
+	}
+	std::vector<std::string> chain;
+	int layer = (int)source.patches.size();
+	if (patch_chain(file, &chain) && !chain.empty()) {
+		layer = archive_layer(source, chain);
+	}
+	SFileCloseFile(file);
+	return layer;
+}
+
+static PyObject * PatchIndex_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	static char const *kwlist[] = {"archive", "scope", NULL};
+	PyObject *archive;
+	unsigned long scope = SFILE_OPEN_FROM_MPQ;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|k:PatchIndex", (char **)kwlist, &ArchiveType, &archive, &scope)) {
+		return NULL;
+	}
+	PatchIndexObject *self = (PatchIndexObject *)type->tp_alloc(type, 0);
+	if (!self) {
+		return NULL;
+	}
+	Py_INCREF(archive);
+	self->archive = (ArchiveObject *)archive;
+	self->scope = (DWORD)scope;
+	self->table = new PatchLayers;
+	self->table->archive = self->archive->state->id;
+
+	return (PyObject *)self;
+}
+
+static void PatchIndex_dealloc(PatchIndexObject *self) {
+	delete self->table;
+	Py_XDECREF(self->archive);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Looks the layer of \a nameObject up, resolving it if needed. Returns false on error. */
+static bool patch_index_get(PatchIndexObject *self, PyObject *nameObject, int *layer) {
+	char const *name;
+	if (!python::detail::from_python(nameObject, &name)) {
+		return false;
+	}
+	std::string key;
+	NameTable::normalize(name, &key);
+	self->table->renew(self->archive->state->id);
+	auto it = self->table->layers.find(key);
+	if (it != self->table->layers.end()) {
+		*layer = it->second;
+		return true;
+	}
+
+	ArchiveObject *archive = self->archive;
+	uint64_t id;
+	if (!call_locked(archive, &archive->mpq, OP_PATCH_INDEX, [&]() -> DWORD {
+		*layer = resolve_layer(archive, name, self->scope);
+		id = archive->state->id;
+		return ERROR_SUCCESS;
+	})) {
+		return false;
+	}
+	self->table->renew(id);
+	if (*layer >= 0) {
+		self->table->layers[key] = *layer;
+	}
+	return true;
+}
+
+static PyObject * PatchIndex_get(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	PyObject *name;
+	PyObject *defaultObject = Py_None;
+
+	if (!python::parse_args(args, nargs, "get", 1, &name, &defaultObject)) {
+		return NULL;
+	}
+	int layer;
+	if (!patch_index_get((PatchIndexObject *)self, name, &layer)) {
+		return NULL;
+	}
+	if (layer < 0) {
+		Py_INCREF(defaultObject);
+		return defaultObject;
+	}
+
+	return PyLong_FromLong(layer);
+}
+
+static PyObject * PatchIndex_resolve(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	PatchIndexObject *self = (PatchIndexObject *)self_;
+	PyObject *namesObject = Py_None;
+
+	if (!python::parse_args(args, nargs, "resolve", 0, &namesObject)) {
+		return NULL;
+	}
+	std::vector<std::string> names;
+	if (namesObject != Py_None) {
+		PyObject *sequence = PySequence_Fast(namesObject, "names must be iterable");
+		if (!sequence) {
+			return NULL;
+		}
+		for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(sequence); ++i) {
+			char const *name;
+			if (!python::detail::from_python(PySequence_Fast_GET_ITEM(sequence, i), &name)) {
+				Py_DECREF(sequence);
+				return NULL;
+			}
+			names.push_back(name);
+		}
+		Py_DECREF(sequence);
+	} else if (!ensure_loaded(self->archive, DEFER_LISTFILE)) {
+		return NULL;
+	}
+
+	/* Listed and resolved in a single call, so that the archive is not patched in between */
+	ArchiveObject *archive = self->archive;
+	std::vector<int> layers;
+	uint64_t id;
+	DWORD error = ERROR_NO_MORE_FILES;
+	if (!call_locked(archive, &archive->mpq, OP_PATCH_INDEX, [&]() -> DWORD {
+		if (namesObject == Py_None) {
+			FileListing listing;
+			error = list_files(archive->mpq, "*", &listing);
+			for (char const *name = listing.names.c_str(); names.size() < listing.hashIndex.size(); name += strlen(name) + 1) {
+				names.push_back(name);
+			}
+		}
+		if (error == ERROR_NO_MORE_FILES) {
+			for (std::string const& name : names) {
+				layers.push_back(resolve_layer(archive, name.c_str(), self->scope));
+			}
+		}
+		id = archive->state->id;
+		return error;
+	})) {
+		return NULL;
+	}
+	if (error != ERROR_NO_MORE_FILES) {
+		PyErr_SetString(StormError, "Error searching archive");
+		return NULL;
+	}
+
+	self->table->renew(id);
+	PyObject *result = PyDict_New();
+	if (!result) {
+		return NULL;
+	}
+	std::string key;
+	for (size_t i = 0; i < names.size(); ++i) {
+		if (layers[i] < 0) {
+			continue;
+		}
+		NameTable::normalize(names[i].c_str(), &key);
+		self->table->layers[key] = layers[i];
+		PyObject *layer = PyLong_FromLong(layers[i]);
+		if (!layer || PyDict_SetItemString(result, names[i].c_str(), layer) < 0) {
+			Py_XDECREF(layer);
+			Py_DECREF(result);
+			return NULL;
+		}
+		Py_DECREF(layer);
+	}
+
+	return result;
+}
+
+static PyObject * PatchIndex_mp_subscript(PyObject *self, PyObject *name) {
+	int layer;
+	if (!patch_index_get((PatchIndexObject *)self, name, &layer)) {
+		return NULL;
+	}
+	if (layer < 0) {
+		PyErr_SetObject(PyExc_KeyError, name);
+		return NULL;
+	}
+
+	return PyLong_FromLong(layer);
+}
+
+static Py_ssize_t PatchIndex_mp_length(PyObject *self) {
+	return ((PatchIndexObject *)self)->table->layers.size();
+}
+
+/*
+ * File cache
+ *
+ * storm.Cache is a byte-bounded LRU cache of decompressed files, shared by
+ * any number of archives and threads. Files up to file_limit bytes are cached
+ * whole; larger ones by sector, so that reading part of them decompresses only
+ * what is missing. Entries are keyed by archive contents (patching an archive
+ * renews them), normalized file name and scope.
+ *
+ * Cached data is returned as storm.Buffer objects, read-only buffers sharing
+ * the cached memory. They stay valid after being evicted.
+ */
+
+typedef std::shared_ptr<std::string const> CacheData;
+
+struct CacheKey {
+	uint64_t archive;
+	std::string name;
+	DWORD scope;
+	uint64_t sector; /* WHOLE_FILE for whole files and large file records */
+
+	static uint64_t const WHOLE_FILE = ~(uint64_t)0;
+
+	bool operator==(CacheKey const& other) const {
+		return archive == other.archive && sector == other.sector && scope == other.scope && name == other.name;
+	}
+};
+
+struct CacheKeyHash {
+	size_t operator()(CacheKey const& key) const {
+		size_t h = std::hash<std::string>()(key.name);
+		h ^= std::hash<uint64_t>()(key.archive) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+		h ^= std::hash<uint64_t>()(key.sector ^ ((uint64_t)key.scope << 48)) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+		return h;
+	}
+};
+
+struct CacheEntry {
+	CacheKey key;
+	CacheData data; /* NULL in the record of a file cached by sector */
+	uint64_t fileSize;
+	DWORD sectorSize;
+
+	size_t cost() const {
+		return sizeof(CacheEntry) + key.name.size() + (data ? data->size() : 0);
+	}
+};
+
+struct FileCache {
+	std::mutex lock;
+	std::list<CacheEntry> entries; /* most recently used first */
+	std::unordered_map<CacheKey, std::list<CacheEntry>::iterator, CacheKeyHash> index;
+	size_t capacity;
+	size_t fileLimit;
+	size_t size;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+
+	FileCache(size_t capacity, size_t fileLimit) : capacity(capacity), fileLimit(fileLimit), size(0), hits(0), misses(0), evictions(0) {}
+
+	/* Must hold the lock */
+	bool get(CacheKey const& key, CacheEntry *entry) {
+		auto it = index.find(key);
+		if (it == index.end()) {
+			++misses;
+			return false;
+		}
+		++hits;
+		entries.splice(entries.begin(), entries, it->second);
+		*entry = *it->second;
+		return true;
+	}
+
+	/* Must hold the lock */
+	void put(CacheEntry const& entry) {
+		if (entry.cost() > capacity) {
+			return;
+		}
+		auto it = index.find(entry.key);
+		if (it != index.end()) {
+			size -= it->second->cost();
+			entries.erase(it->second);
+			index.erase(it);
+		}
+		entries.push_front(entry);
+		index[entry.key] = entries.begin();
+		size += entry.cost();
+		while (size > capacity) {
+			size -= entries.back().cost();
+			index.erase(entries.back().key);
+			entries.pop_back();
+			++evictions;
+		}
+	}
+
+	/* Must hold the lock */
+	void clear() {
+		entries.clear();
+		index.clear();
+		size = 0;
+	}
+};
+
+typedef struct {
+	PyObject_HEAD
+	FileCache *cache;
+} CacheObject;
+
+typedef struct {
+	PyObject_HEAD
+	CacheData *data;
+	size_t offset;
+	size_t length;
+	/* Typed columns, see new_column(); NULL format for bytes */
+	char const *format;
+	Py_ssize_t itemsize;
+	Py_ssize_t count;
+	Py_ssize_t stride;
+} BufferObject;
+
+static PyTypeObject CacheType = { PyVarObject_HEAD_INIT(NULL, 0) };
+static PyTypeObject BufferType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+static PyObject * new_buffer(CacheData const& data, size_t offset, size_t length) {
+	BufferObject *self = (BufferObject *)BufferType.tp_alloc(&BufferType, 0);
+	if (!self) {
+		return NULL;
+	}
+	self->data = new CacheData(data);
+	self->offset = offset;
+	self->length = length;
+	self->format = NULL;
+	self->itemsize = 1;
+	self->count = length;
+	self->stride = 1;
+	return (PyObject *)self;
+}
+
+/* Returns a buffer of the \a count items of \a format, \a stride bytes apart, at \a offset of \a data */
+static PyObject * new_column(CacheData const& data, size_t offset, size_t count, char const *format, size_t itemsize, size_t stride) {
+	size_t length = count ? (count - 1) * stride + itemsize : 0;
+	BufferObject *self = (BufferObject *)new_buffer(data, offset, length);
+	if (!self) {
+		return NULL;
+	}
+	self->format = format;
+	self->itemsize = itemsize;
+	self->count = count;
+	self->stride = stride;
+	return (PyObject *)self;
+}
+
+static void Buffer_dealloc(BufferObject *self) {
+	delete self->data;
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int Buffer_getbuffer(BufferObject *self, Py_buffer *view, int flags) {
+	void *data = (void *)((*self->data)->data() + self->offset);
+	if (!self->format) {
+		return PyBuffer_FillInfo(view, (PyObject *)self, data, self->length, 1, flags);
+	}
+	bool contiguous = self->stride == self->itemsize;
+	if (!contiguous && (flags & PyBUF_STRIDES) != PyBUF_STRIDES) {
+		PyErr_SetString(PyExc_BufferError, "storm.Buffer holds a strided column");
+		return -1;
+	}
+	if (!(flags & PyBUF_ND)) {
+		/* Seen as plain bytes */
+		return PyBuffer_FillInfo(view, (PyObject *)self, data, self->count * self->itemsize, 1, flags);
+	}
+	if (flags & PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "storm.Buffer is read-only");
+		return -1;
+	}
+	Py_INCREF(self);
+	view->obj = (PyObject *)self;
+	view->buf = data;
+	view->len = self->count * self->itemsize;
+	view->readonly = 1;
+	view->itemsize = self->itemsize;
+	view->format = (flags & PyBUF_FORMAT) ? (char *)self->format : NULL;
+	view->ndim = 1;
+	view->shape = (flags & PyBUF_ND) ? &self->count : NULL;
+	view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &self->stride : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+static Py_ssize_t Buffer_sq_length(PyObject *self) {
+	return ((BufferObject *)self)->count;
+}
+
+static PyObject * Cache_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	static char const *kwlist[] = {"capacity", "file_limit", NULL};
+	Py_ssize_t capacity;
+	Py_ssize_t fileLimit = 1 << 20;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|n:Cache", (char **)kwlist, &capacity, &fileLimit)) {
+		return NULL;
+	}
+	if (capacity < 0 || fileLimit < 0) {
+		PyErr_SetString(PyExc_ValueError, "capacity and file_limit must not be negative");
+		return NULL;
+	}
+
+	CacheObject *self = (CacheObject *)type->tp_alloc(type, 0);
+	if (!self) {
+		return NULL;
+	}
+	self->cache = new FileCache(capacity, fileLimit);
+	return (PyObject *)self;
+}
+
+static void Cache_dealloc(CacheObject *self) {
+	delete self->cache;
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Reads up to \a length bytes at \a offset of \a file into \a data. Must hold the archive lock. */
+static DWORD read_at(HANDLE file, uint64_t offset, size_t length, std::string *data) {
+	LONG high = (LONG)(offset >> 32);
+	if (SFileSetFilePointer(file, (LONG)(DWORD)offset, &high, FILE_BEGIN) == SFILE_INVALID_SIZE) {
+		return last_error(ERROR_INVALID_PARAMETER);
+	}
+	data->resize(length);
+	DWORD bytesRead = 0;
+	if (!SFileReadFile(file, &(*data)[0], (DWORD)length, &bytesRead, NULL)) {
+		DWORD error = read_error(file);
+		if (error != ERROR_HANDLE_EOF) {
+			return error;
+		}
+	}
+	data->resize(bytesRead);
+	return ERROR_SUCCESS;
+}
+
+static PyObject * Cache_read(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	FileCache *cache = ((CacheObject *)self_)->cache;
+	PyObject *archiveObject;
+	char const *name;
+	unsigned long long offset = 0;
+	long long size = -1;
+	DWORD scope = SFILE_OPEN_FROM_MPQ;
+
+	if (!python::parse_args(args, nargs, "read", 2, &archiveObject, &name, &offset, &size, &scope)) {
+		return NULL;
+	}
+	if (!PyObject_TypeCheck(archiveObject, &ArchiveType)) {
+		PyErr_Format(PyExc_TypeError, "archive must be %s, not %.50s", ArchiveType.tp_name, Py_TYPE(archiveObject)->tp_name);
+		return NULL;
+	}
+	ArchiveObject *archive = (ArchiveObject *)archiveObject;
+
+	CacheKey key;
+	key.archive = archive->state->id;
+	NameTable::normalize(name, &key.name);
+	key.scope = scope;
+	key.sector = CacheKey::WHOLE_FILE;
+
+	CacheEntry record;
+	bool cached;
+	{
+		std::lock_guard<std::mutex> guard(cache->lock);
+		cached = cache->get(key, &record);
+	}
+
+	std::vector<std::pair<uint64_t, CacheData>> sectors;
+	uint64_t end = 0;
+	DWORD error = ERROR_SUCCESS;
+	bool opened = true;
+	if (!call_locked(archive, &archive->mpq, OP_CACHE_READ, [&]() -> DWORD {
+		HANDLE file = NULL;
+		if (!cached) {
+			/* Unknown file, read it whole or record its size to cache it by sector */
+			record.key = key;
+			record.sectorSize = 0;
+			if (!SFileOpenFileEx(archive->mpq, name, scope, &file)) {
+				opened = false;
+				return open_error(archive->mpq, name, scope);
+			}
+			DWORD sizeHigh;
+			DWORD sizeLow = SFileGetFileSize(file, &sizeHigh);
+			if (sizeLow == SFILE_INVALID_SIZE) {
+				error = last_error(ERROR_CAN_NOT_COMPLETE);
+				SFileCloseFile(file);
+				return error;
+			}
+			record.fileSize = make_uint64(sizeLow, sizeHigh);
+			if (record.fileSize <= cache->fileLimit) {
+				std::string *data = new std::string;
+				record.data.reset(data);
+				error = read_at(file, 0, record.fileSize, data);
+			} else if (!SFileGetFileInfo(archive->mpq, SFileMpqSectorSize, &record.sectorSize, sizeof(record.sectorSize), NULL) || !record.sectorSize) {
+				record.sectorSize = 4096;
+			}
+		}
+
+		uint64_t start = std::min<uint64_t>(offset, record.fileSize);
+		end = size < 0 ? record.fileSize : std::min<uint64_t>(start + size, record.fileSize);
+		if (record.data || error != ERROR_SUCCESS || start == end) {
+			if (file) SFileCloseFile(file);
+			return error;
+		}
+
+		/* Large file, read the missing sectors of the range */
+		uint64_t first = start / record.sectorSize;
+		uint64_t last = (end - 1) / record.sectorSize;
+		std::vector<uint64_t> missing;
+		{
+			std::lock_guard<std::mutex> guard(cache->lock);
+			for (uint64_t i = first; i <= last; ++i) {
+				CacheEntry entry;
+				key.sector = i;
+				sectors.push_back(std::make_pair(i * record.sectorSize, cache->get(key, &entry) ? entry.data : CacheData()));
+				if (!sectors.back().second) {
+					missing.push_back(sectors.size() - 1);
+				}
+			}
+		}
+		if (!missing.empty() && !file && !SFileOpenFileEx(archive->mpq, name, scope, &file)) {
+			opened = false;
+			return open_error(archive->mpq, name, scope);
+		}
+		for (size_t i : missing) {
+			std::string *data = new std::string;
+			sectors[i].second.reset(data);
+			error = read_at(file, sectors[i].first, record.sectorSize, data);
+			if (error != ERROR_SUCCESS) {
+				break;
+			}
+		}
+		if (file) SFileCloseFile(file);
+		return error;
+	})) {
+		return NULL;
+	}
+
+	if (!opened) {
+		PyErr_SetString(StormError, "Error opening file");
+		return NULL;
+	}
+	if (error != ERROR_SUCCESS) {
+		PyErr_Format(StormError, "Could not read file: %i", error);
+		return NULL;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(cache->lock);
+		if (!cached) {
+			cache->put(record);
+		}
+		for (auto const& sector : sectors) {
+			CacheEntry entry = {key, sector.second, record.fileSize, record.sectorSize};
+			entry.key.sector = sector.first / record.sectorSize;
+			cache->put(entry);
+		}
+	}
+
+	uint64_t start = std::min<uint64_t>(offset, record.fileSize);
+	if (record.data) {
+		return new_buffer(record.data, start, end - start);
+	}
+	if (sectors.size() == 1) {
+		CacheData const& data = sectors[0].second;
+		size_t at = std::min<uint64_t>(start - sectors[0].first, data->size());
+		return new_buffer(data, at, std::min<uint64_t>(end - start, data->size() - at));
+	}
+
+	/* Spanning several sectors, copy them together */
+	std::string *data = new std::string;
+	CacheData joined(data);
+	data->reserve(end - start);
+	for (auto const& sector : sectors) {
+		uint64_t from = std::max(start, sector.first) - sector.first;
+		uint64_t to = std::min<uint64_t>(end - sector.first, sector.second->size());
+		if (from < to) {
+			data->append(*sector.second, from, to - from);
+		}
+	}
+	return new_buffer(joined, 0, data->size());
+}
+
+static PyObject * Cache_stats(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	FileCache *cache = ((CacheObject *)self)->cache;
+
+	if (!python::parse_args(args, nargs, "stats", 0)) {
+		return NULL;
+	}
+	std::lock_guard<std::mutex> guard(cache->lock);
+	return Py_BuildValue("{sKsKsKsnsnsn}",
+		"hits", (unsigned long long)cache->hits,
+		"misses", (unsigned long long)cache->misses,
+		"evictions", (unsigned long long)cache->evictions,
+		"entries", (Py_ssize_t)cache->entries.size(),
+		"size", (Py_ssize_t)cache->size,
+		"capacity", (Py_ssize_t)cache->capacity
+	);
+}
+
+static PyObject * Cache_clear(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	FileCache *cache = ((CacheObject *)self)->cache;
+
+	if (!python::parse_args(args, nargs, "clear", 0)) {
+		return NULL;
+	}
+	std::lock_guard<std::mutex> guard(cache->lock);
+	cache->clear();
+
+	Py_RETURN_NONE;
+}
+
+/*
+ * Archive tables
+ *
+ * Archive.tables() reads the header, hash and block tables and the HET and
+ * BET headers of an archive in a single call, for scans over many archives.
+ * Tables are returned as columns: read-only storm.Buffer objects with a typed
+ * format (numpy.asarray() and memoryview take them as is), sharing the table
+ * StormLib copied out. Hash and block table columns are strided views into
+ * the table entries, not copies.
+ *
+ * StormLib only hands out the contents of HET and BET tables as its internal
+ * structures, so only their headers are exported; the block table it returns
+ * is rebuilt from the BET table in archives lacking one.
+ */
+
+static PyStructSequence_Field ArchiveTablesFields[] = {
+	{(char *)"header", (char *)"Fields of the MPQ header, as a dict"},
+	{(char *)"hash_table", (char *)"Hash table columns: name1, name2, locale, block_index"},
+	{(char *)"block_table", (char *)"Block table columns: file_pos, compressed_size, file_size, flags, and file_pos_hi if any"},
+	{(char *)"het_header", (char *)"Fields of the HET table header as a dict, or None"},
+	{(char *)"bet_header", (char *)"Fields of the BET table header as a dict, or None"},
+	{NULL}
+};
+
+static PyStructSequence_Desc ArchiveTablesDesc = {
+	(char *)"storm.ArchiveTables",
+	(char *)"Header and tables of an MPQ archive",
+	ArchiveTablesFields,
+	5,
+};
+
+static PyTypeObject ArchiveTablesType;
+
+/* Fields of the HET and BET headers, after their signature, version and data size */
+static char const *const HetHeaderFields[] = {
+	"table_size", "entry_count", "total_count", "name_hash_bit_size",
+	"index_size_total", "index_size_extra", "index_size", "index_table_size",
+	NULL
+};
+
+static char const *const BetHeaderFields[] = {
+	"table_size", "entry_count", "unknown_08", "table_entry_size",
+	"bit_index_file_pos", "bit_index_file_size", "bit_index_compressed_size", "bit_index_flag_index", "bit_index_unknown",
+	"bit_count_file_pos", "bit_count_file_size", "bit_count_compressed_size", "bit_count_flag_index", "bit_count_unknown",
+	"bit_total_name_hash2", "bit_extra_name_hash2", "bit_count_name_hash2", "name_hash_array_size", "flag_count",
+	NULL
+};
+
+/* Copies the info class \a infoClass of \a mpq into \a data, empty if the archive lacks it. Must hold the archive lock. */
+static void read_table(HANDLE mpq, SFileInfoClass infoClass, std::string *data) {
+	DWORD needed = 0;
+	data->clear();
+	if (!SFileGetFileInfo(mpq, infoClass, NULL, 0, &needed) && needed) {
+		data->resize(needed);
+		if (!SFileGetFileInfo(mpq, infoClass, &(*data)[0], needed, &needed)) {
+			data->clear();
+		}
+	}
+}
+
+/* Adds the column of \a count items of \a format at \a offset of the entries of \a table to \a columns */
+static bool add_column(PyObject *columns, char const *name, CacheData const& table, size_t offset, size_t count, char const *format, size_t itemsize, size_t stride) {
+	PyObject *column = new_column(table, offset, count, format, itemsize, stride);
+	if (!column) {
+		return false;
+	}
+	bool result = PyDict_SetItemString(columns, name, column) == 0;
+	Py_DECREF(column);
+	return result;
+}
+
+/* Returns a dict of \a fields, DWORDs after the extended header in \a data, or None if empty */
+static PyObject * build_ext_header(std::string const& data, char const *const *fields) {
+	size_t const start = 3 * sizeof(DWORD);
+	if (data.size() < start) {
+		Py_RETURN_NONE;
+	}
+	DWORD values[3];
+	memcpy(values, data.data(), sizeof(values));
+	PyObject *result = Py_BuildValue("{sksksk}", "signature", (unsigned long)values[0], "version", (unsigned long)values[1], "data_size", (unsigned long)values[2]);
+	for (size_t i = 0; result && fields[i] && start + (i + 1) * sizeof(DWORD) <= data.size(); ++i) {
+		DWORD value;
+		memcpy(&value, data.data() + start + i * sizeof(DWORD), sizeof(value));
+		PyObject *item = python::build_value(value);
+		if (!item || PyDict_SetItemString(result, fields[i], item) < 0) {
+			Py_CLEAR(result);
+		}
+		Py_XDECREF(item);
+	}
+	return result;
+}
+
+static PyObject * build_header(TMPQHeader const& header, ULONGLONG offset) {
+	return Py_BuildValue("{sKsksKsksksKsKsksksKsKsKsKsKsKsKsKsk}",
+		"header_offset", (unsigned long long)offset,
+		"header_size", (unsigned long)header.dwHeaderSize,
+		"archive_size", (unsigned long long)(header.ArchiveSize64 ? header.ArchiveSize64 : header.dwArchiveSize),
+		"format_version", (unsigned long)header.wFormatVersion,
+		"sector_size", (unsigned long)(0x200 << header.wSectorSize),
+		"hash_table_pos", (unsigned long long)make_uint64(header.dwHashTablePos, header.wHashTablePosHi),
+		"block_table_pos", (unsigned long long)make_uint64(header.dwBlockTablePos, header.wBlockTablePosHi),
+		"hash_table_size", (unsigned long)header.dwHashTableSize,
+		"block_table_size", (unsigned long)header.dwBlockTableSize,
+		"hi_block_table_pos", (unsigned long long)header.HiBlockTablePos64,
+		"het_table_pos", (unsigned long long)header.HetTablePos64,
+		"bet_table_pos", (unsigned long long)header.BetTablePos64,
+		"hash_table_size64", (unsigned long long)header.HashTableSize64,
+		"block_table_size64", (unsigned long long)header.BlockTableSize64,
+		"hi_block_table_size64", (unsigned long long)header.HiBlockTableSize64,
+		"het_table_size64", (unsigned long long)header.HetTableSize64,
+		"bet_table_size64", (unsigned long long)header.BetTableSize64,
+		"raw_chunk_size", (unsigned long)header.dwRawChunkSize
+	);
+}
+
+static PyObject * Archive_tables(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+
+	if (!python::parse_args(args, nargs, "tables", 0)) {
+		return NULL;
+	}
+	TMPQHeader header;
+	memset(&header, 0, sizeof(header));
+	ULONGLONG offset = 0;
+	bool result;
+	std::string hashTable, blockTable, hiBlockTable, hetHeader, betHeader;
+	if (!call_locked(self, &self->mpq, OP_TABLES, [&]() -> DWORD {
+		result = SFileGetFileInfo(self->mpq, SFileMpqHeader, &header, sizeof(header), NULL);
+		if (result) {
+			SFileGetFileInfo(self->mpq, SFileMpqHeaderOffset, &offset, sizeof(offset), NULL);
+			read_table(self->mpq, SFileMpqHashTable, &hashTable);
+			read_table(self->mpq, SFileMpqBlockTable, &blockTable);
+			read_table(self->mpq, SFileMpqHiBlockTable, &hiBlockTable);
+			read_table(self->mpq, SFileMpqHetHeader, &hetHeader);
+			read_table(self->mpq, SFileMpqBetHeader, &betHeader);
+		}
+		/* Only the header is needed, missing tables are not errors */
+		return call_error(result, ERROR_CAN_NOT_COMPLETE);
+	})) {
+		return NULL;
+	}
+	if (!result) {
+		PyErr_SetString(StormError, "Error reading the archive header");
+		return NULL;
+	}
+
+	PyObject *tables = PyStructSequence_New(&ArchiveTablesType);
+	if (!tables) {
+		return NULL;
+	}
+	PyObject *hashColumns = PyDict_New();
+	PyObject *blockColumns = PyDict_New();
+	PyStructSequence_SET_ITEM(tables, 0, build_header(header, offset));
+	PyStructSequence_SET_ITEM(tables, 1, hashColumns);
+	PyStructSequence_SET_ITEM(tables, 2, blockColumns);
+	PyStructSequence_SET_ITEM(tables, 3, build_ext_header(hetHeader, HetHeaderFields));
+	PyStructSequence_SET_ITEM(tables, 4, build_ext_header(betHeader, BetHeaderFields));
+	for (Py_ssize_t i = 0; i < 5; ++i) {
+		if (!PyStructSequence_GET_ITEM(tables, i)) {
+			Py_DECREF(tables);
+			return NULL;
+		}
+	}
+
+	size_t hashCount = hashTable.size() / sizeof(TMPQHash);
+	CacheData hashData = std::make_shared<std::string const>(std::move(hashTable));
+	size_t blockCount = blockTable.size() / sizeof(TMPQBlock);
+	CacheData blockData = std::make_shared<std::string const>(std::move(blockTable));
+	bool valid = add_column(hashColumns, "name1", hashData, offsetof(TMPQHash, dwName1), hashCount, "I", sizeof(DWORD), sizeof(TMPQHash))
+		&& add_column(hashColumns, "name2", hashData, offsetof(TMPQHash, dwName2), hashCount, "I", sizeof(DWORD), sizeof(TMPQHash))
+		&& add_column(hashColumns, "locale", hashData, offsetof(TMPQHash, lcLocale), hashCount, "H", sizeof(USHORT), sizeof(TMPQHash))
+		&& add_column(hashColumns, "block_index", hashData, offsetof(TMPQHash, dwBlockIndex), hashCount, "I", sizeof(DWORD), sizeof(TMPQHash))
+		&& add_column(blockColumns, "file_pos", blockData, offsetof(TMPQBlock, dwFilePos), blockCount, "I", sizeof(DWORD), sizeof(TMPQBlock))
+		&& add_column(blockColumns, "compressed_size", blockData, offsetof(TMPQBlock, dwCSize), blockCount, "I", sizeof(DWORD), sizeof(TMPQBlock))
+		&& add_column(blockColumns, "file_size", blockData, offsetof(TMPQBlock, dwFSize), blockCount, "I", sizeof(DWORD), sizeof(TMPQBlock))
+		&& add_column(blockColumns, "flags", blockData, offsetof(TMPQBlock, dwFlags), blockCount, "I", sizeof(DWORD), sizeof(TMPQBlock));
+	if (valid && !hiBlockTable.empty()) {
+		size_t count = hiBlockTable.size() / sizeof(USHORT);
+		CacheData hiBlockData = std::make_shared<std::string const>(std::move(hiBlockTable));
+		valid = add_column(blockColumns, "file_pos_hi", hiBlockData, 0, count, "H", sizeof(USHORT), sizeof(USHORT));
+	}
+	if (!valid) {
+		Py_DECREF(tables);
+		return NULL;
+	}
+
+	return tables;
+}
+
+/*
+ * Name hashing
+ *
+ * Recovering the names of an archive without a listfile means testing many
+ * candidate names against its hash table. hash_names() and
+ * Archive.match_names() take whole batches of names, hashed on several
+ * threads without the GIL, rather than a call to SFileHasFile() per name.
+ * The three hashes of the hash table are computed in a single pass over each
+ * name, as StormLib's HashString() would one after the other: they do not
+ * depend on each other, so their crypt table lookups overlap. Names are
+ * uppercased, and their slashes turned into backslashes, as StormLib does.
+ */
+
+/* StormLib's crypt table: 0x100 entries per hash type */
+struct CryptTable {
+	DWORD values[0x500];
+
+	CryptTable() {
+		DWORD seed = 0x00100001;
+		for (DWORD index1 = 0; index1 < 0x100; ++index1) {
+			for (DWORD index2 = index1, i = 0; i < 5; ++i, index2 += 0x100) {
+				seed = (seed * 125 + 3) % 0x2AAAAB;
+				DWORD high = (seed & 0xFFFF) << 0x10;
+				seed = (seed * 125 + 3) % 0x2AAAAB;
+				values[index2] = high | (seed & 0xFFFF);
+			}
+		}
+	}
+};
+
+static DWORD const *crypt_table() {
+	static CryptTable const table;
+	return table.values;
+}
+
+/* Hashes of a name in the hash table and in the HET table */
+struct NameHashes {
+	DWORD index; /* before masking with the hash table size */
+	DWORD name1;
+	DWORD name2;
+	ULONGLONG jenkins; /* before masking with the HET name hash size */
+};
+
+static DWORD read_le32(unsigned char const *data) {
+	return data[0] | (DWORD)data[1] << 8 | (DWORD)data[2] << 16 | (DWORD)data[3] << 24;
+}
+
+/* Bob Jenkins' hashlittle2(), over \a length bytes of \a key followed by 12 zeroes */
+static void hashlittle2(unsigned char const *key, size_t length, DWORD *pc, DWORD *pb) {
+#define ROT(x, k) (((x) << (k)) | ((x) >> (32 - (k))))
+	DWORD a, b, c;
+	a = b = c = 0xDEADBEEF + (DWORD)length + *pc;
+	c += *pb;
+	if (!length) {
+		*pc = c;
+		*pb = b;
+		return;
+	}
+	for (; length > 12; length -= 12, key += 12) {
+		a += read_le32(key);
+		b += read_le32(key + 4);
+		c += read_le32(key + 8);
+		a -= c; a ^= ROT(c, 4); c += b;
+		b -= a; b ^= ROT(a, 6); a += c;
+		c -= b; c ^= ROT(b, 8); b += a;
+		a -= c; a ^= ROT(c, 16); c += b;
+		b -= a; b ^= ROT(a, 19); a += c;
+		c -= b; c ^= ROT(b, 4); b += a;
+	}
+	/* The last block, padded with zeroes, which add nothing */
+	a += read_le32(key);
+	b += read_le32(key + 4);
+	c += read_le32(key + 8);
+	c ^= b; c -= ROT(b, 14);
+	a ^= c; a -= ROT(c, 11);
+	b ^= a; b -= ROT(a, 25);
+	c ^= b; c -= ROT(b, 16);
+	a ^= c; a -= ROT(c, 4);
+	b ^= a; b -= ROT(a, 14);
+	c ^= b; c -= ROT(b, 24);
+	*pc = c;
+	*pb = b;
+#undef ROT
+}
+
+/*
+ * Hashes the \a length bytes of \a name like HashString(), and like
+ * HashStringJenkins() if \a jenkins
+ */
+static void hash_name(char const *name, size_t length, NameHashes *hashes, bool jenkins) {
+	DWORD const *table = crypt_table();
+	DWORD seed1[3] = {0x7FED7FED, 0x7FED7FED, 0x7FED7FED};
+	DWORD seed2[3] = {0xEEEEEEEE, 0xEEEEEEEE, 0xEEEEEEEE};
+	/* HashStringJenkins() lowercases at most 0x108 bytes */
+	unsigned char lower[0x108 + 12];
+	size_t lowerLength = std::min<size_t>(length, 0x108);
+	for (size_t i = 0; i < length; ++i) {
+		unsigned char c = (unsigned char)name[i];
+		DWORD upper = c == '/' ? '\\' : (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+		for (int type = 0; type < 3; ++type) {
+			seed1[type] = table[(type << 8) + upper] ^ (seed1[type] + seed2[type]);
+			seed2[type] = upper + seed1[type] + seed2[type] + (seed2[type] << 5) + 3;
+		}
+		if (jenkins && i < lowerLength) {
+			lower[i] = c == '/' ? '\\' : (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+		}
+	}
+	hashes->index = seed1[0];
+	hashes->name1 = seed1[1];
+	hashes->name2 = seed1[2];
+	if (!jenkins) {
+		return;
+	}
+
+	memset(lower + lowerLength, 0, 12);
+	DWORD primary = 1;
+	DWORD secondary = 2;
+	hashlittle2(lower, lowerLength, &secondary, &primary);
+	hashes->jenkins = (ULONGLONG)primary << 32 | secondary;
+}
+
+/* Whether \a hashes are those of a file of the hash table \a table, of \a size entries */
+static bool in_hash_table(TMPQHash const *table, DWORD size, NameHashes const& hashes) {
+	DWORD mask = size - 1;
+	DWORD start = hashes.index & mask;
+	DWORD i = start;
+	do {
+		TMPQHash const& entry = table[i];
+		if (entry.dwBlockIndex == HASH_ENTRY_FREE) {
+			return false;
+		}
+		if (entry.dwName1 == hashes.name1 && entry.dwName2 == hashes.name2 && entry.dwBlockIndex != HASH_ENTRY_DELETED) {
+			return true;
+		}
+		i = (i + 1) & mask;
+	} while (i != start);
+	return false;
+}
+
+/* Names given from python, each followed by a null byte */
+struct NameBatch {
+	std::string data;
+	std::vector<size_t> offsets; /* of each name, then the end of the last one */
+	bool bytes; /* given as a bytes-like object, matches are returned as bytes */
+
+	NameBatch() : offsets(1, 0), bytes(false) {}
+
+	size_t size() const {
+		return offsets.size() - 1;
+	}
+
+	char const *name(size_t i) const {
+		return data.data() + offsets[i];
+	}
+
+	size_t length(size_t i) const {
+		return offsets[i + 1] - offsets[i] - 1;
+	}
+
+	void add(char const *name, size_t length) {
+		data.append(name, length);
+		data.push_back('\0');
+		offsets.push_back(data.size());
+	}
+};
+
+/*
+ * Reads \a object, a str, an iterable of them or a bytes-like object holding a
+ * name per line, like a listfile, into \a batch
+ */
+static bool names_from_python(PyObject *object, NameBatch *batch) {
+	char const *name;
+	if (PyUnicode_Check(object)) {
+		if (!python::detail::from_python(object, &name)) {
+			return false;
+		}
+		batch->add(name, strlen(name));
+		return true;
+	}
+	if (PyObject_CheckBuffer(object)) {
+		Py_buffer view;
+		if (PyObject_GetBuffer(object, &view, PyBUF_SIMPLE) < 0) {
+			return false;
+		}
+		char const *data = (char const *)view.buf;
+		char const *end = data + view.len;
+		batch->bytes = true;
+		while (data < end) {
+			char const *line = data;
+			while (data < end && *data != '\n' && *data != '\r' && *data != '\0') {
+				++data;
+			}
+			if (data > line) {
+				batch->add(line, data - line);
+			}
+			++data;
+		}
+		PyBuffer_Release(&view);
+		return true;
+	}
+
+	PyObject *iterator = PyObject_GetIter(object);
+	if (!iterator) {
+		return false;
+	}
+	PyObject *item;
+	while ((item = PyIter_Next(iterator))) {
+		bool valid = python::detail::from_python(item, &name);
+		if (valid) {
+			batch->add(name, strlen(name));
+		}
+		Py_DECREF(item);
+		if (!valid) {
+			Py_DECREF(iterator);
+			return false;
+		}
+	}
+	Py_DECREF(iterator);
+	return !PyErr_Occurred();
+}
+
+/* Names hashed, and looked up if given a hash table, by several threads */
+struct NameJob {
+	NameBatch const *batch;
+	NameHashes *hashes; /* if hashing */
+	TMPQHash const *table; /* if matching */
+	DWORD tableSize;
+	std::vector<char> found;
+
+	std::atomic<size_t> next; /* next name to take */
+
+	NameJob() : batch(NULL), hashes(NULL), table(NULL), tableSize(0), next(0) {}
+};
+
+static size_t const NAMES_PER_TAKE = 4096;
+
+static void name_worker(NameJob *job) {
+	size_t count = job->batch->size();
+	for (;;) {
+		size_t begin = job->next.fetch_add(NAMES_PER_TAKE);
+		if (begin >= count) {
+			break;
+		}
+		size_t end = std::min(begin + NAMES_PER_TAKE, count);
+		for (size_t i = begin; i < end; ++i) {
+			NameHashes hashes;
+			hash_name(job->batch->name(i), job->batch->length(i), &hashes, job->hashes != NULL);
+			if (job->hashes) {
+				job->hashes[i] = hashes;
+			}
+			if (job->table) {
+				job->found[i] = in_hash_table(job->table, job->tableSize, hashes);
+			}
+		}
+	}
+}
+
+/* Runs \a job on up to \a threads threads, this one included. Call without the GIL. */
+static void run_names(NameJob *job, unsigned int threads) {
+	if (!threads) {
+		threads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	threads = (unsigned int)std::min<size_t>(threads, (job->batch->size() + NAMES_PER_TAKE - 1) / NAMES_PER_TAKE);
+
+	std::vector<std::thread> workers;
+	for (unsigned int i = 1; i < threads; ++i) {
+		try {
+			workers.emplace_back(name_worker, job);
+		} catch (std::system_error const&) {
+			break;
+		}
+	}
+	name_worker(job);
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+}
+
+static PyObject * Storm_hash_names(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	PyObject *names;
+	unsigned int threads = 0;
+
+	if (!python::parse_args(args, nargs, "hash_names", 1, &names, &threads)) {
+		return NULL;
+	}
+	NameBatch batch;
+	if (!names_from_python(names, &batch)) {
+		return NULL;
+	}
+
+	std::string *data = new std::string(batch.size() * sizeof(NameHashes), '\0');
+	CacheData hashData(data);
+	NameJob job;
+	job.batch = &batch;
+	job.hashes = batch.size() ? (NameHashes *)&(*data)[0] : NULL;
+	Py_BEGIN_ALLOW_THREADS
+	run_names(&job, threads);
+	Py_END_ALLOW_THREADS
+
+	PyObject *columns = PyDict_New();
+	if (!columns) {
+		return NULL;
+	}
+	size_t count = batch.size();
+	bool valid = add_column(columns, "index", hashData, offsetof(NameHashes, index), count, "I", sizeof(DWORD), sizeof(NameHashes))
+		&& add_column(columns, "name1", hashData, offsetof(NameHashes, name1), count, "I", sizeof(DWORD), sizeof(NameHashes))
+		&& add_column(columns, "name2", hashData, offsetof(NameHashes, name2), count, "I", sizeof(DWORD), sizeof(NameHashes))
+		&& add_column(columns, "jenkins", hashData, offsetof(NameHashes, jenkins), count, "Q", sizeof(ULONGLONG), sizeof(NameHashes));
+	if (!valid) {
+		Py_DECREF(columns);
+		return NULL;
+	}
+
+	return columns;
+}
+
+static PyObject * Archive_match_names(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	PyObject *names;
+	unsigned int threads = 0;
+
+	if (!python::parse_args(args, nargs, "match_names", 1, &names, &threads)) {
+		return NULL;
+	}
+	NameBatch batch;
+	if (!names_from_python(names, &batch)) {
+		return NULL;
+	}
+
+	NameJob job;
+	job.batch = &batch;
+	job.found.assign(batch.size(), 0);
+	std::string hashTable;
+	if (!call_locked(self, &self->mpq, OP_MATCH_NAMES, [&]() -> DWORD {
+		read_table(self->mpq, SFileMpqHashTable, &hashTable);
+		if (hashTable.size() < sizeof(TMPQHash)) {
+			/* Only a HET table, which StormLib looks names up in */
+			for (size_t i = 0; i < batch.size(); ++i) {
+				job.found[i] = SFileHasFile(self->mpq, batch.name(i));
+			}
+		}
+		return ERROR_SUCCESS;
+	})) {
+		return NULL;
+	}
+	if (hashTable.size() >= sizeof(TMPQHash)) {
+		job.table = (TMPQHash const *)hashTable.data();
+		job.tableSize = (DWORD)(hashTable.size() / sizeof(TMPQHash));
+		Py_BEGIN_ALLOW_THREADS
+		run_names(&job, threads);
+		Py_END_ALLOW_THREADS
+	}
+
+	PyObject *result = PyList_New(0);
+	for (size_t i = 0; result && i < batch.size(); ++i) {
+		if (!job.found[i]) {
+			continue;
+		}
+		PyObject *name = batch.bytes ? PyBytes_FromStringAndSize(batch.name(i), batch.length(i)) : PyUnicode_FromStringAndSize(batch.name(i), batch.length(i));
+		if (!name || PyList_Append(result, name) < 0) {
+			Py_CLEAR(result);
+		}
+		Py_XDECREF(name);
+	}
+	return result;
+}
+
+/*
+ * Worker pool
+ *
+ * storm.Pool runs reads and extractions on its own threads, for asyncio.
+ * Each worker opens its own handles on the archives it is given, so requests
+ * do not contend for the lock of their archive. Finished requests are queued
+ * and signalled on a file descriptor (an eventfd, or a pipe outside Linux) for
+ * the event loop to watch; collect() then returns them. Requests not started
+ * yet can be cancelled.
+ */
+
+struct PoolJob {
+	enum Kind { READ, EXTRACT };
+
+	uint64_t token;
+	Kind kind;
+	ArchiveObject *archive; /* reference, released by collect() */
+	uint64_t archiveId;
+	ArchiveSource source;
+	std::string name;
+	std::string path;
+	DWORD scope;
+
+	std::string data;
+	DWORD error;
+};
+
+struct WorkerPool {
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<PoolJob *> queue;
+	std::vector<PoolJob *> finished;
+	std::vector<std::thread> threads;
+	bool stopping;
+	uint64_t nextToken;
+	int readFd;
+	int writeFd;
+
+	WorkerPool() : stopping(false), nextToken(0), readFd(-1), writeFd(-1) {}
+};
+
+typedef struct {
+	PyObject_HEAD
+	WorkerPool *pool;
+} PoolObject;
+
+static PyTypeObject PoolType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+#ifndef _WIN32
+static void signal_pool(WorkerPool *pool) {
+#ifdef __linux__
+	uint64_t one = 1;
+	ssize_t result = write(pool->writeFd, &one, sizeof(one));
+#else
+	char one = 1;
+	ssize_t result = write(pool->writeFd, &one, sizeof(one));
+#endif
+	(void)result; /* A full pipe is already signalled */
+}
+
+/* Handle of a worker on an archive, and the file it was opened from */
+struct PoolHandle {
+	HANDLE mpq;
+	int file; /* see ArchiveSource::open_file() */
+};
+
+static void close_handles(std::unordered_map<uint64_t, PoolHandle> *handles) {
+	for (auto const& handle : *handles) {
+		close_archive_file(handle.second.file);
+		SFileCloseArchive(handle.second.mpq);
+	}
+	handles->clear();
+}
+
+static void run_job(PoolJob *job, std::unordered_map<uint64_t, PoolHandle> *handles) {
+	auto it = handles->find(job->archiveId);
+	if (it == handles->end()) {
+		/* Keep a few archives open, they are usually reused */
+		if (handles->size() >= 16) {
+			close_handles(handles);
+		}
+		PoolHandle handle;
+		if (!job->source.open(&handle.mpq, &job->error)) {
+			return;
+		}
+		handle.file = job->source.open_file();
+		it = handles->insert(std::make_pair(job->archiveId, handle)).first;
+	}
+	HANDLE mpq = it->second.mpq;
+
+	if (job->kind == PoolJob::EXTRACT) {
+		uint64_t copied = 0;
+		job->error = extract_file(mpq, it->second.file, job->name.c_str(), job->path.c_str(), job->scope, &copied);
+		if (copied) {
+			std::lock_guard<std::mutex> guard(job->archive->state->lock);
+			job->archive->state->stats.bytesCopied += copied;
+		}
+		return;
+	}
+
+	HANDLE file;
+	if (!SFileOpenFileEx(mpq, job->name.c_str(), job->scope, &file)) {
+		job->error = open_error(mpq, job->name.c_str(), job->scope);
+		return;
+	}
+	DWORD sizeHigh;
+	DWORD sizeLow = SFileGetFileSize(file, &sizeHigh);
+	if (sizeLow == SFILE_INVALID_SIZE) {
+		job->error = last_error(ERROR_CAN_NOT_COMPLETE);
+	} else {
+		job->error = read_at(file, 0, make_uint64(sizeLow, sizeHigh), &job->data);
+	}
+	SFileCloseFile(file);
+}
+
+static void pool_worker(WorkerPool *pool) {
+	std::unordered_map<uint64_t, PoolHandle> handles;
+
+	for (;;) {
+		PoolJob *job;
+		{
+			std::unique_lock<std::mutex> guard(pool->lock);
+			pool->wake.wait(guard, [&] { return pool->stopping || !pool->queue.empty(); });
+			if (pool->stopping) {
+				break;
+			}
+			job = pool->queue.front();
+			pool->queue.pop_front();
+		}
+
+		job->error = ERROR_SUCCESS;
+		run_job(job, &handles);
+
+		std::lock_guard<std::mutex> guard(pool->lock);
+		pool->finished.push_back(job);
+		signal_pool(pool);
+	}
+
+	close_handles(&handles);
+}
+#endif
+
+/* Stops the workers, failing the requests they did not start. Needs the GIL. */
+static void close_pool(WorkerPool *pool) {
+	Py_BEGIN_ALLOW_THREADS
+	{
+		std::lock_guard<std::mutex> guard(pool->lock);
+		pool->stopping = true;
+	}
+	pool->wake.notify_all();
+	for (std::thread& thread : pool->threads) {
+		thread.join();
+	}
+	Py_END_ALLOW_THREADS
+	pool->threads.clear();
+
+	for (PoolJob *job : pool->queue) {
+		job->error = ERROR_CAN_NOT_COMPLETE;
+		pool->finished.push_back(job);
+	}
+	pool->queue.clear();
+}
+
+static PyObject * Pool_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	static char const *kwlist[] = {"threads", NULL};
+	unsigned int threads = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|I:Pool", (char **)kwlist, &threads)) {
+		return NULL;
+	}
+#ifdef _WIN32
+	PyErr_SetString(PyExc_NotImplementedError, "storm.Pool is not supported on Windows");
+	return NULL;
+#else
+	PoolObject *self = (PoolObject *)type->tp_alloc(type, 0);
+	if (!self) {
+		return NULL;
+	}
+	WorkerPool *pool = self->pool = new WorkerPool;
+
+#ifdef __linux__
+	pool->readFd = pool->writeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pool->readFd < 0) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		Py_DECREF(self);
+		return NULL;
+	}
+#else
+	int fds[2];
+	if (pipe(fds) != 0) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		Py_DECREF(self);
+		return NULL;
+	}
+	pool->readFd = fds[0];
+	pool->writeFd = fds[1];
+	for (int fd : fds) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+#endif
+
+	if (!threads) {
+		threads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	try {
+		for (unsigned int i = 0; i < threads; ++i) {
+			pool->threads.emplace_back(pool_worker, pool);
+		}
+	} catch (std::system_error const& e) {
+		if (pool->threads.empty()) {
+			PyErr_Format(PyExc_RuntimeError, "Could not start worker threads: %s", e.what());
+			Py_DECREF(self);
+			return NULL;
+		}
+	}
+
+	return (PyObject *)self;
+#endif
+}
+
+static void Pool_dealloc(PoolObject *self) {
+	if (self->pool) {
+		close_pool(self->pool);
+		for (PoolJob *job : self->pool->finished) {
+			Py_DECREF(job->archive);
+			delete job;
+		}
+#ifndef _WIN32
+		if (self->pool->readFd >= 0) {
+			close(self->pool->readFd);
+		}
+		if (self->pool->writeFd >= 0 && self->pool->writeFd != self->pool->readFd) {
+			close(self->pool->writeFd);
+		}
+#endif
+		delete self->pool;
+	}
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject * submit_job(PoolObject *self, ArchiveObject *archive, PoolJob *job) {
+	if (!call_locked(archive, &archive->mpq, OP_SUBMIT, [&]() -> DWORD {
+		job->archiveId = archive->state->id;
+		job->source = archive->state->source;
+		return ERROR_SUCCESS;
+	})) {
+		delete job;
+		return NULL;
+	}
+
+	WorkerPool *pool = self->pool;
+	{
+		std::lock_guard<std::mutex> guard(pool->lock);
+		if (pool->stopping) {
+			delete job;
+			PyErr_SetString(PyExc_ValueError, "I/O operation on closed pool");
+			return NULL;
+		}
+		job->token = ++pool->nextToken;
+		Py_INCREF(archive);
+		job->archive = archive;
+		pool->queue.push_back(job);
+	}
+	pool->wake.notify_one();
+
+	return PyLong_FromUnsignedLongLong(job->token);
+}
+
+static PyObject * Pool_read(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	PyObject *archive;
+	char const *name;
+	DWORD scope = SFILE_OPEN_FROM_MPQ;
+
+	if (!python::parse_args(args, nargs, "read", 2, &archive, &name, &scope)) {
+		return NULL;
+	}
+	if (!PyObject_TypeCheck(archive, &ArchiveType)) {
+		PyErr_Format(PyExc_TypeError, "archive must be %s, not %.50s", ArchiveType.tp_name, Py_TYPE(archive)->tp_name);
+		return NULL;
+	}
+	PoolJob *job = new PoolJob;
+	job->kind = PoolJob::READ;
+	job->name = name;
+	job->scope = scope;
+
+	return submit_job((PoolObject *)self, (ArchiveObject *)archive, job);
+}
+
+static PyObject * Pool_extract(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	PyObject *archive;
+	char const *name;
+	char const *localName;
+	DWORD scope = SFILE_OPEN_FROM_MPQ;
+
+	if (!python::parse_args(args, nargs, "extract", 3, &archive, &name, &localName, &scope)) {
+		return NULL;
+	}
+	if (!PyObject_TypeCheck(archive, &ArchiveType)) {
+		PyErr_Format(PyExc_TypeError, "archive must be %s, not %.50s", ArchiveType.tp_name, Py_TYPE(archive)->tp_name);
+		return NULL;
+	}
+	PoolJob *job = new PoolJob;
+	job->kind = PoolJob::EXTRACT;
+	job->name = name;
+	job->path = localName;
+	job->scope = scope;
+
+	return submit_job((PoolObject *)self, (ArchiveObject *)archive, job);
+}
+
+static PyObject * Pool_cancel(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	WorkerPool *pool = ((PoolObject *)self)->pool;
+	unsigned long long token;
+
+	if (!python::parse_args(args, nargs, "cancel", 1, &token)) {
+		return NULL;
+	}
+	PoolJob *job = NULL;
+	{
+		std::lock_guard<std::mutex> guard(pool->lock);
+		auto it = std::find_if(pool->queue.begin(), pool->queue.end(), [&](PoolJob *queued) { return queued->token == token; });
+		if (it != pool->queue.end()) {
+			job = *it;
+			pool->queue.erase(it);
+		}
+	}
+	if (!job) {
+		Py_RETURN_FALSE;
+	}
+	Py_DECREF(job->archive);
+	delete job;
+
+	Py_RETURN_TRUE;
+}
+
+static PyObject * Pool_collect(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	WorkerPool *pool = ((PoolObject *)self)->pool;
+
+	if (!python::parse_args(args, nargs, "collect", 0)) {
+		return NULL;
+	}
+	std::vector<PoolJob *> finished;
+	{
+		std::lock_guard<std::mutex> guard(pool->lock);
+#ifndef _WIN32
+		/* Reset the signal, the jobs it stands for are taken below */
+		char drain[64];
+		while (read(pool->readFd, drain, sizeof(drain)) > 0) {}
+#endif
+		finished.swap(pool->finished);
+	}
+
+	PyObject *result = PyList_New(finished.size());
+	for (size_t i = 0; i < finished.size(); ++i) {
+		PoolJob *job = finished[i];
+		if (result) {
+			PyObject *value;
+			if (job->error == ERROR_SUCCESS && job->kind == PoolJob::READ) {
+				value = PyBytes_FromStringAndSize(job->data.data(), job->data.size());
+			} else {
+				value = Py_None;
+				Py_INCREF(value);
+			}
+			PyObject *item = value ? Py_BuildValue("(KkN)", (unsigned long long)job->token, (unsigned long)job->error, value) : NULL;
+			if (item) {
+				PyList_SET_ITEM(result, i, item);
+			} else {
+				Py_CLEAR(result);
+			}
+		}
+		Py_DECREF(job->archive);
+		delete job;
+	}
+
+	return result;
+}
+
+static PyObject * Pool_fileno(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	if (!python::parse_args(args, nargs, "fileno", 0)) {
+		return NULL;
+	}
+	return PyLong_FromLong(((PoolObject *)self)->pool->readFd);
+}
+
+static PyObject * Pool_close(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	if (!python::parse_args(args, nargs, "close", 0)) {
+		return NULL;
+	}
+	WorkerPool *pool = ((PoolObject *)self)->pool;
+	close_pool(pool);
+#ifndef _WIN32
+	if (!pool->finished.empty()) {
+		signal_pool(pool);
+	}
+#endif
+
+	Py_RETURN_NONE;
+}
+
+/*
+ * Batch reads
+ *
+ * Archive.read_many() reads a list of files in a single call: the files are
+ * looked up first, then read in the order of their offset in the archive so
+ * that disk access is sequential, with the GIL released. With several threads,
+ * each one reads a contiguous run of files on its own handle on the archive.
+ * Results are either bytes objects or slices of a caller-provided arena.
+ */
+
+struct ReadRequest {
+	char const *name;
+	uint64_t offset; /* SFileInfoByteOffset, for ordering */
+	uint64_t stored; /* SFileInfoCompressedSize, for access hints */
+	uint64_t size;
+	char *target;
+	PyObject *data; /* bytes object target belongs to, if any */
+	bool failed;
+	DWORD error; /* why, if failed */
+};
+
+/* Reads \a request from \a mpq */
+static void read_request(HANDLE mpq, DWORD scope, ReadRequest *request) {
+	HANDLE file;
+	if (!SFileOpenFileEx(mpq, request->name, scope, &file)) {
+		request->failed = true;
+		request->error = open_error(mpq, request->name, scope);
+		return;
+	}
+	DWORD bytesRead = 0;
+	DWORD error = ERROR_SUCCESS;
+	if (!SFileReadFile(file, request->target, (DWORD)request->size, &bytesRead, NULL)) {
+		error = read_error(file);
+	}
+	if (error != ERROR_SUCCESS && error != ERROR_HANDLE_EOF) {
+		request->failed = true;
+		request->error = error;
+	} else if (bytesRead != request->size) {
+		request->failed = true;
+		request->error = ERROR_FILE_CORRUPT;
+	}
+	SFileCloseFile(file);
+}
+
+/* Reads \a requests, in order, from \a mpq, following \a plan */
+static void read_requests(HANDLE mpq, DWORD scope, std::vector<ReadRequest *> const& requests, size_t begin, size_t end, AccessPlan *plan) {
+	for (size_t i = begin; i < end; ++i) {
+		plan->start(i);
+		read_request(mpq, scope, requests[i]);
+		plan->finish(i);
+	}
+}
+
+static PyObject * Archive_read_many(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	PyObject *namesObject;
+	DWORD scope = SFILE_OPEN_FROM_MPQ;
+	unsigned int threads = 1;
+	PyObject *arenaObject = Py_None;
+
+	if (!python::parse_args(args, nargs, "read_many", 1, &namesObject, &scope, &threads, &arenaObject)) {
+		return NULL;
+	}
+	PyObject *names = PySequence_Fast(namesObject, "names must be a sequence");
+	if (!names) {
+		return NULL;
+	}
+	size_t count = PySequence_Fast_GET_SIZE(names);
+	std::vector<ReadRequest> requests(count);
+	for (size_t i = 0; i < count; ++i) {
+		if (!python::detail::from_python(PySequence_Fast_GET_ITEM(names, i), &requests[i].name)) {
+			Py_DECREF(names);
+			return NULL;
+		}
+		requests[i].data = NULL;
+		requests[i].failed = false;
+		requests[i].error = ERROR_SUCCESS;
+	}
+	/* Releases the bytes objects, which duplicate names may have dropped from the dict */
+	auto cleanup = [&] {
+		for (ReadRequest& request : requests) {
+			Py_CLEAR(request.data);
+		}
+		Py_DECREF(names);
+	};
+
+	/* Look the files up */
+	ArchiveSource source;
+	AccessPlan plan;
+	bool planned = false;
+	if (!call_locked(self, &self->mpq, OP_READ_MANY, [&]() -> DWORD {
+		/* Failures are reported per file */
+		source = self->state->source;
+		planned = plan.open(*self->state, self->mpq);
+		for (ReadRequest& request : requests) {
+			HANDLE file;
+			if (!SFileOpenFileEx(self->mpq, request.name, scope, &file)) {
+				request.failed = true;
+				request.error = open_error(self->mpq, request.name, scope);
+				continue;
+			}
+			DWORD sizeHigh;
+			DWORD sizeLow = SFileGetFileSize(file, &sizeHigh);
+			request.size = make_uint64(sizeLow, sizeHigh);
+			if (sizeLow == SFILE_INVALID_SIZE || !SFileGetFileInfo(file, SFileInfoByteOffset, &request.offset, sizeof(request.offset), NULL)) {
+				request.failed = true;
+				request.error = last_error(ERROR_CAN_NOT_COMPLETE);
+			}
+			DWORD stored = 0;
+			if (planned) {
+				SFileGetFileInfo(file, SFileInfoCompressedSize, &stored, sizeof(stored), NULL);
+			}
+			request.stored = stored;
+			SFileCloseFile(file);
+		}
+		return ERROR_SUCCESS;
+	})) {
+		Py_DECREF(names);
+		return NULL;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		if (requests[i].failed) {
+			if (requests[i].error == ERROR_FILE_NOT_FOUND) {
+				PyErr_SetObject(PyExc_KeyError, PySequence_Fast_GET_ITEM(names, i));
+			} else {
+				PyErr_Format(StormError, "Error opening file %s: %i", requests[i].name, requests[i].error);
+			}
+			Py_DECREF(names);
+			return NULL;
+		}
+	}
+
+	/* Allocate where the files go, in the order of names */
+	PyObject *result;
+	Py_buffer arena;
+	if (arenaObject == Py_None) {
+		result = PyDict_New();
+		for (size_t i = 0; result && i < count; ++i) {
+			if (requests[i].size > (uint64_t)PY_SSIZE_T_MAX) {
+				PyErr_NoMemory();
+				Py_CLEAR(result);
+				break;
+			}
+			requests[i].data = PyBytes_FromStringAndSize(NULL, requests[i].size);
+			if (!requests[i].data || PyDict_SetItem(result, PySequence_Fast_GET_ITEM(names, i), requests[i].data) < 0) {
+				Py_CLEAR(result);
+				break;
+			}
+			requests[i].target = PyBytes_AS_STRING(requests[i].data);
+		}
+	} else {
+		if (!python::detail::from_python(arenaObject, &arena)) {
+			cleanup();
+			return NULL;
+		}
+		std::vector<uint64_t> table(count * 2);
+		uint64_t used = 0;
+		for (size_t i = 0; i < count; ++i) {
+			table[i * 2] = used;
+			table[i * 2 + 1] = requests[i].size;
+			requests[i].target = (char *)arena.buf + used;
+			used += requests[i].size;
+		}
+		if (used > (uint64_t)arena.len) {
+			PyErr_Format(PyExc_ValueError, "arena too small: %llu bytes needed", (unsigned long long)used);
+			result = NULL;
+		} else {
+			result = build_array(ArrayType, "Q", table);
+		}
+	}
+	if (!result) {
+		if (arenaObject != Py_None) PyBuffer_Release(&arena);
+		cleanup();
+		return NULL;
+	}
+
+	/* Read them in archive order */
+	std::vector<ReadRequest *> order(count);
+	for (size_t i = 0; i < count; ++i) {
+		order[i] = &requests[i];
+	}
+	std::stable_sort(order.begin(), order.end(), [](ReadRequest const *a, ReadRequest const *b) { return a->offset < b->offset; });
+	if (planned) {
+		for (ReadRequest const *request : order) {
+			plan.add(request->offset, request->stored);
+		}
+	}
+	threads = (unsigned int)std::max<size_t>(std::min<size_t>(threads, count), 1);
+
+	bool valid = true;
+	if (threads == 1) {
+		valid = call_locked(self, &self->mpq, OP_READ_MANY, [&]() -> DWORD { read_requests(self->mpq, scope, order, 0, count, &plan); return ERROR_SUCCESS; });
+	} else {
+		Py_BEGIN_ALLOW_THREADS
+		std::vector<std::thread> workers;
+		auto run = [&](size_t begin, size_t end) {
+			HANDLE mpq;
+			DWORD error;
+			if (!source.open(&mpq, &error)) {
+				for (size_t i = begin; i < end; ++i) {
+					order[i]->failed = true;
+					order[i]->error = error;
+				}
+				return;
+			}
+			read_requests(mpq, scope, order, begin, end, &plan);
+			SFileCloseArchive(mpq);
+		};
+		for (unsigned int t = 0; t < threads; ++t) {
+			size_t begin = count * t / threads;
+			size_t end = count * (t + 1) / threads;
+			try {
+				workers.emplace_back(run, begin, end);
+			} catch (std::system_error const&) {
+				run(begin, end);
+			}
+		}
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+		Py_END_ALLOW_THREADS
+	}
+
+	if (arenaObject != Py_None) {
+		PyBuffer_Release(&arena);
+	}
+	if (!valid) {
+		Py_DECREF(result);
+		cleanup();
+		return NULL;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		if (requests[i].failed) {
+			PyErr_Format(StormError, "Could not read file %s: %i", requests[i].name, requests[i].error);
+			Py_DECREF(result);
+			cleanup();
+			return NULL;
+		}
+	}
+	cleanup();
+
+	return result;
+}
+
+/*
+ * Building archives
+ *
+ * storm.ArchiveBuilder collects files, then writes them to a new archive in a
+ * single pass. The hash table is sized for them when the archive is created so
+ * that it never grows, and the listfile and attributes are written once, when
+ * the archive is flushed at the end. Files copied from other archives are
+ * added in the order of their data there, so that they are read sequentially.
+ *
+ * StormLib compresses within SFileWriteFile and takes no precompressed data,
+ * so a single writer thread adds the files. Worker threads load them ahead of
+ * it, reading local files and reading (decompressing) the files to copy on
+ * handles of their own.
+ */
+
+struct BuildEntry {
+	std::string name; /* in the new archive */
+	std::string source; /* local path, or name in the archive copied from */
+	Py_buffer data;
+	bool hasData;
+	PyObject *archive; /* storm.Archive copied from, if any */
+	size_t origin; /* index of its ArchiveSource while building */
+	DWORD scope;
+	DWORD flags;
+	DWORD compression;
+	LCID locale;
+	uint64_t fileTime;
+	uint64_t offset;
+};
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *name; /* str */
+	DWORD flags;
+	DWORD maxFileCount;
+	std::vector<BuildEntry> *entries;
+} BuilderObject;
+
+static PyTypeObject BuilderType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+struct BuildJob {
+	std::vector<BuildEntry *> order;
+	std::vector<ArchiveSource> sources;
+	std::vector<std::string> payloads;
+	std::vector<DWORD> errors;
+	std::vector<bool> loaded;
+	std::mutex lock;
+	std::condition_variable changed;
+	size_t next;
+	size_t added;
+	size_t window; /* files loaded ahead of the writer */
+	bool stop;
+
+	BuildJob() : next(0), added(0), window(0), stop(false) {}
+};
+
+static void clear_entries(std::vector<BuildEntry> *entries) {
+	for (BuildEntry& entry : *entries) {
+		if (entry.hasData) {
+			PyBuffer_Release(&entry.data);
+		}
+		Py_XDECREF(entry.archive);
+	}
+	entries->clear();
+}
+
+/* Loads the payload of \a entry, unless it was added as data. Does not need the GIL. */
+static DWORD load_entry(BuildJob *job, BuildEntry const& entry, std::unordered_map<size_t, HANDLE> *handles, std::string *payload) {
+	if (entry.hasData) {
+		return ERROR_SUCCESS;
+	}
+
+	if (!entry.archive) {
+		FILE *file = fopen(entry.source.c_str(), "rb");
+		if (!file) {
+			return ERROR_FILE_NOT_FOUND;
+		}
+		DWORD error = ERROR_SUCCESS;
+		char buffer[0x10000];
+		size_t count;
+		while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+			if (payload->size() + count > 0xFFFFFFFF) {
+				error = ERROR_DISK_FULL; /* Files are limited to 4 GiB */
+				break;
+			}
+			payload->append(buffer, count);
+		}
+		if (ferror(file)) {
+			error = ERROR_CAN_NOT_COMPLETE;
+		}
+		fclose(file);
+		return error;
+	}
+
+	auto it = handles->find(entry.origin);
+	if (it == handles->end()) {
+		HANDLE mpq;
+		DWORD error;
+		if (!job->sources[entry.origin].open(&mpq, &error)) {
+			return error;
+		}
+		it = handles->insert(std::make_pair(entry.origin, mpq)).first;
+	}
+	HANDLE file;
+	if (!SFileOpenFileEx(it->second, entry.source.c_str(), entry.scope, &file)) {
+		return open_error(it->second, entry.source.c_str(), entry.scope);
+	}
+	DWORD sizeHigh;
+	DWORD sizeLow = SFileGetFileSize(file, &sizeHigh);
+	DWORD error;
+	if (sizeLow == SFILE_INVALID_SIZE) {
+		error = last_error(ERROR_CAN_NOT_COMPLETE);
+	} else if (sizeHigh) {
+		error = ERROR_DISK_FULL;
+	} else {
+		error = read_at(file, 0, sizeLow, payload);
+	}
+	SFileCloseFile(file);
+	return error;
+}
+
+/* Adds a file to \a mpq */
+static DWORD add_entry(HANDLE mpq, BuildEntry const& entry, char const *data, size_t size) {
+	HANDLE file;
+	if (!SFileCreateFile(mpq, entry.name.c_str(), entry.fileTime, (DWORD)size, entry.locale, entry.flags, &file)) {
+		return last_error(ERROR_CAN_NOT_COMPLETE);
+	}
+	DWORD error = ERROR_SUCCESS;
+	if (size && !SFileWriteFile(file, data, (DWORD)size, entry.compression)) {
+		error = last_error(ERROR_CAN_NOT_COMPLETE);
+	}
+	if (!SFileFinishFile(file) && error == ERROR_SUCCESS) {
+		error = last_error(ERROR_CAN_NOT_COMPLETE);
+	}
+	return error;
+}
+
+static void build_worker(BuildJob *job) {
+	std::unordered_map<size_t, HANDLE> handles;
+
+	for (;;) {
+		size_t i;
+		{
+			std::unique_lock<std::mutex> guard(job->lock);
+			job->changed.wait(guard, [&] { return job->stop || job->next < job->added + job->window; });
+			if (job->stop || job->next >= job->order.size()) {
+				break;
+			}
+			i = job->next++;
+		}
+
+		DWORD error = load_entry(job, *job->order[i], &handles, &job->payloads[i]);
+
+		std::lock_guard<std::mutex> guard(job->lock);
+		job->errors[i] = error;
+		job->loaded[i] = true;
+		job->changed.notify_all();
+	}
+
+	for (auto const& handle : handles) {
+		SFileCloseArchive(handle.second);
+	}
+}
+
+/* Adds the files of \a job to \a mpq, in order. Returns the index of the file that failed, or the file count. */
+static size_t write_entries(HANDLE mpq, BuildJob *job, unsigned int threads) {
+	size_t count = job->order.size();
+	std::vector<std::thread> workers;
+	for (unsigned int t = 0; threads > 1 && t < threads; ++t) {
+		try {
+			workers.emplace_back(build_worker, job);
+		} catch (std::system_error const&) {
+			break;
+		}
+	}
+	std::unordered_map<size_t, HANDLE> handles; /* when loading on this thread */
+
+	size_t i;
+	for (i = 0; i < count; ++i) {
+		if (workers.empty()) {
+			job->errors[i] = load_entry(job, *job->order[i], &handles, &job->payloads[i]);
+		} else {
+			std::unique_lock<std::mutex> guard(job->lock);
+			job->changed.wait(guard, [&] { return job->loaded[i]; });
+		}
+		BuildEntry const& entry = *job->order[i];
+		if (job->errors[i] == ERROR_SUCCESS) {
+			if (entry.hasData) {
+				job->errors[i] = add_entry(mpq, entry, (char const *)entry.data.buf, entry.data.len);
+			} else {
+				job->errors[i] = add_entry(mpq, entry, job->payloads[i].data(), job->payloads[i].size());
+			}
+		}
+		std::string().swap(job->payloads[i]);
+		if (job->errors[i] != ERROR_SUCCESS) {
+			break;
+		}
+
+		std::lock_guard<std::mutex> guard(job->lock);
+		job->added = i + 1;
+		job->changed.notify_all();
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(job->lock);
+		job->stop = true;
+		job->changed.notify_all();
+	}
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+	for (auto const& handle : handles) {
+		SFileCloseArchive(handle.second);
+	}
+	return i;
+}
+
+static PyObject * Builder_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	static char const *kwlist[] = {"name", "flags", "max_file_count", NULL};
+	PyObject *name;
+	DWORD flags = MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES | MPQ_CREATE_ARCHIVE_V2;
+	DWORD maxFileCount = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "U|II:ArchiveBuilder", (char **)kwlist, &name, &flags, &maxFileCount)) {
+		return NULL;
+	}
 
-	if (!python::parse_tuple(args, "SFileIsPatchedArchive", &mpq)) {
+	BuilderObject *self = (BuilderObject *)type->tp_alloc(type, 0);
+	if (!self) {
 		return NULL;
 	}
-	bool result = SFileIsPatchedArchive(mpq);
+	Py_INCREF(name);
+	self->name = name;
+	self->flags = flags;
+	self->maxFileCount = maxFileCount;
+	self->entries = new std::vector<BuildEntry>;
+	return (PyObject *)self;
+}
 
-	if (!result) {
-		Py_RETURN_FALSE;
+static void Builder_dealloc(BuilderObject *self) {
+	if (self->entries) {
+		clear_entries(self->entries);
+		delete self->entries;
 	}
+	Py_XDECREF(self->name);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
 
-	Py_RETURN_TRUE;
+static Py_ssize_t Builder_length(BuilderObject *self) {
+	return self->entries->size();
 }
 
-/*
- * Reading Files
- */
+/* Queues an entry for \a name with the options common to all methods */
+static BuildEntry * new_entry(BuilderObject *self, char const *name, DWORD flags, DWORD compression) {
+	BuildEntry entry;
+	entry.name = name;
+	entry.hasData = false;
+	entry.archive = NULL;
+	entry.origin = 0;
+	entry.scope = SFILE_OPEN_FROM_MPQ;
+	entry.flags = flags;
+	entry.compression = compression;
+	entry.locale = 0;
+	entry.fileTime = 0;
+	entry.offset = 0;
+	self->entries->push_back(entry);
+	return &self->entries->back();
+}
 
-static PyObject * Storm_SFileOpenFileEx(PyObject *self, PyObject *args) {
-	HANDLE mpq = NULL;
-	char *name;
-	DWORD scope;
-	HANDLE file = NULL;
+static PyObject * Builder_add(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	BuilderObject *self = (BuilderObject *)self_;
+	char const *name;
+	PyObject *dataObject;
+	DWORD flags = MPQ_FILE_COMPRESS | MPQ_FILE_REPLACEEXISTING;
+	DWORD compression = MPQ_COMPRESSION_ZLIB;
+	DWORD locale = 0;
+	unsigned long long fileTime = 0;
 
-	if (!python::parse_tuple(args, "SFileOpenFileEx", &mpq, &name, &scope)) {
+	if (!python::parse_args(args, nargs, "add", 2, &name, &dataObject, &flags, &compression, &locale, &fileTime)) {
 		return NULL;
 	}
-	bool result = SFileOpenFileEx(mpq, name, scope, &file);
-
-	if (!result) {
-		PyErr_SetString(StormError, "Error opening file");
+	Py_buffer data;
+	if (PyObject_GetBuffer(dataObject, &data, PyBUF_SIMPLE) < 0) {
+		return NULL;
+	}
+	if ((uint64_t)data.len > 0xFFFFFFFF) {
+		PyBuffer_Release(&data);
+		PyErr_SetString(PyExc_ValueError, "files are limited to 4 GiB");
 		return NULL;
 	}
 
-	return python::build_value(file);
+	BuildEntry *entry = new_entry(self, name, flags, compression);
+	entry->data = data;
+	entry->hasData = true;
+	entry->locale = locale;
+	entry->fileTime = fileTime;
+
+	Py_RETURN_NONE;
 }
 
-static PyObject * Storm_SFileGetFileSize(PyObject *self, PyObject *args) {
-	HANDLE file = NULL;
+static PyObject * Builder_add_file(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	BuilderObject *self = (BuilderObject *)self_;
+	char const *name;
+	char const *path;
+	DWORD flags = MPQ_FILE_COMPRESS | MPQ_FILE_REPLACEEXISTING;
+	DWORD compression = MPQ_COMPRESSION_ZLIB;
+	DWORD locale = 0;
+	unsigned long long fileTime = 0;
 
-	if (!python::parse_tuple(args, "SFileGetFileSize", &file)) {
+	if (!python::parse_args(args, nargs, "add_file", 2, &name, &path, &flags, &compression, &locale, &fileTime)) {
 		return NULL;
 	}
-	DWORD sizeHigh;
-	DWORD sizeLow = SFileGetFileSize(file, &sizeHigh);
 
-	if (sizeLow == SFILE_INVALID_SIZE) {
-		PyErr_SetString(StormError, "Error getting file size");
-		return NULL;
-	}
+	BuildEntry *entry = new_entry(self, name, flags, compression);
+	entry->source = path;
+	entry->locale = locale;
+	entry->fileTime = fileTime;
 
-	return python::build_value ( (((uint64_t)sizeLow  << 0)  & 0x00000000FFFFFFFF)
-	                           | (((uint64_t)sizeHigh << 32) & 0xFFFFFFFF00000000)
-	                           );
+	Py_RETURN_NONE;
 }
 
-static PyObject * Storm_SFileSetFilePointer(PyObject *self, PyObject *args) {
-	HANDLE file = NULL;
-	uint64_t offset = 0;
-	DWORD whence;
+static PyObject * Builder_copy(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	BuilderObject *self = (BuilderObject *)self_;
+	PyObject *archive;
+	char const *source;
+	PyObject *nameObject = Py_None;
+	char const *name;
+	DWORD flags = MPQ_FILE_COMPRESS | MPQ_FILE_REPLACEEXISTING;
+	DWORD compression = MPQ_COMPRESSION_ZLIB;
+	DWORD scope = SFILE_OPEN_FROM_MPQ;
 
-	if (!python::parse_tuple(args, "SFileSetFilePointer", &file, &offset, &whence)) {
+	if (!python::parse_args(args, nargs, "copy", 2, &archive, &source, &nameObject, &flags, &compression, &scope)) {
 		return NULL;
 	}
-
-	//! \note The StormLib API is broken here: LONG is signed, while it surely
-	//! should be unsigned.
-	LONG posLow =  (offset & 0x00000000FFFFFFFF) >> 0;
-	LONG posHigh = (offset & 0xFFFFFFFF00000000) >> 32;
-	DWORD result = SFileSetFilePointer(file, posLow, &posHigh, whence);
-
-	if (result == SFILE_INVALID_SIZE) {
-		DWORD error = GetLastError();
-		switch (error) {
-			case ERROR_INVALID_HANDLE:
-				PyErr_SetString(PyExc_TypeError, "Could not seek within file: Invalid handle");
-				break;
-			case ERROR_INVALID_PARAMETER:
-				if (whence != FILE_BEGIN && whence != FILE_CURRENT && whence != FILE_END) {
-					PyErr_Format(PyExc_TypeError, "Could not seek within file: %i is not a valid whence", whence);
-				} else {
-					PyErr_Format(PyExc_TypeError, "Could not seek within file: offset %lu is too large", offset);
-				}
-				break;
-			default:
-				PyErr_Format(StormError, "Error seeking in file: %i", GetLastError());
-				break;
-		}
+	if (!PyObject_TypeCheck(archive, &ArchiveType)) {
+		PyErr_Format(PyExc_TypeError, "archive must be %s, not %.50s", ArchiveType.tp_name, Py_TYPE(archive)->tp_name);
+		return NULL;
+	}
+	if (!optional_string(nameObject, &name)) {
 		return NULL;
 	}
 
-	return python::build_value ( (((uint64_t)result  << 0)  & 0x00000000FFFFFFFF)
-	                           | (((uint64_t)posHigh << 32) & 0xFFFFFFFF00000000)
-	                           );
+	BuildEntry *entry = new_entry(self, name ? name : source, flags, compression);
+	entry->source = source;
+	Py_INCREF(archive);
+	entry->archive = archive;
+	entry->scope = scope;
+
+	Py_RETURN_NONE;
 }
 
-static PyObject * Storm_SFileReadFile(PyObject *self, PyObject *args) {
-	HANDLE file = NULL;
-	DWORD size;
-	DWORD bytesRead;
+static PyObject * Builder_build(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	BuilderObject *self = (BuilderObject *)self_;
+	unsigned int threads = 0;
 
-	if (!python::parse_tuple(args, "SFileReadFile", &file, &size)) {
+	if (!python::parse_args(args, nargs, "build", 0, &threads)) {
 		return NULL;
 	}
+	char const *name = PyUnicode_AsUTF8(self->name);
+	if (!name) {
+		return NULL;
+	}
+	/* Files added while building go to the next build */
+	std::vector<BuildEntry> entries;
+	entries.swap(*self->entries);
+	size_t count = entries.size();
+	auto restore = [&] {
+		entries.insert(entries.end(), self->entries->begin(), self->entries->end());
+		entries.swap(*self->entries);
+	};
 
-	std::vector<char> buffer (size);
-
-	bool result = SFileReadFile(file, buffer.data(), size, &bytesRead, NULL);
-
-	if (!result) {
-		DWORD error = GetLastError();
-		if (error != ERROR_HANDLE_EOF) {
-			switch (error) {
-				case ERROR_INVALID_HANDLE:
-					PyErr_SetString(PyExc_TypeError, "Could not read file: Invalid handle");
-					break;
-				case ERROR_FILE_CORRUPT:
-					PyErr_SetString(PyExc_IOError, "Could not read file: File is corrupt");
-					break;
-				default:
-					PyErr_Format(StormError, "Could not read file: %i", error);
-					break;
+	/* Look up the files to copy, along with their locale and file time */
+	BuildJob job;
+	std::unordered_map<PyObject *, size_t> origins;
+	for (BuildEntry& entry : entries) {
+		if (!entry.archive) {
+			continue;
+		}
+		auto it = origins.find(entry.archive);
+		if (it != origins.end()) {
+			entry.origin = it->second;
+			continue;
+		}
+		ArchiveObject *archive = (ArchiveObject *)entry.archive;
+		size_t origin = job.sources.size();
+		origins[entry.archive] = origin;
+		job.sources.emplace_back();
+		BuildEntry const *missing = NULL;
+		DWORD error = ERROR_SUCCESS;
+		/* Copies keep their file time, from the attributes */
+		if (!ensure_loaded(archive, DEFER_ATTRIBUTES) || !call_locked(archive, &archive->mpq, OP_BUILD, [&]() -> DWORD {
+			job.sources.back() = archive->state->source;
+			for (BuildEntry& other : entries) {
+				if (other.archive != entry.archive) {
+					continue;
+				}
+				other.origin = origin;
+				HANDLE file;
+				if (!SFileOpenFileEx(archive->mpq, other.source.c_str(), other.scope, &file)) {
+					missing = &other;
+					error = open_error(archive->mpq, other.source.c_str(), other.scope);
+					return error;
+				}
+				if (!SFileGetFileInfo(file, SFileInfoByteOffset, &other.offset, sizeof(other.offset), NULL)) {
+					other.offset = 0;
+				}
+				SFileGetFileInfo(file, SFileInfoFileTime, &other.fileTime, sizeof(other.fileTime), NULL);
+				SFileGetFileInfo(file, SFileInfoLocale, &other.locale, sizeof(other.locale), NULL);
+				SFileCloseFile(file);
+			}
+			return ERROR_SUCCESS;
+		})) {
+			restore();
+			return NULL;
+		}
+		if (missing) {
+			if (error == ERROR_FILE_NOT_FOUND) {
+				PyErr_SetString(PyExc_KeyError, missing->source.c_str());
+			} else {
+				PyErr_Format(StormError, "Error opening file %s: %i", missing->source.c_str(), error);
 			}
-			/* Emulate python's read() behaviour => we don't care if we go past EOF */
+			restore();
 			return NULL;
 		}
 	}
 
-	assert (bytesRead <= (DWORD)std::numeric_limits<int>::max());
-	return python::build_value(std::pair<char*, int> (buffer.data(), bytesRead));
-}
+	/* Data and local files first, as given, then copies in the order of their archive */
+	for (BuildEntry& entry : entries) {
+		job.order.push_back(&entry);
+	}
+	std::stable_sort(job.order.begin(), job.order.end(), [](BuildEntry const *a, BuildEntry const *b) {
+		if ((a->archive != NULL) != (b->archive != NULL)) {
+			return b->archive != NULL;
+		}
+		return a->origin < b->origin || (a->origin == b->origin && a->offset < b->offset);
+	});
+	job.payloads.resize(count);
+	job.errors.assign(count, ERROR_SUCCESS);
+	job.loaded.assign(count, false);
+	if (!threads) {
+		threads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	threads = (unsigned int)std::min<size_t>(threads, count);
+	job.window = threads * 4;
 
-static PyObject * Storm_SFileCloseFile(PyObject *self, PyObject *args) {
-	HANDLE file = NULL;
+	/* Keep the hash table at most 3/4 full, leaving room for the listfile, attributes and signature */
+	DWORD maxFileCount = (DWORD)std::min<uint64_t>(count + count / 3 + 3, HASH_TABLE_SIZE_MAX);
+	maxFileCount = std::max(maxFileCount, self->maxFileCount);
 
-	if (!python::parse_tuple(args, "SFileCloseFile", &file)) {
-		return NULL;
+	HANDLE mpq;
+	bool created;
+	size_t failed = count;
+	DWORD error = ERROR_SUCCESS;
+	Py_BEGIN_ALLOW_THREADS
+	created = SFileCreateArchive(name, self->flags, maxFileCount, &mpq);
+	if (!created) {
+		error = last_error(ERROR_CAN_NOT_COMPLETE);
+	} else {
+		failed = write_entries(mpq, &job, threads);
+		/* The listfile, attributes and tables are written here, once */
+		if (!SFileFlushArchive(mpq) && failed == count) {
+			error = last_error(ERROR_CAN_NOT_COMPLETE);
+		}
+		SFileCloseArchive(mpq);
 	}
-	bool result = SFileCloseFile(file);
+	Py_END_ALLOW_THREADS
 
-	if (!result) {
-		PyErr_SetString(StormError, "Error closing file");
+	if (!created) {
+		PyErr_Format(StormError, "Error creating archive %s: %i", name, error);
+	} else if (failed != count) {
+		BuildEntry const& entry = *job.order[failed];
+		PyErr_Format(StormError, "Error adding %s to %s: %i", entry.name.c_str(), name, job.errors[failed]);
+	} else if (error != ERROR_SUCCESS) {
+		PyErr_Format(StormError, "Error flushing archive %s: %i", name, error);
+	}
+	if (PyErr_Occurred()) {
+		restore();
 		return NULL;
 	}
+	clear_entries(&entries);
 
-	Py_RETURN_NONE;
+	return PyLong_FromSize_t(count);
 }
 
-static PyObject * Storm_SFileHasFile(PyObject *self, PyObject *args) {
-	HANDLE mpq = NULL;
-	char *name;
-
-	if (!python::parse_tuple(args, "SFileHasFile", &mpq, &name)) {
-		return NULL;
-	}
-	bool result = SFileHasFile(mpq, name);
+/*
+ * Statistics and tracing
+ *
+ * Calls made through archive and file objects are counted in their stats():
+ * calls and time spent in StormLib per operation, time spent waiting for the
+ * archive lock, bytes requested and read, errors by code and the length of the
+ * patch chain of files opened from patched archives. The stats of an archive
+ * include those of its files. Work done by worker threads, on handles of their
+ * own, is not counted.
+ *
+ * storm.set_trace() sets a callback called after each of those calls. When
+ * built with <sys/sdt.h>, each call also fires the USDT probe python_mpq:call
+ * (operation, nanoseconds, error), which costs a nop unless traced.
+ */
 
-	if (!result) {
-		if (GetLastError() == ERROR_FILE_NOT_FOUND) {
-			Py_RETURN_FALSE;
-		} else {
-			PyErr_SetString(StormError, "Error searching for file");
-			return NULL;
+static PyObject * build_stats(HandleStats const& stats) {
+	PyObject *calls = PyDict_New();
+	PyObject *time = PyDict_New();
+	PyObject *errors = PyDict_New();
+	bool valid = calls && time && errors;
+	for (int op = 0; valid && op < OP_COUNT; ++op) {
+		if (!stats.calls[op]) {
+			continue;
 		}
+		PyObject *count = PyLong_FromUnsignedLongLong(stats.calls[op]);
+		PyObject *seconds = PyFloat_FromDouble(stats.nanoseconds[op] / 1e9);
+		valid = count && seconds
+			&& PyDict_SetItemString(calls, OperationNames[op], count) == 0
+			&& PyDict_SetItemString(time, OperationNames[op], seconds) == 0;
+		Py_XDECREF(count);
+		Py_XDECREF(seconds);
+	}
+	for (auto it = stats.errors.begin(); valid && it != stats.errors.end(); ++it) {
+		PyObject *code = PyLong_FromUnsignedLong(it->first);
+		PyObject *count = PyLong_FromUnsignedLongLong(it->second);
+		valid = code && count && PyDict_SetItem(errors, code, count) == 0;
+		Py_XDECREF(code);
+		Py_XDECREF(count);
 	}
 
-	Py_RETURN_TRUE;
+	PyObject *result = NULL;
+	if (valid) {
+		result = Py_BuildValue("{sOsOsdsKsKsKsKsOsKsK}",
+			"calls", calls,
+			"time", time,
+			"wait", stats.waitNanoseconds / 1e9,
+			"bytes_requested", (unsigned long long)stats.bytesRequested,
+			"bytes_read", (unsigned long long)stats.bytesRead,
+			"bytes_copied", (unsigned long long)stats.bytesCopied,
+			"bytes_parallel", (unsigned long long)stats.bytesParallel,
+			"errors", errors,
+			"patched_opens", (unsigned long long)stats.patchedOpens,
+			"patch_depth", (unsigned long long)stats.patchDepth
+		);
+	}
+	Py_XDECREF(calls);
+	Py_XDECREF(time);
+	Py_XDECREF(errors);
+	return result;
 }
 
-static PyObject * Storm_SFileGetFileName(PyObject *self, PyObject *args) {
-	HANDLE file = NULL;
-	char name[MAX_PATH];
+/* Returns a copy of \a stats, reset if \a resetObject is true */
+static PyObject * get_stats(ArchiveObject *archive, HandleStats *stats, PyObject *const *args, Py_ssize_t nargs) {
+	PyObject *resetObject = Py_False;
 
-	if (!python::parse_tuple(args, "SFileGetFileName", &file)) {
+	if (!python::parse_args(args, nargs, "stats", 0, &resetObject)) {
 		return NULL;
 	}
-	bool result = SFileGetFileName(file, name);
-
-	if (!result) {
-		PyErr_SetString(StormError, "Error getting file name");
+	int reset = PyObject_IsTrue(resetObject);
+	if (reset < 0) {
 		return NULL;
 	}
-
-	return python::build_value(name);
-}
-
-static PyObject * Storm_SFileGetFileInfo(PyObject *self, PyObject *args) {
-	HANDLE file = NULL;
-	SFileInfoClass infoClass;
-
-	if (!python::parse_tuple(args, "SFileGetFileInfo", &file, &infoClass)) {
-		return NULL;
+	HandleStats copy;
+	Py_BEGIN_ALLOW_THREADS
+	{
+		std::lock_guard<std::mutex> guard(archive->state->lock);
+		copy = *stats;
+		if (reset) {
+			stats->reset();
+		}
 	}
+	Py_END_ALLOW_THREADS
 
-	int value = 0;
-	DWORD size = sizeof(value);
-	bool result = SFileGetFileInfo(file, infoClass, &value, size, 0);
+	return build_stats(copy);
+}
 
-	if (!result) {
-		if (GetLastError() == ERROR_INVALID_PARAMETER) {
-			PyErr_SetString(PyExc_TypeError, "Invalid INFO_TYPE queried");
-			return NULL;
-		} else {
-			PyErr_SetString(StormError, "Error getting info");
-			return NULL;
-		}
-	}
+static PyObject * Archive_stats(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	ArchiveObject *self = (ArchiveObject *)self_;
+	return get_stats(self, &self->state->stats, args, nargs);
+}
 
-	return python::build_value(value);
+static PyObject * File_stats(PyObject *self_, PyObject *const *args, Py_ssize_t nargs) {
+	FileObject *self = (FileObject *)self_;
+	return get_stats(self->archive, self->stats, args, nargs);
 }
 
-static PyObject * Storm_SFileExtractFile(PyObject *self, PyObject *args) {
-	HANDLE mpq = NULL;
-	char *name;
-	TCHAR *localName;
-	DWORD scope;
+static PyObject * Storm_set_trace(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	PyObject *callback;
 
-	if (!python::parse_tuple(args, "SFileExtractFile", &mpq, &name, &localName, &scope)) {
+	if (!python::parse_args(args, nargs, "set_trace", 1, &callback)) {
 		return NULL;
 	}
-	bool result = SFileExtractFile(mpq, name, localName, scope);
-
-	if (!result) {
-		if (GetLastError() == ERROR_UNKNOWN_FILE_KEY) {
-			PyErr_Format(StormError, "Error extracting file: File Key `%s' unknown", name);
-			return NULL;
-		} else {
-			PyErr_Format(StormError, "Error extracting file: %i", GetLastError());
-			return NULL;
-		}
+	if (callback != Py_None && !PyCallable_Check(callback)) {
+		PyErr_SetString(PyExc_TypeError, "callback must be callable or None");
+		return NULL;
 	}
+	PyObject *previous = Tracer;
+	if (callback == Py_None) {
+		Tracer = NULL;
+	} else {
+		Py_INCREF(callback);
+		Tracer = callback;
+	}
+	Py_XDECREF(previous);
 
 	Py_RETURN_NONE;
 }
 
-static PyObject * Storm_SFileFindFirstFile(PyObject *self, PyObject *args) {
-	HANDLE mpq = NULL;
-	char *mask;
-	SFILE_FIND_DATA findFileData;
-	TCHAR *listFile; // XXX Unused for now
+/*
+ * Module functions
+ *
+ * The SFile* functions mirror the StormLib API and take the archive, file
+ * or search object as their first argument.
+ */
 
-	if (!python::parse_tuple(args, "SFileFindFirstFile", &mpq, &listFile, &mask)) {
-		return NULL;
-	}
-	HANDLE result = SFileFindFirstFile(mpq, mask, &findFileData, NULL);
+static PyObject * Storm_SFileOpenArchive(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	char const *name;
+	DWORD priority;
+	DWORD flags;
 
-	if (!result) {
-		PyErr_SetString(StormError, "Error searching archive");
+	if (!python::parse_args(args, nargs, "SFileOpenArchive", 3, &name, &priority, &flags)) {
 		return NULL;
 	}
 
-	return python::build_value(result, findFileData.cFileName);
+	return open_archive(&ArchiveType, name, priority, flags, false);
 }
 
-static PyObject * Storm_SFileFindNextFile(PyObject *self, PyObject *args) {
-	HANDLE find = NULL;
-	SFILE_FIND_DATA findFileData;
+static PyObject * Storm_SFileCreateArchive(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	char const *name;
+	DWORD flags;
+	DWORD maxFileCount;
 
-	if (!python::parse_tuple(args, "SFileFindFirstFile", &find)) {
+	if (!python::parse_args(args, nargs, "SFileCreateArchive", 3, &name, &flags, &maxFileCount)) {
 		return NULL;
 	}
-	bool result = SFileFindNextFile(find, &findFileData);
 
-	if (!result) {
-		if (GetLastError() == ERROR_NO_MORE_FILES) {
-			PyErr_SetString(NoMoreFilesError, "");
-			return NULL;
-		} else {
-			PyErr_SetString(StormError, "Error searching for next result in archive");
-			return NULL;
-		}
-	}
+	return create_archive(&ArchiveType, name, flags, maxFileCount);
+}
 
-	return python::build_value(findFileData.cFileName);
+static PyObject * Storm_SFileGetFileInfo(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	if (nargs >= 1 && PyObject_TypeCheck(args[0], &FileType)) {
+		return File_info(args[0], args + 1, nargs - 1);
+	}
+	return forward<&ArchiveType, Archive_info>(self, args, nargs);
 }
 
-static PyObject * Storm_SFileFindClose(PyObject *self, PyObject *args) {
-	HANDLE find = NULL;
+static PyObject * find_first(PyObject *const *args, Py_ssize_t nargs, char const *fun, bool listfile) {
+	PyObject *mpq;
+	PyObject *listFile; // XXX Unused for now
+	char const *mask;
 
-	if (!python::parse_tuple(args, "SFileFindFirstFile", &find)) {
+	if (!python::parse_args(args, nargs, fun, 3, &mpq, &listFile, &mask)) {
+		return NULL;
+	}
+	if (!PyObject_TypeCheck(mpq, &ArchiveType)) {
+		PyErr_Format(PyExc_TypeError, "first argument must be a %s", ArchiveType.tp_name);
 		return NULL;
 	}
-	bool result = SFileFindClose(find);
 
-	if (!result) {
-		PyErr_SetString(StormError, "Error closing archive search");
+	PyObject *find = open_find((ArchiveObject *)mpq, mask, listfile);
+	if (!find) {
+		return NULL;
+	}
+	PyObject *name = Find_next((FindObject *)find);
+	if (!name) {
+		if (!PyErr_Occurred()) {
+			PyErr_SetString(StormError, listfile ? "Error searching listfile" : "Error searching archive");
+		}
+		Py_DECREF(find);
 		return NULL;
 	}
 
-	Py_RETURN_NONE;
+	return Py_BuildValue("NN", find, name);
 }
 
-static PyObject * Storm_SListFileFindFirstFile(PyObject *self, PyObject *args) {
-	HANDLE mpq = NULL;
-	char *mask;
-	char *listFile; // XXX Unused for now
-	SFILE_FIND_DATA findFileData;
+static PyObject * find_next(PyObject *const *args, Py_ssize_t nargs, char const *fun) {
+	PyObject *find;
 
-	if (!python::parse_tuple(args, "SListFileFindFirstFile", &mpq, &listFile, &mask)) {
+	if (!python::parse_args(args, nargs, fun, 1, &find)) {
 		return NULL;
 	}
-	HANDLE result = SListFileFindFirstFile(mpq, NULL, mask, &findFileData);
-
-	if (!result) {
-		PyErr_SetString(StormError, "Error searching listfile");
+	if (!PyObject_TypeCheck(find, &FindType)) {
+		PyErr_Format(PyExc_TypeError, "first argument must be a %s", FindType.tp_name);
 		return NULL;
 	}
 
-	return python::build_value(result, findFileData.cFileName);
+	PyObject *name = Find_next((FindObject *)find);
+	if (!name && !PyErr_Occurred()) {
+		PyErr_SetString(NoMoreFilesError, "");
+	}
+
+	return name;
 }
 
-static PyObject * Storm_SListFileFindNextFile(PyObject *self, PyObject *args) {
-	HANDLE find = NULL;
-	SFILE_FIND_DATA findFileData;
+static PyObject * Storm_SFileFindFirstFile(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	return find_first(args, nargs, "SFileFindFirstFile", false);
+}
 
-	if (!python::parse_tuple(args, "SListFileFindFirstFile", &find)) {
-		return NULL;
-	}
-	bool result = SListFileFindNextFile(find, &findFileData);
+static PyObject * Storm_SFileFindNextFile(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	return find_next(args, nargs, "SFileFindNextFile");
+}
 
-	if (!result) {
-		if (GetLastError() == ERROR_NO_MORE_FILES) {
-			PyErr_SetString(NoMoreFilesError, "");
-			return NULL;
-		} else {
-			PyErr_SetString(StormError, "Error searching for next result in listfile");
-			return NULL;
-		}
-	}
+static PyObject * Storm_SListFileFindFirstFile(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	return find_first(args, nargs, "SListFileFindFirstFile", true);
+}
 
-	return python::build_value(findFileData.cFileName);
+static PyObject * Storm_SListFileFindNextFile(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+	return find_next(args, nargs, "SListFileFindNextFile");
 }
 
-static PyObject * Storm_SListFileFindClose(PyObject *self, PyObject *args) {
-	HANDLE find = NULL;
 
-	if (!python::parse_tuple(args, "SListFileFindFirstFile", &find)) {
-		return NULL;
-	}
-	bool result = SListFileFindClose(find);
+static PyMethodDef ArchiveMethods[] = {
+	{"add_listfile", FASTCALL(Archive_add_listfile), METH_FASTCALL, "Adds a listfile to the archive"},
+	{"advise", FASTCALL(Archive_advise), METH_FASTCALL, "Sets the page cache hints (ADVISE_*) of batches reading the archive, and how far ahead they go"},
+	{"parallel_read", FASTCALL(Archive_parallel_read), METH_FASTCALL, "Sets the size from which reads of compressed files decompress their sectors on several threads (0 never does), and how many (0 for one per core)"},
+	{"load", FASTCALL(Archive_load), METH_FASTCALL, "Loads the listfile and attributes a lazy open deferred"},
+	{"flush", FASTCALL(Archive_flush), METH_FASTCALL, "Flushes all unsaved data in the archive to the disk"},
+	{"close", FASTCALL(Archive_close), METH_FASTCALL, "Closes the archive, along with its open files and searches"},
+	{"compact", FASTCALL(Archive_compact), METH_FASTCALL, "Compacts (rebuilds) the archive, freeing all gaps that were created by write operations"},
+	{"set_max_file_count", FASTCALL(Archive_set_max_file_count), METH_FASTCALL, "Changes the number of files the archive can hold, rebuilding its hash table"},
+	{"is_patched", FASTCALL(Archive_is_patched), METH_FASTCALL, "Determines if the archive has been patched"},
+	{"patch", FASTCALL(Archive_patch), METH_FASTCALL, "Adds a patch archive to the archive"},
+	{"open_file", FASTCALL(Archive_open_file), METH_FASTCALL, "Opens a file from the archive"},
+	{"has_file", FASTCALL(Archive_has_file), METH_FASTCALL, "Checks if a file exists within the archive"},
+	{"info", FASTCALL(Archive_info), METH_FASTCALL, "Retrieves information about the archive"},
+	{"stat", FASTCALL(Archive_stat), METH_FASTCALL, "Returns a FileInfo holding all information about a file of the archive"},
+	{"tables", FASTCALL(Archive_tables), METH_FASTCALL, "Returns the header and the hash, block, HET and BET tables of the archive as a storm.ArchiveTables"},
+	{"match_names", FASTCALL(Archive_match_names), METH_FASTCALL, "Returns the names (an iterable of str, or lines of bytes) found in the hash table of the archive"},
+	{"extract", FASTCALL(Archive_extract), METH_FASTCALL, "Extracts a file from the archive to the local drive"},
+	{"find", FASTCALL(Archive_find), METH_FASTCALL, "Iterates over the files matching a mask in the archive"},
+	{"find_listfile", FASTCALL(Archive_find_listfile), METH_FASTCALL, "Iterates over the files matching a mask in the listfile"},
+	{"from_buffer", FASTCALL(Archive_from_buffer), METH_FASTCALL | METH_CLASS, "Opens an archive from an object supporting the buffer protocol"},
+	{"create", FASTCALL(Archive_create), METH_FASTCALL | METH_CLASS, "Creates a new archive, open for writing"},
+	{"extract_all", FASTCALL(Archive_extract_all), METH_FASTCALL, "Extracts files on several threads, returning a dict of failed names to error codes"},
+	{"verify_file", FASTCALL(Archive_verify_file), METH_FASTCALL, "Verifies a file against its sector CRCs, CRC32 and MD5, returning VERIFY_* flags"},
+	{"verify", FASTCALL(Archive_verify), METH_FASTCALL, "Verifies the signature of the archive, returning one of the ERROR_*_SIGNATURE_* codes"},
+	{"verify_all", FASTCALL(Archive_verify_all), METH_FASTCALL, "Verifies files on several threads, returning a dict of names to VERIFY_* flags"},
+	{"read_many", FASTCALL(Archive_read_many), METH_FASTCALL, "Reads files in archive order, into a dict of bytes or an arena buffer"},
+	{"list", FASTCALL(Archive_list), METH_FASTCALL, "Lists the files matching a mask in the archive along with their metadata, as a storm.FileList"},
+	{"stats", FASTCALL(Archive_stats), METH_FASTCALL, "Returns the counters of the calls on the archive and its files as a dict, resetting them if asked"},
+	{"__enter__", FASTCALL(Handle_enter), METH_FASTCALL, NULL},
+	{"__exit__", FASTCALL(Archive_exit), METH_FASTCALL, NULL},
+	{NULL, NULL, 0, NULL} /* Sentinel */
+};
 
-	if (!result) {
-		PyErr_SetString(StormError, "Error closing listfile search");
-		return NULL;
-	}
+static PyMethodDef FileMethods[] = {
+	{"size", FASTCALL(File_size), METH_FASTCALL, "Retrieves the size of the file"},
+	{"seek", FASTCALL(File_seek), METH_FASTCALL, "Seeks to a position within the file, returns the new position"},
+	{"tell", FASTCALL(File_tell), METH_FASTCALL, "Returns the position within the file"},
+	{"read", FASTCALL(File_read), METH_FASTCALL, "Reads bytes from the file, up to its end by default"},
+	{"readinto", FASTCALL(File_readinto), METH_FASTCALL, "Reads bytes from the file into a writable buffer"},
+	{"close", FASTCALL(File_close), METH_FASTCALL, "Closes the file"},
+	{"get_name", FASTCALL(File_get_name), METH_FASTCALL, "Retrieves the name of the file"},
+	{"info", FASTCALL(File_info), METH_FASTCALL, "Retrieves information about the file"},
+	{"stat", FASTCALL(File_stat), METH_FASTCALL, "Returns a FileInfo holding all information about the file"},
+	{"stats", FASTCALL(File_stats), METH_FASTCALL, "Returns the counters of the calls on the file as a dict, resetting them if asked"},
+	{"__enter__", FASTCALL(Handle_enter), METH_FASTCALL, NULL},
+	{"__exit__", FASTCALL(File_exit), METH_FASTCALL, NULL},
+	{NULL, NULL, 0, NULL} /* Sentinel */
+};
 
-	Py_RETURN_NONE;
+static PyMethodDef FindMethods[] = {
+	{"close", FASTCALL(Find_close), METH_FASTCALL, "Stops searching files"},
+	{"__enter__", FASTCALL(Handle_enter), METH_FASTCALL, NULL},
+	{"__exit__", FASTCALL(Find_exit), METH_FASTCALL, NULL},
+	{NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+static PyMethodDef NameIndexMethods[] = {
+	{"get", FASTCALL(NameIndex_get), METH_FASTCALL, "Returns the first archive holding a file, or None"},
+	{"entry", FASTCALL(NameIndex_entry), METH_FASTCALL, "Returns the (archive, hash_index, block_index) a listed file was indexed at, or None"},
+	{"contains", FASTCALL(NameIndex_contains), METH_FASTCALL, "Returns a list telling whether each of the names is in the archives"},
+	{"listdir", FASTCALL(NameIndex_listdir), METH_FASTCALL, "Returns the subdirectories, then the files, of a directory"},
+	{"isdir", FASTCALL(NameIndex_isdir), METH_FASTCALL, "Returns whether a directory holds any file"},
+	{"walk", FASTCALL(NameIndex_walk), METH_FASTCALL, "Returns the (path, directories, files) of a directory and its subdirectories, top-down"},
+	{"glob", FASTCALL(NameIndex_glob), METH_FASTCALL, "Returns the names matching any of the glob patterns"},
+	{"search", FASTCALL(NameIndex_search), METH_FASTCALL, "Returns the names in a directory matching any of the regular expressions"},
+	{NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+static PySequenceMethods NameIndexSequence = {
+	NameIndex_sq_length, /* sq_length */
+	0, /* sq_concat */
+	0, /* sq_repeat */
+	0, /* sq_item */
+	0, /* was_sq_slice */
+	0, /* sq_ass_item */
+	0, /* was_sq_ass_slice */
+	NameIndex_sq_contains, /* sq_contains */
+};
+
+static PyMethodDef FileInfoMethods[] = {
+	{"from_handle", FASTCALL(FileInfo_from_handle), METH_FASTCALL | METH_CLASS, "Describes an open storm.File"},
+	{"from_archive", FASTCALL(FileInfo_from_archive), METH_FASTCALL | METH_CLASS, "Describes a file of a storm.Archive"},
+	{"from_list", FASTCALL(FileInfo_from_list), METH_FASTCALL | METH_CLASS, "Returns a list describing each file of a storm.FileList"},
+	{NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+static PyMethodDef PatchIndexMethods[] = {
+	{"get", FASTCALL(PatchIndex_get), METH_FASTCALL, "Returns the layer supplying a file, or a default if the archive has no such file"},
+	{"resolve", FASTCALL(PatchIndex_resolve), METH_FASTCALL, "Resolves the layers of files, or of every file, returning a dict of names to layers"},
+	{NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+static PyMappingMethods PatchIndexMapping = {
+	PatchIndex_mp_length, /* mp_length */
+	PatchIndex_mp_subscript, /* mp_subscript */
+	0, /* mp_ass_subscript */
+};
+
+static PyMethodDef CacheMethods[] = {
+	{"read", FASTCALL(Cache_read), METH_FASTCALL, "Reads part of a file through the cache, as a read-only buffer"},
+	{"stats", FASTCALL(Cache_stats), METH_FASTCALL, "Returns the hit, miss and eviction counters and the size of the cache"},
+	{"clear", FASTCALL(Cache_clear), METH_FASTCALL, "Drops every entry of the cache"},
+	{NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+static PyMethodDef PoolMethods[] = {
+	{"read", FASTCALL(Pool_read), METH_FASTCALL, "Queues reading a whole file, returns the token of the request"},
+	{"extract", FASTCALL(Pool_extract), METH_FASTCALL, "Queues extracting a file, returns the token of the request"},
+	{"cancel", FASTCALL(Pool_cancel), METH_FASTCALL, "Cancels a request not started yet, returns whether it was"},
+	{"collect", FASTCALL(Pool_collect), METH_FASTCALL, "Returns the finished requests as (token, error, data) tuples"},
+	{"fileno", FASTCALL(Pool_fileno), METH_FASTCALL, "Returns the file descriptor readable while requests are finished"},
+	{"close", FASTCALL(Pool_close), METH_FASTCALL, "Stops the workers, failing the requests not started"},
+	{NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+static PyMethodDef BuilderMethods[] = {
+	{"add", FASTCALL(Builder_add), METH_FASTCALL, "Adds a file from an object supporting the buffer protocol"},
+	{"add_file", FASTCALL(Builder_add_file), METH_FASTCALL, "Adds a file from the local drive"},
+	{"copy", FASTCALL(Builder_copy), METH_FASTCALL, "Adds a file copied from another archive"},
+	{"build", FASTCALL(Builder_build), METH_FASTCALL, "Writes the archive, returning the number of files added"},
+	{NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+static PySequenceMethods BuilderSequence = {
+	(lenfunc)Builder_length, /* sq_length */
+};
+
+static PyMemberDef BuilderMembers[] = {
+	{(char *)"name", T_OBJECT, offsetof(BuilderObject, name), READONLY, (char *)"Name of the archive to create"},
+	{NULL} /* Sentinel */
+};
+
+static PyBufferProcs BufferBuffer = {
+	(getbufferproc)Buffer_getbuffer, /* bf_getbuffer */
+	NULL, /* bf_releasebuffer */
+};
+
+static PySequenceMethods BufferSequence = {
+	Buffer_sq_length, /* sq_length */
+};
+
+static PyMemberDef ArchiveMembers[] = {
+	{(char *)"name", T_OBJECT, offsetof(ArchiveObject, name), READONLY, (char *)"Path of the archive"},
+	{NULL} /* Sentinel */
+};
+
+static PyMemberDef FileMembers[] = {
+	{(char *)"archive", T_OBJECT, offsetof(FileObject, archive), READONLY, (char *)"Archive the file was opened from"},
+	{NULL} /* Sentinel */
+};
+
+static PyMemberDef NameIndexMembers[] = {
+	{(char *)"archives", T_OBJECT, offsetof(NameIndexObject, archives), READONLY, (char *)"Indexed archives, by priority"},
+	{NULL} /* Sentinel */
+};
+
+static PyMemberDef FileInfoMembers[] = {
+	{(char *)"filename", T_OBJECT_EX, offsetof(FileInfoObject, filename), 0, (char *)"Name of the file, with / as separator"},
+	{(char *)"file_size", T_ULONGLONG, offsetof(FileInfoObject, fileSize), 0, (char *)"Uncompressed size"},
+	{(char *)"compress_size", T_ULONGLONG, offsetof(FileInfoObject, compressSize), 0, (char *)"Compressed size"},
+	{(char *)"byte_offset", T_ULONGLONG, offsetof(FileInfoObject, byteOffset), 0, (char *)"Offset of the file data in the archive"},
+	{(char *)"flags", T_UINT, offsetof(FileInfoObject, flags), 0, (char *)"MPQ_FILE_* flags"},
+	{(char *)"locale", T_UINT, offsetof(FileInfoObject, locale), 0, (char *)"Locale"},
+	{(char *)"file_index", T_UINT, offsetof(FileInfoObject, fileIndex), 0, (char *)"Index in the block table"},
+	{(char *)"hash_index", T_UINT, offsetof(FileInfoObject, hashIndex), 0, (char *)"Index in the hash table"},
+	{(char *)"name_hash1", T_UINT, offsetof(FileInfoObject, nameHash1), 0, (char *)"First name hash of the hash table entry"},
+	{(char *)"name_hash2", T_UINT, offsetof(FileInfoObject, nameHash2), 0, (char *)"Second name hash of the hash table entry"},
+	{(char *)"name_hash3", T_ULONGLONG, offsetof(FileInfoObject, nameHash3), 0, (char *)"Jenkins hash of the name, for HET tables"},
+	{(char *)"encryption_key", T_UINT, offsetof(FileInfoObject, encryptionKey), 0, (char *)"Decryption key"},
+	{(char *)"encryption_key_raw", T_UINT, offsetof(FileInfoObject, encryptionKeyRaw), 0, (char *)"Decryption key, before adjusting it to the file offset"},
+	{(char *)"file_time", T_ULONGLONG, offsetof(FileInfoObject, fileTime), 0, (char *)"File time as FILETIME, 0 if unknown"},
+	{(char *)"patch_chain", T_OBJECT, offsetof(FileInfoObject, patchChain), READONLY, (char *)"Names of the archives holding the file, from the base one, or None"},
+	{NULL} /* Sentinel */
+};
+
+static PyMemberDef PatchIndexMembers[] = {
+	{(char *)"archive", T_OBJECT, offsetof(PatchIndexObject, archive), READONLY, (char *)"Indexed archive"},
+	{(char *)"scope", T_UINT, offsetof(PatchIndexObject, scope), READONLY, (char *)"Scope the files are opened with when resolving them"},
+	{NULL} /* Sentinel */
+};
+
+static PyMemberDef FindMembers[] = {
+	{(char *)"archive", T_OBJECT, offsetof(FindObject, archive), READONLY, (char *)"Archive being searched"},
+	{NULL} /* Sentinel */
+};
+
+static PyObject * Archive_get_closed(ArchiveObject *self, void *closure) {
+	return PyBool_FromLong(self->mpq == NULL);
+}
+
+static PyObject * File_get_closed(FileObject *self, void *closure) {
+	return PyBool_FromLong(self->file == NULL);
 }
 
+static PyGetSetDef ArchiveGetSet[] = {
+	{(char *)"closed", (getter)Archive_get_closed, NULL, (char *)"Whether the archive is closed", NULL},
+	{NULL} /* Sentinel */
+};
+
+static PyGetSetDef FileGetSet[] = {
+	{(char *)"closed", (getter)File_get_closed, NULL, (char *)"Whether the file is closed", NULL},
+	{NULL} /* Sentinel */
+};
+
 
 static PyMethodDef StormMethods[] = {
-	{"SFileOpenArchive",  Storm_SFileOpenArchive, METH_VARARGS, "Open an MPQ archive."},
-	/* SFileCreateArchive */
-	{"SFileAddListFile", Storm_SFileAddListFile, METH_VARARGS, "Adds an in-memory listfile to an open MPQ archive"},
+	{"SFileOpenArchive", FASTCALL(Storm_SFileOpenArchive), METH_FASTCALL, "Open an MPQ archive."},
+	{"SFileCreateArchive", FASTCALL(Storm_SFileCreateArchive), METH_FASTCALL, "Creates a new MPQ archive"},
+	{"SFileAddListFile", FASTCALL((forward<&ArchiveType, Archive_add_listfile>)), METH_FASTCALL, "Adds an in-memory listfile to an open MPQ archive"},
 	/* SFileSetLocale (unimplemented) */
 	/* SFileGetLocale (unimplemented) */
-	{"SFileFlushArchive", Storm_SFileFlushArchive, METH_VARARGS, "Flushes all unsaved data in an MPQ archive to the disk"},
-	{"SFileCloseArchive",  Storm_SFileCloseArchive, METH_VARARGS, "Close an MPQ archive."},
-	{"SFileCompactArchive", Storm_SFileCompactArchive, METH_VARARGS, "Compacts (rebuilds) the MPQ archive, freeing all gaps that were created by write operations"},
-	/* SFileSetMaxFileCount */
+	{"SFileFlushArchive", FASTCALL((forward<&ArchiveType, Archive_flush>)), METH_FASTCALL, "Flushes all unsaved data in an MPQ archive to the disk"},
+	{"SFileCloseArchive", FASTCALL((forward<&ArchiveType, Archive_close>)), METH_FASTCALL, "Close an MPQ archive."},
+	{"SFileCompactArchive", FASTCALL((forward<&ArchiveType, Archive_compact>)), METH_FASTCALL, "Compacts (rebuilds) the MPQ archive, freeing all gaps that were created by write operations"},
+	{"SFileSetMaxFileCount", FASTCALL((forward<&ArchiveType, Archive_set_max_file_count>)), METH_FASTCALL, "Changes the maximum number of files that can be stored in an MPQ archive"},
 	/* SFileSetCompactCallback (unimplemented) */
 
-	{"SFileIsPatchedArchive",  Storm_SFileIsPatchedArchive, METH_VARARGS, "Determines if an MPQ archive has been patched"},
-	{"SFileOpenPatchArchive", Storm_SFileOpenPatchArchive, METH_VARARGS, "Adds a patch archive to an MPQ archive"},
-
-	{"SFileOpenFileEx", Storm_SFileOpenFileEx, METH_VARARGS, "Open a file from an MPQ archive"},
-	{"SFileGetFileSize", Storm_SFileGetFileSize, METH_VARARGS, "Retrieve the size of a file within an MPQ archive"},
-	{"SFileSetFilePointer", Storm_SFileSetFilePointer, METH_VARARGS, "Seeks to a position within archive file"},
-	{"SFileReadFile", Storm_SFileReadFile, METH_VARARGS, "Reads bytes in an open file"},
-	{"SFileCloseFile", Storm_SFileCloseFile, METH_VARARGS, "Close an open file"},
-	{"SFileHasFile", Storm_SFileHasFile, METH_VARARGS, "Check if a file exists within an MPQ archive"},
-	{"SFileGetFileName", Storm_SFileGetFileName, METH_VARARGS, "Retrieve the name of an open file"},
-	{"SFileGetFileInfo", Storm_SFileGetFileInfo, METH_VARARGS, "Retrieve information about an open file or MPQ archive"},
-	/* SFileVerifyFile (unimplemented) */
-	/* SFileVerifyArchive (unimplemented) */
-	{"SFileExtractFile", Storm_SFileExtractFile, METH_VARARGS, "Extracts a file from an MPQ archive to the local drive"},
+	{"SFileIsPatchedArchive", FASTCALL((forward<&ArchiveType, Archive_is_patched>)), METH_FASTCALL, "Determines if an MPQ archive has been patched"},
+	{"SFileOpenPatchArchive", FASTCALL((forward<&ArchiveType, Archive_patch>)), METH_FASTCALL, "Adds a patch archive to an MPQ archive"},
+
+	{"SFileOpenFileEx", FASTCALL((forward<&ArchiveType, Archive_open_file>)), METH_FASTCALL, "Open a file from an MPQ archive"},
+	{"SFileGetFileSize", FASTCALL((forward<&FileType, File_size>)), METH_FASTCALL, "Retrieve the size of a file within an MPQ archive"},
+	{"SFileSetFilePointer", FASTCALL((forward<&FileType, File_seek>)), METH_FASTCALL, "Seeks to a position within archive file"},
+	{"SFileReadFile", FASTCALL((forward<&FileType, File_read>)), METH_FASTCALL, "Reads bytes in an open file"},
+	{"SFileReadFileInto", FASTCALL((forward<&FileType, File_readinto>)), METH_FASTCALL, "Reads bytes in an open file into a writable buffer"},
+	{"SFileCloseFile", FASTCALL((forward<&FileType, File_close>)), METH_FASTCALL, "Close an open file"},
+	{"SFileHasFile", FASTCALL((forward<&ArchiveType, Archive_has_file>)), METH_FASTCALL, "Check if a file exists within an MPQ archive"},
+	{"SFileGetFileName", FASTCALL((forward<&FileType, File_get_name>)), METH_FASTCALL, "Retrieve the name of an open file"},
+	{"SFileGetFileInfo", FASTCALL(Storm_SFileGetFileInfo), METH_FASTCALL, "Retrieve information about an open file or MPQ archive"},
+	{"SFileVerifyFile", FASTCALL((forward<&ArchiveType, Archive_verify_file>)), METH_FASTCALL, "Verifies a file within an MPQ archive"},
+	{"SFileVerifyArchive", FASTCALL((forward<&ArchiveType, Archive_verify>)), METH_FASTCALL, "Verifies the digital signature of an MPQ archive"},
+	{"SFileExtractFile", FASTCALL((forward<&ArchiveType, Archive_extract>)), METH_FASTCALL, "Extracts a file from an MPQ archive to the local drive"},
 
 	/* File searching */
-	{"SFileFindFirstFile", Storm_SFileFindFirstFile, METH_VARARGS, "Finds the first file matching the specification in the archive"},
-	{"SFileFindNextFile", Storm_SFileFindNextFile, METH_VARARGS, "Finds the next file matching the specification in the archive"},
-	{"SFileFindClose", Storm_SFileFindClose, METH_VARARGS, "Stops searching files in the archive"},
-	{"SListFileFindFirstFile", Storm_SListFileFindFirstFile, METH_VARARGS, "Finds the first file matching the specification in the listfile"},
-	{"SListFileFindNextFile", Storm_SListFileFindNextFile, METH_VARARGS, "Finds the next file matching the specification in the listfile"},
-	{"SListFileFindClose", Storm_SListFileFindClose, METH_VARARGS, "Stops searching files in the listfile"},
+	{"SFileFindFirstFile", FASTCALL(Storm_SFileFindFirstFile), METH_FASTCALL, "Finds the first file matching the specification in the archive"},
+	{"SFileFindNextFile", FASTCALL(Storm_SFileFindNextFile), METH_FASTCALL, "Finds the next file matching the specification in the archive"},
+	{"SFileFindClose", FASTCALL((forward<&FindType, Find_close>)), METH_FASTCALL, "Stops searching files in the archive"},
+	{"SListFileFindFirstFile", FASTCALL(Storm_SListFileFindFirstFile), METH_FASTCALL, "Finds the first file matching the specification in the listfile"},
+	{"SListFileFindNextFile", FASTCALL(Storm_SListFileFindNextFile), METH_FASTCALL, "Finds the next file matching the specification in the listfile"},
+	{"SListFileFindClose", FASTCALL((forward<&FindType, Find_close>)), METH_FASTCALL, "Stops searching files in the listfile"},
+
+	{"set_trace", FASTCALL(Storm_set_trace), METH_FASTCALL, "Sets a function called as (operation, archive, seconds, error) after each call, or None"},
+	{"hash_names", FASTCALL(Storm_hash_names), METH_FASTCALL, "Hashes names (an iterable of str, or lines of bytes) as in hash and HET tables, into columns"},
 	{NULL, NULL, 0, NULL} /* Sentinel */
 };
 
 
 #define storm_doc "Python bindings for StormLib"
 #define DECLARE(x) PyObject_SetAttrString(m, #x, PyLong_FromLong((long) x));
+#define ADD_TYPE(name, type) Py_INCREF(&type); PyModule_AddObject(m, name, (PyObject *)&type);
 
 static struct PyModuleDef moduledef = {
 	PyModuleDef_HEAD_INIT,
@@ -564,6 +6897,125 @@ static struct PyModuleDef moduledef = {
 MOD_INIT(storm) {
 	PyObject *m;
 
+#ifndef _WIN32
+	/* StormLib emulates the last error on POSIX, per thread only in some builds */
+	SetLastError(ERROR_SUCCESS);
+	std::thread([] { SetLastError(ERROR_INVALID_PARAMETER); }).join();
+	LocalErrors = GetLastError() == ERROR_SUCCESS;
+#endif
+
+	ArchiveType.tp_name = "storm.Archive";
+	ArchiveType.tp_doc = "An open MPQ archive";
+	ArchiveType.tp_basicsize = sizeof(ArchiveObject);
+	ArchiveType.tp_flags = Py_TPFLAGS_DEFAULT;
+	ArchiveType.tp_new = Archive_new;
+	ArchiveType.tp_dealloc = (destructor)Archive_dealloc;
+	ArchiveType.tp_methods = ArchiveMethods;
+	ArchiveType.tp_members = ArchiveMembers;
+	ArchiveType.tp_getset = ArchiveGetSet;
+	if (PyType_Ready(&ArchiveType) < 0) return NULL;
+
+	FileType.tp_name = "storm.File";
+	FileType.tp_doc = "A file opened from an MPQ archive";
+	FileType.tp_basicsize = sizeof(FileObject);
+	FileType.tp_flags = Py_TPFLAGS_DEFAULT;
+	FileType.tp_dealloc = (destructor)File_dealloc;
+	FileType.tp_methods = FileMethods;
+	FileType.tp_members = FileMembers;
+	FileType.tp_getset = FileGetSet;
+	if (PyType_Ready(&FileType) < 0) return NULL;
+
+	FindType.tp_name = "storm.Find";
+	FindType.tp_doc = "A search over the files of an MPQ archive, iterating over file names";
+	FindType.tp_basicsize = sizeof(FindObject);
+	FindType.tp_flags = Py_TPFLAGS_DEFAULT;
+	FindType.tp_dealloc = (destructor)Find_dealloc;
+	FindType.tp_iter = PyObject_SelfIter;
+	FindType.tp_iternext = (iternextfunc)Find_next;
+	FindType.tp_methods = FindMethods;
+	FindType.tp_members = FindMembers;
+	if (PyType_Ready(&FindType) < 0) return NULL;
+
+	NameIndexType.tp_name = "storm.NameIndex";
+	NameIndexType.tp_doc = "An index of the file names in a stack of archives, mapping them to the first archive holding them";
+	NameIndexType.tp_basicsize = sizeof(NameIndexObject);
+	NameIndexType.tp_flags = Py_TPFLAGS_DEFAULT;
+	NameIndexType.tp_new = NameIndex_new;
+	NameIndexType.tp_dealloc = (destructor)NameIndex_dealloc;
+	NameIndexType.tp_as_sequence = &NameIndexSequence;
+	NameIndexType.tp_methods = NameIndexMethods;
+	NameIndexType.tp_members = NameIndexMembers;
+	if (PyType_Ready(&NameIndexType) < 0) return NULL;
+
+	FileInfoType.tp_name = "storm.FileInfo";
+	FileInfoType.tp_doc = "Information about a file of an archive";
+	FileInfoType.tp_basicsize = sizeof(FileInfoObject);
+	FileInfoType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
+	FileInfoType.tp_new = FileInfo_new;
+	FileInfoType.tp_dealloc = (destructor)FileInfo_dealloc;
+	FileInfoType.tp_repr = (reprfunc)FileInfo_repr;
+	FileInfoType.tp_methods = FileInfoMethods;
+	FileInfoType.tp_members = FileInfoMembers;
+	if (PyType_Ready(&FileInfoType) < 0) return NULL;
+
+	PatchIndexType.tp_name = "storm.PatchIndex";
+	PatchIndexType.tp_doc = "The layer of a patched archive supplying the final content of each file";
+	PatchIndexType.tp_basicsize = sizeof(PatchIndexObject);
+	PatchIndexType.tp_flags = Py_TPFLAGS_DEFAULT;
+	PatchIndexType.tp_new = PatchIndex_new;
+	PatchIndexType.tp_dealloc = (destructor)PatchIndex_dealloc;
+	PatchIndexType.tp_as_mapping = &PatchIndexMapping;
+	PatchIndexType.tp_methods = PatchIndexMethods;
+	PatchIndexType.tp_members = PatchIndexMembers;
+	if (PyType_Ready(&PatchIndexType) < 0) return NULL;
+
+	CacheType.tp_name = "storm.Cache";
+	CacheType.tp_doc = "A byte-bounded LRU cache of decompressed files and sectors";
+	CacheType.tp_basicsize = sizeof(CacheObject);
+	CacheType.tp_flags = Py_TPFLAGS_DEFAULT;
+	CacheType.tp_new = Cache_new;
+	CacheType.tp_dealloc = (destructor)Cache_dealloc;
+	CacheType.tp_methods = CacheMethods;
+	if (PyType_Ready(&CacheType) < 0) return NULL;
+
+	BuilderType.tp_name = "storm.ArchiveBuilder";
+	BuilderType.tp_doc = "Files to write to a new archive in one pass, loaded on several threads";
+	BuilderType.tp_basicsize = sizeof(BuilderObject);
+	BuilderType.tp_flags = Py_TPFLAGS_DEFAULT;
+	BuilderType.tp_new = Builder_new;
+	BuilderType.tp_dealloc = (destructor)Builder_dealloc;
+	BuilderType.tp_as_sequence = &BuilderSequence;
+	BuilderType.tp_methods = BuilderMethods;
+	BuilderType.tp_members = BuilderMembers;
+	if (PyType_Ready(&BuilderType) < 0) return NULL;
+
+	PoolType.tp_name = "storm.Pool";
+	PoolType.tp_doc = "A pool of threads reading and extracting files, for event loops";
+	PoolType.tp_basicsize = sizeof(PoolObject);
+	PoolType.tp_flags = Py_TPFLAGS_DEFAULT;
+	PoolType.tp_new = Pool_new;
+	PoolType.tp_dealloc = (destructor)Pool_dealloc;
+	PoolType.tp_methods = PoolMethods;
+	if (PyType_Ready(&PoolType) < 0) return NULL;
+
+	BufferType.tp_name = "storm.Buffer";
+	BufferType.tp_doc = "Read-only data from a storm.Cache, or a column of an archive table";
+	BufferType.tp_basicsize = sizeof(BufferObject);
+	BufferType.tp_flags = Py_TPFLAGS_DEFAULT;
+	BufferType.tp_dealloc = (destructor)Buffer_dealloc;
+	BufferType.tp_as_buffer = &BufferBuffer;
+	BufferType.tp_as_sequence = &BufferSequence;
+	if (PyType_Ready(&BufferType) < 0) return NULL;
+
+	if (PyStructSequence_InitType2(&FileListType, &FileListDesc) < 0) return NULL;
+	if (PyStructSequence_InitType2(&ArchiveTablesType, &ArchiveTablesDesc) < 0) return NULL;
+
+	PyObject *array = PyImport_ImportModule("array");
+	if (array == NULL) return NULL;
+	ArrayType = PyObject_GetAttrString(array, "array");
+	Py_DECREF(array);
+	if (ArrayType == NULL) return NULL;
+
 	m = PyModule_Create(&moduledef);
 	if (m == NULL) return NULL;
 
@@ -575,12 +7027,58 @@ MOD_INIT(storm) {
 	Py_INCREF(NoMoreFilesError);
 	PyModule_AddObject(m, "NoMoreFilesError", NoMoreFilesError);
 
+	ADD_TYPE("Archive", ArchiveType);
+	ADD_TYPE("File", FileType);
+	ADD_TYPE("Find", FindType);
+	ADD_TYPE("FileList", FileListType);
+	ADD_TYPE("ArchiveTables", ArchiveTablesType);
+	ADD_TYPE("NameIndex", NameIndexType);
+	ADD_TYPE("PatchIndex", PatchIndexType);
+	ADD_TYPE("FileInfo", FileInfoType);
+	ADD_TYPE("Cache", CacheType);
+	ADD_TYPE("Buffer", BufferType);
+	ADD_TYPE("Pool", PoolType);
+	ADD_TYPE("ArchiveBuilder", BuilderType);
+
+	/* Archive.advise */
+	DECLARE(ADVISE_NONE);
+	DECLARE(ADVISE_WILLNEED);
+	DECLARE(ADVISE_DONTNEED);
+
 	/* SFileOpenArchive */
 	DECLARE(MPQ_OPEN_NO_LISTFILE);
 	DECLARE(MPQ_OPEN_NO_ATTRIBUTES);
 	DECLARE(MPQ_OPEN_FORCE_MPQ_V1);
 	DECLARE(MPQ_OPEN_CHECK_SECTOR_CRC);
 	DECLARE(MPQ_OPEN_READ_ONLY);
+	DECLARE(BASE_PROVIDER_FILE);
+	DECLARE(BASE_PROVIDER_MAP);
+
+	/* SFileCreateArchive */
+	DECLARE(MPQ_CREATE_LISTFILE);
+	DECLARE(MPQ_CREATE_ATTRIBUTES);
+	DECLARE(MPQ_CREATE_SIGNATURE);
+	DECLARE(MPQ_CREATE_ARCHIVE_V1);
+	DECLARE(MPQ_CREATE_ARCHIVE_V2);
+	DECLARE(MPQ_CREATE_ARCHIVE_V3);
+	DECLARE(MPQ_CREATE_ARCHIVE_V4);
+
+	/* ArchiveBuilder */
+	DECLARE(MPQ_FILE_IMPLODE);
+	DECLARE(MPQ_FILE_COMPRESS);
+	DECLARE(MPQ_FILE_ENCRYPTED);
+	DECLARE(MPQ_FILE_FIX_KEY);
+	DECLARE(MPQ_FILE_SINGLE_UNIT);
+	DECLARE(MPQ_FILE_SECTOR_CRC);
+	DECLARE(MPQ_FILE_REPLACEEXISTING);
+	DECLARE(MPQ_COMPRESSION_HUFFMANN);
+	DECLARE(MPQ_COMPRESSION_ZLIB);
+	DECLARE(MPQ_COMPRESSION_PKWARE);
+	DECLARE(MPQ_COMPRESSION_BZIP2);
+	DECLARE(MPQ_COMPRESSION_SPARSE);
+	DECLARE(MPQ_COMPRESSION_ADPCM_MONO);
+	DECLARE(MPQ_COMPRESSION_ADPCM_STEREO);
+	DECLARE(MPQ_COMPRESSION_LZMA);
 
 	/* SFileGetFileInfo */
 	DECLARE(SFileInfoPatchChain);
@@ -600,8 +7098,44 @@ MOD_INIT(storm) {
 	DECLARE(SFileInfoEncryptionKey);
 	DECLARE(SFileInfoEncryptionKeyRaw);
 
+	/* SFileVerifyFile */
+	DECLARE(SFILE_VERIFY_SECTOR_CRC);
+	DECLARE(SFILE_VERIFY_FILE_CRC);
+	DECLARE(SFILE_VERIFY_FILE_MD5);
+	DECLARE(SFILE_VERIFY_RAW_MD5);
+	DECLARE(SFILE_VERIFY_ALL);
+	DECLARE(VERIFY_OPEN_ERROR);
+	DECLARE(VERIFY_READ_ERROR);
+	DECLARE(VERIFY_FILE_HAS_SECTOR_CRC);
+	DECLARE(VERIFY_FILE_SECTOR_CRC_ERROR);
+	DECLARE(VERIFY_FILE_HAS_CHECKSUM);
+	DECLARE(VERIFY_FILE_CHECKSUM_ERROR);
+	DECLARE(VERIFY_FILE_HAS_MD5);
+	DECLARE(VERIFY_FILE_MD5_ERROR);
+	DECLARE(VERIFY_FILE_HAS_RAW_MD5);
+	DECLARE(VERIFY_FILE_ERROR_MASK);
+
+	/* SFileVerifyArchive */
+	DECLARE(ERROR_NO_SIGNATURE);
+	DECLARE(ERROR_VERIFY_FAILED);
+	DECLARE(ERROR_WEAK_SIGNATURE_OK);
+	DECLARE(ERROR_WEAK_SIGNATURE_ERROR);
+	DECLARE(ERROR_STRONG_SIGNATURE_OK);
+	DECLARE(ERROR_STRONG_SIGNATURE_ERROR);
+
 	/* SFileOpenFileEx, SFileExtractFile */
 	DECLARE(SFILE_OPEN_FROM_MPQ);
+	DECLARE(SFILE_OPEN_BASE_FILE);
+
+	/* Error codes, as returned by extract_all() */
+	DECLARE(ERROR_FILE_NOT_FOUND);
+	DECLARE(ERROR_ACCESS_DENIED);
+	DECLARE(ERROR_INVALID_PARAMETER);
+	DECLARE(ERROR_DISK_FULL);
+	DECLARE(ERROR_CAN_NOT_COMPLETE);
+	DECLARE(ERROR_FILE_CORRUPT);
+	DECLARE(ERROR_UNKNOWN_FILE_KEY);
+	DECLARE(ERROR_CHECKSUM_ERROR);
 
 	return m;
 }
@@ -1,10 +1,15 @@
 #!/usr/bin/env python
+import os
 import platform
-from setuptools import Extension, setup
+
+from setuptools import Command, Extension, setup
 
 
 extra_link_args = []
 extra_compile_args = []
+if platform.system() != "Windows":
+	extra_compile_args += ["-std=c++11", "-pthread"]
+	extra_link_args += ["-pthread"]
 # XCode for macOS Mojave issue
 if platform.mac_ver()[0] == "10.14":
 	for flags in extra_link_args, extra_compile_args:
@@ -20,4 +25,63 @@ module = Extension(
 	extra_link_args=extra_link_args,
 )
 
-setup(ext_modules=[module])
+
+class BuildBench(Command):
+	"""
+	Builds build/storm_bench, benchmarks of StormLib without the bindings,
+	see benchmarks/storm_bench.cc
+	"""
+	description = "build the native StormLib benchmarks"
+	user_options = [
+		("build-base=", "b", "directory receiving storm_bench"),
+		("build-temp=", "t", "directory for object files"),
+		("include-dirs=", "I", "directories to search for StormLib.h"),
+		("library-dirs=", "L", "directories to search for StormLib"),
+	]
+
+	def initialize_options(self):
+		self.build_base = None
+		self.build_temp = None
+		self.include_dirs = None
+		self.library_dirs = None
+
+	def finalize_options(self):
+		self.set_undefined_options("build", ("build_base", "build_base"))
+		self.set_undefined_options(
+			"build_ext",
+			("build_temp", "build_temp"),
+			("include_dirs", "include_dirs"),
+			("library_dirs", "library_dirs"),
+		)
+		for option in "include_dirs", "library_dirs":
+			value = getattr(self, option) or []
+			if isinstance(value, str):
+				value = value.split(os.pathsep)
+			setattr(self, option, value)
+
+	def run(self):
+		# setuptools provides distutils on Python 3.12+, once imported
+		from distutils.ccompiler import new_compiler
+		from distutils.sysconfig import customize_compiler
+
+		compiler = new_compiler(
+			verbose=self.verbose, dry_run=self.dry_run, force=self.force
+		)
+		customize_compiler(compiler)
+		objects = compiler.compile(
+			[os.path.join("benchmarks", "storm_bench.cc")],
+			output_dir=self.build_temp,
+			include_dirs=self.include_dirs,
+			extra_postargs=extra_compile_args,
+		)
+		compiler.link_executable(
+			objects, "storm_bench",
+			output_dir=self.build_base,
+			libraries=["storm"],
+			library_dirs=self.library_dirs,
+			extra_postargs=extra_link_args,
+			target_lang="c++",
+		)
+
+
+setup(ext_modules=[module], cmdclass={"build_bench": BuildBench})
@@ -0,0 +1,120 @@
+import ctypes
+import ctypes.util
+import os
+import random
+import sys
+
+import pytest
+
+from mpq import storm
+
+
+# StormLib flags, which the bindings do not all export
+MPQ_CREATE_LISTFILE = 0x00100000
+MPQ_CREATE_ATTRIBUTES = 0x00200000
+MPQ_CREATE_ARCHIVE_V2 = 0x01000000
+MPQ_FILE_COMPRESS = 0x00000200
+MPQ_FILE_REPLACEEXISTING = 0x80000000
+MPQ_COMPRESSION_ZLIB = 0x02
+CREATE_FLAGS = (
+	MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES | MPQ_CREATE_ARCHIVE_V2
+)
+
+
+def make_content(rng, size):
+	"""
+	Returns \a size bytes, half random and half text, so that they compress
+	"""
+	random_size = size // 2 + 1
+	data = rng.getrandbits(8 * random_size).to_bytes(random_size, "little")
+	text = b"The quick brown fox jumps over the lazy dog. "
+	return (data + text * (size // len(text) + 1))[:size]
+
+
+def load_storm():
+	"""
+	Returns the StormLib the bindings are linked with, through ctypes, to
+	write archives without going through the bindings
+	"""
+	if sys.platform == "win32":
+		library = ctypes.CDLL(ctypes.util.find_library("storm"))
+	else:
+		# Symbols are looked up in the libraries the extension depends on too
+		library = ctypes.CDLL(storm.__file__)
+	handle = ctypes.c_void_p
+	dword = ctypes.c_uint32
+	functions = {
+		"SFileCreateArchive": [
+			ctypes.c_char_p, dword, dword, ctypes.POINTER(handle)
+		],
+		"SFileCreateFile": [
+			handle, ctypes.c_char_p, ctypes.c_uint64, dword, dword, dword,
+			ctypes.POINTER(handle),
+		],
+		"SFileWriteFile": [handle, ctypes.c_char_p, dword, dword],
+		"SFileFinishFile": [handle],
+		"SFileCloseArchive": [handle],
+	}
+	for name, argtypes in functions.items():
+		function = getattr(library, name)
+		function.argtypes = argtypes
+		function.restype = ctypes.c_bool
+	return library
+
+
+def build_archive(
+	path, files, flags=MPQ_FILE_COMPRESS, compression=MPQ_COMPRESSION_ZLIB,
+	create_flags=CREATE_FLAGS
+):
+	"""
+	Writes the archive \a path holding \a files, a dict of names to contents,
+	with StormLib itself. Returns \a path.
+	"""
+	path = str(path)
+	if os.path.exists(path):
+		os.remove(path)
+	library = load_storm()
+	mpq = ctypes.c_void_p()
+	count = len(files) * 2 + 16
+	if not library.SFileCreateArchive(
+		os.fsencode(path), create_flags, count, ctypes.byref(mpq)
+	):
+		raise storm.error("Could not create %s" % (path))
+	try:
+		flags |= MPQ_FILE_REPLACEEXISTING
+		for name, data in files.items():
+			file = ctypes.c_void_p()
+			if not library.SFileCreateFile(
+				mpq, name.encode(), 0, len(data), 0, flags, ctypes.byref(file)
+			):
+				raise storm.error("Could not add %s to %s" % (name, path))
+			written = library.SFileWriteFile(file, data, len(data), compression)
+			if not library.SFileFinishFile(file) or not written:
+				raise storm.error("Could not write %s to %s" % (name, path))
+	finally:
+		library.SFileCloseArchive(mpq)
+	return path
+
+
+@pytest.fixture(scope="session")
+def files():
+	"""
+	Names and contents of the files of the sample archive
+	"""
+	rng = random.Random(1)
+	result = {
+		"Data\\File%03i.bin" % (i): make_content(rng, rng.randint(1, 64 << 10))
+		for i in range(64)
+	}
+	result["Data\\Empty.txt"] = b""
+	result["Data\\Sub\\Hello.txt"] = b"Hello, world!\n"
+	return result
+
+
+@pytest.fixture(scope="session")
+def archive_path(tmp_path_factory, files):
+	"""
+	Path of a sample archive holding \a files
+	"""
+	directory = str(tmp_path_factory.mktemp("archives"))
+	return build_archive(os.path.join(directory, "sample.MPQ"), files)
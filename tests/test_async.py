@@ -0,0 +1,87 @@
+import asyncio
+import select
+import sys
+
+import pytest
+
+import mpq
+from mpq import storm
+
+from .test_threads import run_threads
+
+
+def run(coroutine):
+	loop = asyncio.new_event_loop()
+	try:
+		return loop.run_until_complete(coroutine)
+	finally:
+		loop.close()
+
+
+@pytest.mark.skipif(sys.platform == "win32", reason="storm.Pool needs POSIX")
+def test_pool_errors(archive_path, files):
+	# Workers failing together must each report their own error
+	archive = storm.Archive(archive_path)
+	pool = storm.Pool()
+	expected = {}
+	for i, name in enumerate(sorted(files) * 4):
+		missing = "Missing\\%i.bin" % (i)
+		expected[pool.read(archive, missing)] = (storm.ERROR_FILE_NOT_FOUND, None)
+		expected[pool.read(archive, name)] = (0, files[name])
+	results = {}
+	while len(results) < len(expected):
+		select.select([pool.fileno()], [], [], 10)
+		for token, error, data in pool.collect():
+			results[token] = (error, data if not error else None)
+	pool.close()
+	assert results == expected
+
+
+@pytest.mark.parametrize("executor", [False, True])
+def test_read_async(archive_path, files, monkeypatch, executor):
+	if executor:
+		def unsupported():
+			raise NotImplementedError("storm.Pool is not supported on Windows")
+		monkeypatch.setattr(storm, "Pool", unsupported)
+	elif sys.platform == "win32":
+		pytest.skip("storm.Pool needs POSIX")
+
+	async def read_all(f):
+		names = sorted(files)
+		results = await f.read_many_async(names)
+		assert results == files
+		with pytest.raises(KeyError):
+			await f.read_async("Missing.bin")
+
+	with mpq.MPQFile(archive_path) as f:
+		run(read_all(f))
+
+
+def test_extract_async_executor(archive_path, files, monkeypatch, tmp_path):
+	def unsupported():
+		raise NotImplementedError("storm.Pool is not supported on Windows")
+	monkeypatch.setattr(storm, "Pool", unsupported)
+	path = str(tmp_path / "hello.txt")
+	with mpq.MPQFile(archive_path) as f:
+		run(f.extract_async("Data\\Sub\\Hello.txt", path))
+	with open(path, "rb") as f:
+		assert f.read() == files["Data\\Sub\\Hello.txt"]
+
+
+@pytest.mark.skipif(sys.platform == "win32", reason="storm.Pool needs POSIX")
+def test_read_async_loops(archive_path, files):
+	# Loops on several threads each complete their own requests
+	names = sorted(files)
+
+	async def read_all(f):
+		return await asyncio.wait_for(f.read_many_async(names), 30)
+
+	def read(index, f):
+		for i in range(4):
+			assert run(read_all(f)) == files
+
+	with mpq.MPQFile(archive_path) as f:
+		run_threads(4, read, f)
+		# The pools of the closed loops are shut down on the next request
+		run(read_all(f))
+		assert len(f._dispatchers) == 1
@@ -0,0 +1,32 @@
+import pytest
+
+from mpq import storm
+
+
+@pytest.mark.parametrize("threads", [1, 4])
+def test_build(archive_path, files, tmp_path, threads):
+	# Added, local and copied files all end up in the archive
+	local = tmp_path / "local.txt"
+	local.write_bytes(b"Local file\n")
+	path = str(tmp_path / "built.MPQ")
+	names = sorted(files)
+
+	builder = storm.ArchiveBuilder(path)
+	builder.add("Added\\Bytes.txt", b"Added bytes\n")
+	builder.add("Added\\Buffer.txt", memoryview(bytearray(b"Added buffer\n")))
+	builder.add_file("Added\\Local.txt", str(local))
+	with storm.Archive(archive_path) as source:
+		for name in names:
+			builder.copy(source, name)
+		builder.copy(source, names[0], "Copied\\Renamed.bin")
+		assert len(builder) == len(names) + 4
+		assert builder.build(threads) == len(names) + 4
+
+	expected = dict(files)
+	expected["Added\\Bytes.txt"] = b"Added bytes\n"
+	expected["Added\\Buffer.txt"] = b"Added buffer\n"
+	expected["Added\\Local.txt"] = b"Local file\n"
+	expected["Copied\\Renamed.bin"] = files[names[0]]
+	with storm.Archive(path) as archive:
+		assert archive.read_many(sorted(expected)) == expected
+		assert set(expected) <= set(archive.list().name)
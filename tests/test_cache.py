@@ -0,0 +1,84 @@
+import pytest
+
+import mpq
+from mpq import storm
+
+from .conftest import build_archive
+
+
+SIZE = 10000
+
+
+@pytest.fixture
+def small_files(tmp_path):
+	"""
+	Archive of three files of SIZE bytes
+	"""
+	files = {
+		"Cache\\%s.bin" % (name): name.encode() * SIZE
+		for name in ("a", "b", "c")
+	}
+	return build_archive(tmp_path / "cache.MPQ", files), files
+
+
+def counters(cache):
+	stats = cache.stats()
+	return stats["hits"], stats["misses"], stats["evictions"]
+
+
+def test_cache_read(archive_path, files):
+	cache = storm.Cache(16 << 20)
+	with mpq.MPQFile(archive_path, cache=cache) as f:
+		for name, data in sorted(files.items()):
+			assert f.read(name) == data
+			assert isinstance(f.read(name), bytes)
+			buffer = f.read_buffer(name)
+			assert isinstance(buffer, storm.Buffer)
+			assert bytes(buffer) == data
+	hits, misses, evictions = counters(cache)
+	assert misses == len(files)
+	assert hits == 2 * len(files)
+	assert evictions == 0
+	assert cache.stats()["entries"] == len(files)
+
+
+def test_cache_read_uncached(archive_path, files):
+	# Without a cache, both return bytes
+	name = "Data\\Sub\\Hello.txt"
+	with mpq.MPQFile(archive_path) as f:
+		assert f.read(name) == f.read_buffer(name) == files[name]
+
+
+def test_cache_eviction(small_files):
+	# The least recently used file goes first
+	path, files = small_files
+	a, b, c = sorted(files)
+	cache = storm.Cache(2 * SIZE + 1024)
+	with mpq.MPQFile(path, cache=cache) as f:
+		f.read(a)
+		f.read(b)
+		f.read(a)
+		assert counters(cache) == (1, 2, 0)
+		f.read(c)
+		assert counters(cache) == (1, 3, 1)
+		f.read(a)
+		assert counters(cache) == (2, 3, 1)
+		assert f.read(b) == files[b]
+		assert counters(cache) == (2, 4, 2)
+	stats = cache.stats()
+	assert stats["entries"] == 2
+	assert stats["size"] <= stats["capacity"]
+
+
+def test_cache_sectors(archive_path, files):
+	# Files above the limit are cached by sector, and read back in any range
+	cache = storm.Cache(16 << 20, 1024)
+	name = max(files, key=lambda name: len(files[name]))
+	data = files[name]
+	with mpq.MPQFile(archive_path, cache=cache) as f:
+		for start, size in [(0, 100), (5000, 20000), (len(data) - 10, 100)]:
+			with f.open(name) as file:
+				file.seek(start)
+				assert file.read(size) == data[start:start + size]
+		assert f.read(name) == data
+	assert cache.stats()["hits"] > 0
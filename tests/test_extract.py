@@ -0,0 +1,60 @@
+import os
+
+import pytest
+
+import mpq
+from mpq import storm
+
+
+def local_path(root, name):
+	return os.path.join(root, *name.split("\\"))
+
+
+def test_extract_all(archive_path, files, tmp_path):
+	root = str(tmp_path)
+	archive = storm.Archive(archive_path)
+	errors = archive.extract_all(root, sorted(files), 0, 4)
+	assert errors == {}
+	for name, data in files.items():
+		with open(local_path(root, name), "rb") as f:
+			assert f.read() == data
+
+
+def test_extract_all_errors(archive_path, files, tmp_path):
+	# Every worker fails in its own way, each file must get its own error
+	root = str(tmp_path)
+	names = sorted(files)
+	blocked = names[0]
+	os.makedirs(local_path(root, blocked))
+	missing = ["Missing\\File%03i.bin" % (i) for i in range(32)]
+	escaping = ["..\\Escape%03i.bin" % (i) for i in range(32)]
+
+	archive = storm.Archive(archive_path)
+	errors = archive.extract_all(root, names + missing + escaping, 0, 8)
+	assert set(errors) == {blocked} | set(missing) | set(escaping)
+	assert errors[blocked] not in (storm.ERROR_FILE_NOT_FOUND, 0)
+	for name in missing:
+		assert errors[name] == storm.ERROR_FILE_NOT_FOUND
+	for name in escaping:
+		assert errors[name] == storm.ERROR_INVALID_PARAMETER
+	for name in names[1:]:
+		with open(local_path(root, name), "rb") as f:
+			assert f.read() == files[name]
+
+
+def test_extract_missing(archive_path, tmp_path):
+	with mpq.MPQFile(archive_path) as f:
+		with pytest.raises(KeyError):
+			f.extract("Missing.bin", str(tmp_path))
+
+
+def test_extract_all_duplicates(archive_path, files, tmp_path):
+	# Each file is extracted once, however many times it is named
+	root = str(tmp_path)
+	names = sorted(files)
+	spellings = [name.replace("\\", "/").lower() for name in names]
+	with mpq.MPQFile(archive_path) as f:
+		assert f.extract_all(root, names + spellings + names) == {}
+	for name, data in files.items():
+		with open(local_path(root, name), "rb") as f:
+			assert f.read() == data
@@ -0,0 +1,20 @@
+import pytest
+
+import mpq
+
+
+@pytest.mark.parametrize("pattern, expected", [
+	("Data/*.txt", ["Data/Empty.txt"]),
+	("Data/**.txt", ["Data/Empty.txt", "Data/Sub/Hello.txt"]),
+	("Data/**/Hello.txt", ["Data/Sub/Hello.txt"]),
+	("Data/**/Empty.txt", ["Data/Empty.txt"]),
+	("**/Empty.txt", ["Data/Empty.txt"]),
+	("Data/**/**/Hello.txt", ["Data/Sub/Hello.txt"]),
+	("Data/Sub/**/Hello.txt", ["Data/Sub/Hello.txt"]),
+	("Data/S**/Hello.txt", ["Data/Sub/Hello.txt"]),
+	("Data**/Hello.txt", ["Data/Sub/Hello.txt"]),
+	("Data/**/Sub", []),
+])
+def test_glob(archive_path, pattern, expected):
+	with mpq.MPQFile(archive_path) as f:
+		assert f.glob(pattern) == expected
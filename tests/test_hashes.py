@@ -0,0 +1,157 @@
+import pytest
+
+from mpq import storm
+
+from .conftest import build_archive
+
+
+MASK = 0xFFFFFFFF
+HASH_ENTRY_FREE = 0xFFFFFFFF
+
+# Longer than the 0x108 bytes HashStringJenkins() looks at
+LONG_NAME = "Data\\" + "Long\\" * 60 + "Name.txt"
+
+
+def crypt_table():
+	seed = 0x00100001
+	table = [0] * 0x500
+	for i in range(0x100):
+		for j in range(5):
+			seed = (seed * 125 + 3) % 0x2AAAAB
+			high = (seed & 0xFFFF) << 16
+			seed = (seed * 125 + 3) % 0x2AAAAB
+			table[i + j * 0x100] = high | (seed & 0xFFFF)
+	return table
+
+
+CRYPT_TABLE = crypt_table()
+
+
+def normalize(name, upper):
+	data = name.encode().replace(b"/", b"\\")
+	return data.upper() if upper else data.lower()
+
+
+def hash_string(name, hash_type):
+	# StormLib's HashString()
+	seed1, seed2 = 0x7FED7FED, 0xEEEEEEEE
+	for c in normalize(name, True):
+		seed1 = (CRYPT_TABLE[(hash_type << 8) + c] ^ (seed1 + seed2)) & MASK
+		seed2 = (c + seed1 + seed2 + (seed2 << 5) + 3) & MASK
+	return seed1
+
+
+def rot(x, k):
+	return ((x << k) | (x >> (32 - k))) & MASK
+
+
+# Steps of hashlittle2(), as (x, y, z, k): x -= y; x ^= rot(y, k); y += z
+MIX = [
+	(0, 2, 1, 4), (1, 0, 2, 6), (2, 1, 0, 8),
+	(0, 2, 1, 16), (1, 0, 2, 19), (2, 1, 0, 4),
+]
+# and the final ones, as (x, y, k): x ^= y; x -= rot(y, k)
+FINAL = [
+	(2, 1, 14), (0, 2, 11), (1, 0, 25), (2, 1, 16),
+	(0, 2, 4), (1, 0, 14), (2, 1, 24),
+]
+
+
+def hash_jenkins(name):
+	# StormLib's HashStringJenkins(), hashlittle2() over at most 0x108 bytes
+	key = normalize(name, False)[:0x108]
+	v = [(0xDEADBEEF + len(key) + 2) & MASK] * 3
+	v[2] = (v[2] + 1) & MASK
+	if key:
+		key += b"\0" * (-len(key) % 12)
+		for offset in range(0, len(key), 12):
+			for i in range(3):
+				word = key[offset + 4 * i:offset + 4 * i + 4]
+				v[i] = (v[i] + int.from_bytes(word, "little")) & MASK
+			if offset + 12 < len(key):
+				for x, y, z, k in MIX:
+					v[x] = ((v[x] - v[y]) & MASK) ^ rot(v[y], k)
+					v[y] = (v[y] + v[z]) & MASK
+		for x, y, k in FINAL:
+			v[x] = ((v[x] ^ v[y]) - rot(v[y], k)) & MASK
+	return v[1] << 32 | v[2]
+
+
+def column(columns, name):
+	return memoryview(columns[name]).tolist()
+
+
+@pytest.fixture(scope="module", params=["v1", "v4"])
+def hashed_archive(request, tmp_path_factory, files):
+	"""
+	Archive of format 1, with a hash table, or 4, with a HET table too,
+	holding the sample files and LONG_NAME
+	"""
+	create_flags = storm.MPQ_CREATE_LISTFILE | storm.MPQ_CREATE_ATTRIBUTES
+	if request.param == "v4":
+		create_flags |= storm.MPQ_CREATE_ARCHIVE_V4
+	contents = dict(files)
+	contents[LONG_NAME] = b"long"
+	directory = tmp_path_factory.mktemp("hashes")
+	path = directory / ("%s.MPQ" % (request.param))
+	try:
+		build_archive(path, contents, create_flags=create_flags)
+	except storm.error:
+		# StormLib may refuse the long name
+		del contents[LONG_NAME]
+		path = directory / ("%s-short.MPQ" % (request.param))
+		build_archive(path, contents, create_flags=create_flags)
+	return storm.Archive(str(path))
+
+
+def test_hash_names_reference(hashed_archive):
+	# The hashes match StormLib's algorithms, also past 0x108 bytes
+	# The keys of the hash and block tables, as StormLib documents them
+	assert hash_string("(hash table)", 3) == 0xC3AF3770
+	assert hash_string("(block table)", 3) == 0xEC83B3A3
+	names = list(hashed_archive.list().name) + [LONG_NAME, "", "a/b"]
+	hashes = storm.hash_names(names)
+	for i, key in enumerate(["index", "name1", "name2"]):
+		expected = [hash_string(name, i) for name in names]
+		assert column(hashes, key) == expected
+	expected = [hash_jenkins(name) for name in names]
+	assert column(hashes, "jenkins") == expected
+
+
+def test_hash_names_archive(hashed_archive):
+	# The hashes are those StormLib files the listed names under
+	names = list(hashed_archive.list().name)
+	infos = [hashed_archive.stat(name) for name in names]
+	if not any(info.name_hash1 or info.name_hash2 for info in infos):
+		pytest.skip("StormLib does not report the name hashes")
+	hashes = {
+		key: column(storm.hash_names(names), key)
+		for key in ["index", "name1", "name2", "jenkins"]
+	}
+	tables = hashed_archive.tables()
+	table = {
+		key: column(tables.hash_table, key)
+		for key in ["name1", "name2", "block_index"]
+	}
+	size = len(table["name1"])
+	het = tables.het_header
+	if het:
+		bits = het["name_hash_bit_size"]
+		and_mask, or_mask = (1 << bits) - 1, 1 << (bits - 1)
+
+	for i, (name, info) in enumerate(zip(names, infos)):
+		assert hashes["name1"][i] == info.name_hash1, name
+		assert hashes["name2"][i] == info.name_hash2, name
+		if het:
+			jenkins = hashes["jenkins"][i]
+			assert jenkins & and_mask | or_mask == info.name_hash3, name
+
+		if not size:
+			continue
+		# The file is found probing from the index of its name
+		entry = hashes["index"][i] & (size - 1)
+		while entry != info.hash_index:
+			assert table["block_index"][entry] != HASH_ENTRY_FREE, name
+			entry = (entry + 1) & (size - 1)
+		assert table["name1"][entry] == info.name_hash1, name
+		assert table["name2"][entry] == info.name_hash2, name
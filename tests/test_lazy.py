@@ -0,0 +1,25 @@
+import mpq
+
+
+def calls(f, operation):
+	return f._archives[0].stats()["calls"].get(operation, 0)
+
+
+def test_lazy_read(archive_path, files, tmp_path):
+	# Known names are found without loading the listfile or listing files
+	name = "Data\\Sub\\Hello.txt"
+	with mpq.MPQFile(archive_path, lazy=True) as f:
+		assert name in f
+		assert "Data\\Missing.txt" not in f
+		assert f.read(name) == files[name]
+		with f.open(name) as file:
+			assert file.read() == files[name]
+		f.extract(name, str(tmp_path / "Hello.txt"))
+		assert calls(f, "load") == 0
+		assert calls(f, "list") == 0
+
+		# Listing files loads it
+		assert len(f.namelist()) >= len(files)
+		assert calls(f, "load") == 1
+		assert name in f
+		assert f.read(name) == files[name]
@@ -0,0 +1,63 @@
+import pytest
+
+import mpq
+
+from .conftest import build_archive
+
+
+BASE = {
+	"Data\\Base.txt": b"base",
+	"Data\\First.txt": b"first, unpatched",
+	"Data\\Second.txt": b"second, unpatched",
+}
+PATCHES = [
+	{"Data\\First.txt": b"first, patched once"},
+	{"Data\\Second.txt": b"second, patched twice"},
+]
+
+
+@pytest.fixture
+def patched(tmp_path):
+	"""
+	MPQFile on BASE, patched with each of PATCHES in turn
+	"""
+	f = mpq.MPQFile(build_archive(tmp_path / "base.MPQ", BASE))
+	for i, files in enumerate(PATCHES):
+		f.patch(build_archive(tmp_path / ("patch-%i.MPQ" % (i + 1)), files))
+	yield f
+	f.close()
+
+
+def expected():
+	files = dict(BASE)
+	for patch in PATCHES:
+		files.update(patch)
+	return files
+
+
+def test_patch_layer(patched):
+	assert patched.is_patched()
+	assert patched.patch_layer("Data\\Base.txt") == 0
+	assert patched.patch_layer("Data\\First.txt") == 1
+	assert patched.patch_layer("Data\\Second.txt") == 2
+	with pytest.raises(KeyError):
+		patched.patch_layer("Data\\Missing.txt")
+
+
+def test_read_patched(patched):
+	for name, data in expected().items():
+		assert patched.read(name, patched=True) == data
+
+
+def test_materialize(patched):
+	# Only the files a patch touches are read into memory
+	assert patched.materialize(threads=2) == 2
+	for name, data in expected().items():
+		assert patched.read(name, patched=True) == data
+
+
+def test_flatten(patched, tmp_path):
+	with patched.flatten(str(tmp_path / "flat.MPQ"), threads=2) as flat:
+		assert not flat.is_patched()
+		for name, data in expected().items():
+			assert flat.read(name) == data
@@ -0,0 +1,36 @@
+from array import array
+
+import pytest
+
+from mpq import storm
+
+from .test_threads import run_threads
+
+
+@pytest.mark.parametrize("threads", [1, 4])
+def test_read_many(archive_path, files, threads):
+	archive = storm.Archive(archive_path)
+	names = sorted(files)
+	assert archive.read_many(names, 0, threads) == files
+
+	arena = bytearray(sum(len(data) for data in files.values()))
+	table = archive.read_many(names, 0, threads, arena)
+	assert isinstance(table, array)
+	for i, name in enumerate(names):
+		offset, size = table[2 * i], table[2 * i + 1]
+		assert arena[offset:offset + size] == files[name]
+
+
+def test_read_many_missing_concurrently(archive_path, files):
+	# A missing file raises KeyError whatever other threads are doing
+	names = sorted(files)
+
+	def read(index):
+		archive = storm.Archive(archive_path)
+		for i in range(50):
+			missing = "Missing\\%i-%i.bin" % (index, i)
+			with pytest.raises(KeyError):
+				archive.read_many(names[:4] + [missing])
+			assert archive.read_many(names[i % len(names):][:2], 0, 2)
+
+	run_threads(8, read)
@@ -0,0 +1,92 @@
+import os
+import random
+
+import pytest
+
+from mpq import storm
+
+from .conftest import build_archive, make_content
+
+
+CODECS = [
+	("zlib", storm.MPQ_FILE_COMPRESS, storm.MPQ_COMPRESSION_ZLIB),
+	("bzip2", storm.MPQ_FILE_COMPRESS, storm.MPQ_COMPRESSION_BZIP2),
+	("pkware", storm.MPQ_FILE_COMPRESS, storm.MPQ_COMPRESSION_PKWARE),
+	("huffmann", storm.MPQ_FILE_COMPRESS, storm.MPQ_COMPRESSION_HUFFMANN),
+	("lzma", storm.MPQ_FILE_COMPRESS, storm.MPQ_COMPRESSION_LZMA),
+	("implode", storm.MPQ_FILE_IMPLODE, 0),
+	(
+		"crc", storm.MPQ_FILE_COMPRESS | storm.MPQ_FILE_SECTOR_CRC,
+		storm.MPQ_COMPRESSION_ZLIB,
+	),
+]
+
+
+@pytest.fixture(scope="module")
+def large_files():
+	"""
+	Files spanning many sectors, the last of them partial
+	"""
+	rng = random.Random(2)
+	return {
+		"Large\\%i.bin" % (i): make_content(rng, size)
+		for i, size in enumerate([(1 << 20) + 123, 300001, 4096 * 5])
+	}
+
+
+def read_range(archive, name, start, size):
+	with archive.open_file(name) as file:
+		file.seek(start)
+		return file.read(size)
+
+
+def check_sectors(archive, name):
+	# Parallel reads are only made on files StormLib split in sectors
+	if archive.stat(name).flags & storm.MPQ_FILE_SINGLE_UNIT:
+		pytest.skip("StormLib did not split the files in sectors")
+
+
+@pytest.mark.parametrize(
+	"flags, compression", [codec[1:] for codec in CODECS],
+	ids=[codec[0] for codec in CODECS],
+)
+def test_parallel_read(tmp_path, large_files, flags, compression):
+	# Sectors decompressed on several threads match StormLib's reads
+	path = build_archive(
+		tmp_path / "codec.MPQ", large_files, flags, compression
+	)
+	with storm.Archive(path) as archive:
+		for name, data in sorted(large_files.items()):
+			# Whole files, and ranges starting and ending within sectors
+			ranges = [(0, len(data)), (1000, len(data) - 3000)]
+			archive.parallel_read(0)
+			serial = [read_range(archive, name, *r) for r in ranges]
+			assert serial[0] == data
+			check_sectors(archive, name)
+
+			archive.parallel_read(1, 4)
+			before = archive.stats()["bytes_parallel"]
+			parallel = [read_range(archive, name, *r) for r in ranges]
+			read = archive.stats()["bytes_parallel"] - before
+			assert parallel == serial
+			if flags & storm.MPQ_FILE_SECTOR_CRC:
+				# Left to StormLib, which checks the CRCs
+				assert read == 0
+			else:
+				assert read == sum(size for start, size in ranges)
+
+
+def test_parallel_read_replaced(tmp_path, large_files):
+	# Parallel reads use the file the archive was opened from
+	path = build_archive(tmp_path / "base.MPQ", large_files)
+	other = build_archive(tmp_path / "other.MPQ", {
+		name: data[::-1] for name, data in large_files.items()
+	})
+	with storm.Archive(path) as archive:
+		archive.parallel_read(1)
+		os.rename(path, path + ".old")
+		os.rename(other, path)
+		for name, data in sorted(large_files.items()):
+			check_sectors(archive, name)
+			assert read_range(archive, name, 0, len(data)) == data
+		assert archive.stats()["bytes_parallel"] > 0
@@ -0,0 +1,64 @@
+import os
+
+import pytest
+
+import mpq
+from mpq import sidecar
+
+from .conftest import build_archive
+
+
+def touch(path):
+	st = os.stat(path)
+	os.utime(path, ns=(st.st_atime_ns, st.st_mtime_ns + 10 ** 9))
+
+
+def alter(path):
+	# Changes a byte of the hashed header, keeping the size and time
+	st = os.stat(path)
+	offset = min(st.st_size, sidecar.HEADER_SIZE) - 1
+	with open(path, "r+b") as f:
+		f.seek(offset)
+		byte = f.read(1)
+		f.seek(offset)
+		f.write(bytes([byte[0] ^ 0xFF]))
+	os.utime(path, ns=(st.st_atime_ns, st.st_mtime_ns))
+
+
+def replace(path):
+	other = build_archive(path + ".new", {"Other\\File.txt": b"other"})
+	os.replace(other, path)
+
+
+@pytest.fixture
+def indexed(tmp_path, files):
+	"""
+	Archive of \a files, and the sidecar index saved for it
+	"""
+	path = build_archive(tmp_path / "indexed.MPQ", files)
+	index = str(tmp_path / "indexed.idx")
+	with mpq.MPQFile(path) as f:
+		f.save_index(index)
+	return path, index
+
+
+def test_load_index(indexed, files):
+	path, index = indexed
+	with mpq.MPQFile(path) as f:
+		assert f.load_index(index)
+		assert sorted(f.namelist()) == sorted(
+			name.replace("\\", "/") for name in files
+		)
+		assert "Data\\Sub\\Hello.txt" in f
+		assert f.read("Data\\Sub\\Hello.txt") == files["Data\\Sub\\Hello.txt"]
+
+
+@pytest.mark.parametrize("change", [touch, alter, replace])
+def test_load_index_stale(indexed, change):
+	# Any change to the archive file invalidates its sidecar
+	path, index = indexed
+	with mpq.MPQFile(path) as f:
+		change(path)
+		assert sidecar.read(index, [path]) is None
+		assert not f.load_index(index, update=True)
+		assert f.load_index(index)
@@ -0,0 +1,43 @@
+import pytest
+
+from mpq import storm
+
+from .test_threads import run_threads
+
+
+def test_errors_concurrently(archive_path, files):
+	# Calls are counted with their own error, whatever other threads do
+	names = sorted(files)
+	archives = [storm.Archive(archive_path) for i in range(4)]
+	traced = {}
+
+	def trace(operation, archive, seconds, error):
+		traced.setdefault(id(archive), set()).add((operation, error))
+
+	def check(index):
+		# Even threads only read present files, odd ones open missing files
+		archive = archives[index]
+		for i in range(200):
+			if index % 2:
+				with pytest.raises(storm.error):
+					archive.open_file("Missing\\%i-%i.bin" % (index, i))
+			else:
+				with archive.open_file(names[i % len(names)]) as file:
+					file.read()
+
+	storm.set_trace(trace)
+	try:
+		run_threads(len(archives), check)
+	finally:
+		storm.set_trace(None)
+
+	for index, archive in enumerate(archives):
+		errors = archive.stats()["errors"]
+		if index % 2:
+			assert errors == {storm.ERROR_FILE_NOT_FOUND: 200}
+			assert traced[id(archive)] == {
+				("open_file", storm.ERROR_FILE_NOT_FOUND)
+			}
+		else:
+			assert errors == {}
+			assert {error for op, error in traced[id(archive)]} == {0}
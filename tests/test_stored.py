@@ -0,0 +1,69 @@
+import os
+
+import pytest
+
+from mpq import storm
+
+from .conftest import build_archive
+
+
+@pytest.fixture(params=[0, storm.MPQ_FILE_COMPRESS], ids=["stored", "zlib"])
+def flags(request):
+	return request.param
+
+
+def read_file(archive, name):
+	with archive.open_file(name) as file:
+		return file.read()
+
+
+def read_local(path):
+	with open(path, "rb") as f:
+		return f.read()
+
+
+def check_copied(archive, flags, files):
+	# Only files stored as is are copied without StormLib
+	copied = archive.stats()["bytes_copied"]
+	if flags & storm.MPQ_FILE_COMPRESS:
+		assert copied == 0
+	else:
+		assert copied == sum(len(data) for data in files.values())
+
+
+def test_extract(tmp_path, files, flags):
+	# Copied files match StormLib's reads, byte for byte
+	path = build_archive(tmp_path / "base.MPQ", files, flags)
+	with storm.Archive(path) as archive:
+		for i, (name, data) in enumerate(sorted(files.items())):
+			local = str(tmp_path / ("%i.bin" % (i)))
+			archive.extract(name, local)
+			assert read_local(local) == read_file(archive, name) == data
+		check_copied(archive, flags, files)
+
+
+def test_extract_all(tmp_path, files, flags):
+	path = build_archive(tmp_path / "base.MPQ", files, flags)
+	root = tmp_path / "out"
+	with storm.Archive(path) as archive:
+		assert archive.extract_all(str(root), sorted(files), 0, 4) == {}
+		for name, data in files.items():
+			local = os.path.join(str(root), *name.split("\\"))
+			assert read_local(local) == read_file(archive, name) == data
+		check_copied(archive, flags, files)
+
+
+def test_extract_replaced(tmp_path, files, flags):
+	# Copies use the file the archive was opened from
+	path = build_archive(tmp_path / "base.MPQ", files, flags)
+	other = build_archive(tmp_path / "other.MPQ", {
+		name: data[::-1] for name, data in files.items()
+	}, flags)
+	with storm.Archive(path) as archive:
+		os.rename(path, path + ".old")
+		os.rename(other, path)
+		for i, (name, data) in enumerate(sorted(files.items())):
+			local = str(tmp_path / ("%i.bin" % (i)))
+			archive.extract(name, local)
+			assert read_local(local) == data
+		check_copied(archive, flags, files)
@@ -0,0 +1,65 @@
+import threading
+
+from mpq import storm
+
+
+def run_threads(count, target, *args):
+	"""
+	Runs \a target(index, *args) on \a count threads, re-raising the first error
+	"""
+	errors = []
+
+	def run(index):
+		try:
+			target(index, *args)
+		except BaseException as e:
+			errors.append(e)
+
+	threads = [threading.Thread(target=run, args=(i, )) for i in range(count)]
+	for thread in threads:
+		thread.start()
+	for thread in threads:
+		thread.join()
+	if errors:
+		raise errors[0]
+
+
+def find(mpq, mask):
+	"""
+	Returns the names of the files matching \a mask in \a mpq
+	"""
+	handle, name = storm.SFileFindFirstFile(mpq, "", mask)
+	names = [name]
+	while True:
+		try:
+			names.append(storm.SFileFindNextFile(handle))
+		except storm.NoMoreFilesError:
+			break
+	storm.SFileFindClose(handle)
+	return names
+
+
+def test_has_file_missing_concurrently(archive_path, files):
+	# Failing lookups on other threads must not turn a missing file into an error
+	names = sorted(files)
+
+	def lookup(index):
+		mpq = storm.SFileOpenArchive(archive_path, 0, storm.MPQ_OPEN_READ_ONLY)
+		for i in range(2000):
+			assert storm.SFileHasFile(mpq, names[i % len(names)])
+			assert not storm.SFileHasFile(mpq, "Missing\\%i-%i.bin" % (index, i))
+		storm.SFileCloseArchive(mpq)
+
+	run_threads(8, lookup)
+
+
+def test_find_concurrently(archive_path, files):
+	# The end of a search is told from its result, not from the last error
+	def search(index):
+		mpq = storm.SFileOpenArchive(archive_path, 0, storm.MPQ_OPEN_READ_ONLY)
+		for i in range(50):
+			assert not storm.SFileHasFile(mpq, "Missing\\%i.bin" % (i))
+			assert set(files) <= set(find(mpq, "Data\\*"))
+		storm.SFileCloseArchive(mpq)
+
+	run_threads(8, search)